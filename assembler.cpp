@@ -11,52 +11,37 @@ using namespace Chip8;
 
 int main(int argc, char** argv)
 {
-    std::filesystem::path filename { argv[1] }; 
+    if (argc < 2) {
+	std::cerr << "Usage: " << argv[0] << " <source> [-g]\n"
+		  << "  -g  also write a .sym file mapping addresses to source lines\n";
+	return 1;
+    }
+
+    std::filesystem::path filename { argv[1] };
+    const bool write_symbols = argc > 2 && std::string(argv[2]) == "-g";
 
     std::ifstream inputfile;
     std::ofstream outputfile;
     inputfile.open(filename.c_str(), std::ios::in);
 
-    filename.replace_extension(".rom");
-    outputfile.open(filename.c_str(), std::ios::binary | std::ios::out);
-
     if (!inputfile) {
 	std::cerr << "Could not open file\n";
 	return 1;
     }
 
-    size_t addr = 0x200;
-    Instruction instruction; 
-
-    std::string line;
-
-    std::unordered_map<std::string,size_t> labels;
-    std::vector<std::string> lines;
-
-    while (getline(inputfile, line)) {
-	// Detect comments
-	
-	if (line[line.find_first_not_of(' ')] == '#') {
-	    continue;
-	}
-	else if (line[line.find_first_not_of(' ')] == ':') {
-	    labels.insert({line, addr}); 
-	} else {
-	    lines.push_back(line);
-	    addr += 2;
-	}
-    }
+    const auto program = assemble_program(inputfile, filename.filename().string());
+    inputfile.close();
 
-    for (const auto& line : lines) {
-	Instruction instruction = assemble(line, labels);
-	
-	uint16_t rev_endian = ((instruction & 0xFF00) >> 8) | ((instruction & 0x00FF) << 8);
+    filename.replace_extension(".rom");
+    outputfile.open(filename.c_str(), std::ios::binary | std::ios::out);
+    outputfile.write(reinterpret_cast<const char*>(program.bytes.data()), program.bytes.size());
+    outputfile.close();
 
-	outputfile.write(reinterpret_cast<const char*>(&rev_endian), sizeof(Instruction));
+    if (write_symbols) {
+	filename.replace_extension(".sym");
+	std::ofstream symbolfile(filename.c_str());
+	program.symbols.write(symbolfile);
     }
 
-    inputfile.close();
-    outputfile.close();
-	
     return 0;
 }
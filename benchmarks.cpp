@@ -0,0 +1,591 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+#include "disassembly.h"
+#include "env.h"
+#include "explorer.h"
+#include "movie.h"
+#include "netplay.h"
+#include "perf_counters.h"
+#include "rewind.h"
+#include "savestate.h"
+#include "server.h"
+#include "trace.h"
+
+using namespace Chip8;
+
+// Reproducible microbenchmarks. Every benchmark is calibrated until one
+// sample takes at least min_time / samples, then the median of the
+// samples is reported. Results go to stdout as json. With --perf the
+// samples are also measured with hardware counters, reported per item
+// (the emulated instruction, for interpret and frame benchmarks).
+
+namespace {
+
+    template<typename T>
+    inline void do_not_optimize(const T& value)
+    {
+	asm volatile("" : : "r,m"(value) : "memory");
+    }
+
+    struct Result {
+	std::string name;
+	uint64_t iterations;
+	uint64_t items_per_iteration;
+	double ns_per_iteration;
+	double min_ns_per_iteration;
+	// Over all samples, when counters are enabled
+	PerfCounters::Sample perf;
+	uint64_t perf_items = 0;
+    };
+
+    class Harness {
+	public:
+	    Harness(std::string filter, double min_time) : filter{std::move(filter)}, min_time{min_time} {}
+
+	    bool selected(const std::string& name) const { return name.find(filter) != std::string::npos; }
+
+	    void enable_perf()
+	    {
+		perf = std::make_unique<PerfCounters>();
+		if (!perf->available()) {
+		    std::fprintf(stderr, "Hardware counters unavailable (%s), see /proc/sys/kernel/perf_event_paranoid\n",
+			    perf->error().c_str());
+		    perf.reset();
+		}
+	    }
+
+	    // fn(iterations) runs the measured code that many times. Setup
+	    // belongs outside of the loop in fn.
+	    void run(const std::string& name, uint64_t items_per_iteration, const std::function<void(uint64_t)>& fn)
+	    {
+		if (!selected(name))
+		    return;
+
+		constexpr int samples = 5;
+		const double sample_time = min_time / samples;
+
+		uint64_t iterations = 1;
+		while (time(fn, iterations) < sample_time && iterations < (1ull << 40))
+		    iterations *= 2;
+
+		std::vector<double> times;
+		if (perf)
+		    perf->start();
+		for (int i=0; i<samples; ++i)
+		    times.push_back(time(fn, iterations) / iterations * 1e9);
+		const auto counters = perf ? perf->stop() : PerfCounters::Sample{};
+		std::sort(times.begin(), times.end());
+
+		Result result{name, iterations, items_per_iteration, times[samples/2], times[0], counters,
+		    samples * iterations * items_per_iteration};
+		std::fprintf(stderr, "%-40s %14.1f ns %14.2f Mitems/s", name.c_str(), result.ns_per_iteration,
+			items_per_iteration / result.ns_per_iteration * 1e3);
+		if (perf) {
+		    const double ipc = ratio(result.perf, PerfCounters::Instructions, PerfCounters::Cycles);
+		    std::fprintf(stderr, " %6.2f IPC %8.3f br-miss/item %8.3f L1d-miss/item", ipc,
+			    per_item(result, PerfCounters::BranchMisses), per_item(result, PerfCounters::L1dMisses));
+		}
+		std::fprintf(stderr, "\n");
+		results.push_back(std::move(result));
+	    }
+
+	    void write_json(std::ostream& out) const
+	    {
+		out << "{\n  \"context\": {\"compiler\": \"" << __VERSION__ << "\"";
+#ifdef NDEBUG
+		out << ", \"ndebug\": true";
+#else
+		out << ", \"ndebug\": false";
+#endif
+		out << ", \"perf\": " << (perf ? "true" : "false");
+		out << "},\n  \"benchmarks\": [\n";
+		for (size_t i=0; i<results.size(); ++i) {
+		    const auto& r = results[i];
+		    out << "    {\"name\": \"" << r.name << "\""
+			<< ", \"iterations\": " << r.iterations
+			<< ", \"ns_per_iteration\": " << r.ns_per_iteration
+			<< ", \"min_ns_per_iteration\": " << r.min_ns_per_iteration
+			<< ", \"items_per_second\": " << r.items_per_iteration / r.ns_per_iteration * 1e9;
+		    if (perf)
+			write_perf(out, r);
+		    out << "}" << (i+1 < results.size() ? "," : "") << '\n';
+		}
+		out << "  ]\n}\n";
+	    }
+
+	private:
+	    // NaN for counters the kernel did not give us, written as null
+	    static double ratio(const PerfCounters::Sample& sample, PerfCounters::Counter a, PerfCounters::Counter b)
+	    {
+		if (!sample.valid[a] || !sample.valid[b] || sample.values[b] == 0)
+		    return std::nan("");
+		return static_cast<double>(sample.values[a]) / sample.values[b];
+	    }
+
+	    static double per_item(const Result& r, PerfCounters::Counter counter)
+	    {
+		if (!r.perf.valid[counter] || r.perf_items == 0)
+		    return std::nan("");
+		return static_cast<double>(r.perf.values[counter]) / r.perf_items;
+	    }
+
+	    static void write_number(std::ostream& out, double value)
+	    {
+		if (std::isnan(value))
+		    out << "null";
+		else
+		    out << value;
+	    }
+
+	    static void write_perf(std::ostream& out, const Result& r)
+	    {
+		out << ", \"perf\": {";
+		for (size_t c=0; c<PerfCounters::Count; ++c) {
+		    const auto counter = static_cast<PerfCounters::Counter>(c);
+		    out << '"' << PerfCounters::name(counter) << "_per_item\": ";
+		    write_number(out, per_item(r, counter));
+		    out << ", ";
+		}
+		out << "\"ipc\": ";
+		write_number(out, ratio(r.perf, PerfCounters::Instructions, PerfCounters::Cycles));
+		out << '}';
+	    }
+
+	    static double time(const std::function<void(uint64_t)>& fn, uint64_t iterations)
+	    {
+		const auto start = std::chrono::steady_clock::now();
+		fn(iterations);
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		return elapsed.count();
+	    }
+
+	    std::string filter;
+	    double min_time;
+	    std::unique_ptr<PerfCounters> perf;
+	    std::vector<Result> results;
+    };
+
+
+    // Instructions grouped by what they exercise in interpret()
+    struct OpcodeClass {
+	const char* name;
+	std::vector<Instruction> instructions;
+    };
+
+    const std::vector<OpcodeClass> opcode_classes = {
+	{"flow",   {0x2300, 0x00EE, 0x1300, 0xB300}},
+	{"skip",   {0x3012, 0x4012, 0x5010, 0x9010, 0xE09E, 0xE0A1}},
+	{"alu",    {0x7105, 0x8010, 0x8011, 0x8012, 0x8013, 0x8014, 0x8015, 0x8016, 0x8017, 0x801E}},
+	{"load",   {0x6123, 0xA300, 0xF007, 0xF115, 0xF118, 0xF11E, 0xF129}},
+	{"memory", {0xF333, 0xF755, 0xF765}},
+	{"random", {0xC1FF, 0xC20F}},
+	{"draw",   {0xD015}},
+	{"clear",  {0x00E0}},
+    };
+
+    std::vector<uint8_t> random_rom(size_t size)
+    {
+	std::mt19937 mt(42);
+	std::vector<uint8_t> rom(size);
+	for (auto& byte : rom)
+	    byte = mt() & 0xFF;
+	return rom;
+    }
+
+    // Every instruction form, repeated until the program is lines long
+    std::string large_source(size_t lines)
+    {
+	std::stringstream source;
+	source << ":START:\n";
+	for (size_t i=0; i<lines; ++i) {
+	    const auto opcode = static_cast<Opcode>(1 + i % (opcode_count-1));
+	    char text[32];
+	    const auto length = disassemble(get_info(opcode).base | (i % 3 == 0 ? 0x0123 : 0), text, sizeof(text));
+	    source << std::string_view(text, length) << "  # line " << i << '\n';
+	}
+	source << "JP :START:\n";
+	return source.str();
+    }
+
+    Program assemble_file(const std::filesystem::path& path)
+    {
+	std::ifstream in(path);
+	if (!in)
+	    throw std::runtime_error("Could not open " + path.string());
+	return assemble_program(in, path.filename().string());
+    }
+
+}
+
+int main(int argc, char** argv)
+{
+    std::string filter;
+    std::string json_output;
+    double min_time = 0.5;
+    bool use_perf = false;
+    for (int i=1; i<argc; ++i) {
+	const std::string arg = argv[i];
+	if (arg == "--filter" && i+1 < argc)
+	    filter = argv[++i];
+	else if (arg == "--json" && i+1 < argc)
+	    json_output = argv[++i];
+	else if (arg == "--min-time" && i+1 < argc)
+	    min_time = std::stod(argv[++i]);
+	else if (arg == "--perf")
+	    use_perf = true;
+	else {
+	    std::cerr << "Usage: " << argv[0] << " [--filter substring] [--json file] [--min-time seconds] [--perf]\n";
+	    return 1;
+	}
+    }
+
+    Harness harness(filter, min_time);
+    if (use_perf)
+	harness.enable_perf();
+
+    for (const auto& opcode_class : opcode_classes) {
+	harness.run(std::string("interpret/") + opcode_class.name, opcode_class.instructions.size(), [&](uint64_t iterations) {
+	    Chip8State m;
+	    m.seed(1);
+	    m.set_I_register(0x300);
+	    for (uint64_t i=0; i<iterations; ++i) {
+		for (const auto instruction : opcode_class.instructions)
+		    m.interpret(instruction);
+	    }
+	    do_not_optimize(m.get_register(0xF));
+	});
+    }
+
+    // Sprite from the font, at a position where it is fully visible or clipped
+    for (const auto& [x, y, height] : {std::tuple{8, 8, 1}, {8, 8, 5}, {8, 8, 15}, {60, 28, 15}}) {
+	const auto name = "drw/x" + std::to_string(x) + "_y" + std::to_string(y) + "_h" + std::to_string(height);
+	harness.run(name, 1, [&, x=x, y=y, height=height](uint64_t iterations) {
+	    Chip8State m;
+	    m.set_register(0, x);
+	    m.set_register(1, y);
+	    m.set_I_register(0x000);
+	    const Instruction instruction = 0xD010 | height;
+	    for (uint64_t i=0; i<iterations; ++i)
+		m.interpret(instruction);
+	    do_not_optimize(m.get_register(0xF));
+	});
+    }
+
+    harness.run("clear_display", 1, [](uint64_t iterations) {
+	Chip8State m;
+	for (uint64_t i=0; i<iterations; ++i) {
+	    m.clear_display();
+	    do_not_optimize(m);
+	}
+    });
+
+    const auto rom = random_rom(Chip8State::memory_size - Chip8State::program_start);
+    const auto rom_path = std::filesystem::temp_directory_path() / "chip8_benchmark.rom";
+    {
+	std::ofstream out(rom_path, std::ios::binary);
+	out.write(reinterpret_cast<const char*>(rom.data()), rom.size());
+    }
+    harness.run("load_file/3584", rom.size(), [&](uint64_t iterations) {
+	Chip8State m;
+	for (uint64_t i=0; i<iterations; ++i) {
+	    m.load_file(rom_path.string());
+	    do_not_optimize(m.get_memory(0x200));
+	}
+    });
+
+    const auto source = large_source(1790);
+    harness.run("assemble_program/1790_lines", 1790, [&](uint64_t iterations) {
+	for (uint64_t i=0; i<iterations; ++i) {
+	    std::istringstream in(source);
+	    const auto program = assemble_program(in);
+	    do_not_optimize(program.bytes.data());
+	}
+    });
+
+    harness.run("assemble/single", 1, [](uint64_t iterations) {
+	for (uint64_t i=0; i<iterations; ++i)
+	    do_not_optimize(assemble("DRW V3, V4, 10"));
+    });
+
+    harness.run("disassemble/buffer_3584", rom.size()/2, [&](uint64_t iterations) {
+	char buffer[32];
+	for (uint64_t i=0; i<iterations; ++i) {
+	    for (size_t addr=0; addr+1<rom.size(); addr+=2) {
+		const Instruction instruction = (rom[addr] << 8) | rom[addr+1];
+		do_not_optimize(disassemble(instruction, buffer, sizeof(buffer)));
+	    }
+	}
+    });
+
+    harness.run("disassemble/analyse_3584", rom.size(), [&](uint64_t iterations) {
+	for (uint64_t i=0; i<iterations; ++i) {
+	    const auto disassembly = analyse(rom);
+	    do_not_optimize(disassembly.kinds.data());
+	}
+    });
+
+    harness.run("disassemble/source_3584", rom.size(), [&](uint64_t iterations) {
+	const auto disassembly = analyse(rom);
+	for (uint64_t i=0; i<iterations; ++i) {
+	    std::ostringstream out;
+	    write_source(out, rom, disassembly);
+	    do_not_optimize(out.tellp());
+	}
+    });
+
+    {
+	const auto program = assemble_file(std::filesystem::path(CHIP8_ROM_DIR) / "bounce.asm");
+	Chip8State m;
+	m.load_rom(program.bytes);
+	m.run_frame(1000);
+	const auto snapshot = m.snapshot();
+
+	harness.run("state/snapshot_restore", 1, [&](uint64_t iterations) {
+	    Chip8State other;
+	    for (uint64_t i=0; i<iterations; ++i) {
+		other.restore(snapshot);
+		do_not_optimize(other);
+	    }
+	});
+
+	harness.run("state/fork", 1, [&](uint64_t iterations) {
+	    for (uint64_t i=0; i<iterations; ++i) {
+		auto copy = m.fork();
+		do_not_optimize(copy);
+	    }
+	});
+
+	harness.run("state/fingerprint", 1, [&](uint64_t iterations) {
+	    for (uint64_t i=0; i<iterations; ++i)
+		do_not_optimize(m.fingerprint());
+	});
+
+	// One thread, so the number is per core
+	ExploreOptions options;
+	options.max_depth = 3;
+	options.threads = 1;
+	const auto states = explore(m, options).states;
+	harness.run("explore/bounce_3_frames", states, [&](uint64_t iterations) {
+	    for (uint64_t i=0; i<iterations; ++i)
+		do_not_optimize(explore(m, options).states);
+	});
+
+	harness.run("state/save_delta", 1, [&](uint64_t iterations) {
+	    for (uint64_t i=0; i<iterations; ++i)
+		do_not_optimize(save_state(snapshot, program.bytes).size());
+	});
+
+	const auto saved = save_state(snapshot, program.bytes);
+	harness.run("state/load_delta", 1, [&](uint64_t iterations) {
+	    for (uint64_t i=0; i<iterations; ++i)
+		do_not_optimize(load_state(saved, program.bytes).program_counter);
+	});
+    }
+
+    // Capture cost per frame, and how much ten minutes at 60 fps need
+    for (const auto* name : {"maze", "bounce"}) {
+	const auto program = assemble_file(std::filesystem::path(CHIP8_ROM_DIR) / (std::string(name) + ".asm"));
+	harness.run(std::string("rewind/frame_and_push_") + name, 1, [&](uint64_t iterations) {
+	    Chip8State m;
+	    m.load_rom(program.bytes);
+	    RewindBuffer history;
+	    for (uint64_t i=0; i<iterations; ++i) {
+		m.run_frame(10);
+		history.push(m.snapshot());
+	    }
+	    do_not_optimize(history.frames());
+	});
+
+	if (!harness.selected(std::string("rewind/ten_minutes_") + name))
+	    continue;
+	Chip8State m;
+	m.load_rom(program.bytes);
+	RewindBuffer history(64<<20);
+	for (int i=0; i<10*60*60; ++i) {
+	    m.run_frame(10);
+	    history.push(m.snapshot());
+	}
+	std::fprintf(stderr, "rewind/ten_minutes_%s: %zu bytes\n", name, history.bytes_used());
+    }
+
+    // Ten minutes at 60 fps, checking the display after every frame
+    {
+	const auto program = assemble_file(std::filesystem::path(CHIP8_ROM_DIR) / "maze.asm");
+	Movie movie;
+	movie.seed = 1;
+	movie.instructions_per_frame = 10;
+	movie.rom_hash = rom_hash(program.bytes);
+	Chip8State m;
+	m.seed(movie.seed);
+	m.load_rom(program.bytes);
+	for (int frame=0; frame<10*60*60; ++frame) {
+	    movie.keys.push_back(frame / 30 % 3 == 0 ? 1 << 5 : 0);
+	    m.set_keyboard(movie.keys.back());
+	    m.run_frame(movie.instructions_per_frame);
+	    movie.display_hashes.push_back(m.display_hash());
+	}
+
+	harness.run("replay/ten_minutes_maze", movie.keys.size(), [&](uint64_t iterations) {
+	    Chip8State other;
+	    for (uint64_t i=0; i<iterations; ++i)
+		do_not_optimize(replay(movie, program.bytes, other).frames);
+	});
+    }
+
+    // Whole frames of the bundled programs, at 10 instructions per frame
+    for (const auto* name : {"maze", "counter", "bounce"}) {
+	const auto program = assemble_file(std::filesystem::path(CHIP8_ROM_DIR) / (std::string(name) + ".asm"));
+	harness.run(std::string("frame/") + name, 10, [&](uint64_t iterations) {
+	    Chip8State m;
+	    m.seed(1);
+	    m.load_rom(program.bytes);
+	    for (uint64_t i=0; i<iterations; ++i)
+		m.run_frame(10);
+	    do_not_optimize(m.get_program_counter());
+	});
+    }
+
+    // A frame plus two frames of run-ahead, as the runner does with --run-ahead 2
+    {
+	const auto program = assemble_file(std::filesystem::path(CHIP8_ROM_DIR) / "bounce.asm");
+	harness.run("frame/bounce_run_ahead_2", 10, [&](uint64_t iterations) {
+	    Chip8State m;
+	    m.seed(1);
+	    m.load_rom(program.bytes);
+	    uint64_t hash = 0;
+	    for (uint64_t i=0; i<iterations; ++i) {
+		m.run_frame(10);
+		m.run_ahead(2, 10, [&] { hash ^= m.display_hash(); });
+	    }
+	    do_not_optimize(hash);
+	});
+    }
+
+    // Netplay at its worst: every remote frame arrives eight frames late
+    // and mispredicted, so every frame rolls back and runs nine frames
+    {
+	const auto program = assemble_file(std::filesystem::path(CHIP8_ROM_DIR) / "bounce.asm");
+	harness.run("netplay/rollback_8_frames", 1, [&](uint64_t iterations) {
+	    Chip8State m;
+	    m.seed(1);
+	    m.load_rom(program.bytes);
+	    RollbackSession session(m, 10);
+	    while (session.can_advance())
+		session.advance(0);
+	    for (uint64_t i=0; i<iterations; ++i) {
+		const auto frame = session.confirmed();
+		session.receive_remote(frame, frame % 2 ? 0x0001 : 0x0002);
+		session.advance(0);
+	    }
+	    do_not_optimize(session.resimulated_frames());
+	});
+    }
+
+    // One server tick with a thousand clients of bounce, each reading
+    // its deltas, per session
+    if (harness.selected("server/tick_1000_sessions")) {
+	const auto program = assemble_file(std::filesystem::path(CHIP8_ROM_DIR) / "bounce.asm");
+	const auto path = (std::filesystem::temp_directory_path() / "chip8_benchmark.sock").string();
+	constexpr size_t sessions = 1000;
+	SessionServer server(path);
+	std::vector<std::unique_ptr<SessionClient>> clients;
+	for (size_t i=0; i<sessions; ++i) {
+	    clients.push_back(std::make_unique<SessionClient>(path));
+	    clients.back()->send_rom(program.bytes, i);
+	}
+	while (server.sessions() < sessions || server.frames_sent() < sessions) {
+	    server.poll(10);
+	    server.tick();
+	}
+	harness.run("server/tick_1000_sessions", sessions, [&](uint64_t iterations) {
+	    for (uint64_t i=0; i<iterations; ++i) {
+		server.tick();
+		for (auto& client : clients)
+		    client->receive();
+	    }
+	});
+    }
+
+    // A batch step of bounce envs on one thread, per env frame
+    {
+	const auto program = assemble_file(std::filesystem::path(CHIP8_ROM_DIR) / "bounce.asm");
+	for (const auto format : {ObservationFormat::bits, ObservationFormat::bytes}) {
+	    EnvOptions options;
+	    options.rewards.push_back({0x300, 2});
+	    options.max_frames = 1000;
+	    options.format = format;
+	    options.threads = 1;
+	    VectorEnv envs(program.bytes, 256, options);
+	    std::vector<uint8_t> observations(envs.size() * envs.observation_size());
+	    std::vector<uint16_t> actions(envs.size());
+	    std::vector<float> rewards(envs.size());
+	    std::vector<uint8_t> dones(envs.size());
+	    envs.reset(observations.data());
+	    const std::string name = format == ObservationFormat::bits ? "env/step_256_bits" : "env/step_256_bytes";
+	    harness.run(name, envs.size(), [&](uint64_t iterations) {
+		for (uint64_t i=0; i<iterations; ++i) {
+		    actions[i % actions.size()] ^= 1 << 4;
+		    envs.step(actions.data(), rewards.data(), dones.data(), observations.data());
+		}
+		do_not_optimize(observations[0]);
+	    });
+	}
+    }
+
+    // The undo log the runner keeps for stepping backwards
+    {
+	const auto program = assemble_file(std::filesystem::path(CHIP8_ROM_DIR) / "bounce.asm");
+	harness.run("frame/bounce_undo", 10, [&](uint64_t iterations) {
+	    UndoLog log;
+	    Chip8State m;
+	    m.seed(1);
+	    m.load_rom(program.bytes);
+	    m.set_undo_log(&log);
+	    for (uint64_t i=0; i<iterations; ++i)
+		m.run_frame(10);
+	    do_not_optimize(log.records());
+	});
+    }
+
+#ifdef CHIP8_TRACE
+    {
+	const auto program = assemble_file(std::filesystem::path(CHIP8_ROM_DIR) / "bounce.asm");
+	const auto trace_path = std::filesystem::temp_directory_path() / "chip8_benchmark.trace";
+	harness.run("frame/bounce_traced", 10, [&](uint64_t iterations) {
+	    Tracer tracer(trace_path.string(), 1<<14);
+	    Chip8State m;
+	    m.seed(1);
+	    m.load_rom(program.bytes);
+	    m.set_observer(&tracer);
+	    for (uint64_t i=0; i<iterations; ++i)
+		m.run_frame(10);
+	    do_not_optimize(tracer.count());
+	});
+	std::filesystem::remove(trace_path);
+    }
+#endif
+
+    std::filesystem::remove(rom_path);
+
+    if (json_output.empty()) {
+	harness.write_json(std::cout);
+    } else {
+	std::ofstream out(json_output);
+	harness.write_json(out);
+    }
+
+    return 0;
+}
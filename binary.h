@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace Chip8 {
+
+    // Little endian helpers shared by the binary file formats
+
+    inline void put_varint(std::vector<uint8_t>& out, uint64_t value)
+    {
+	while (value >= 0x80) {
+	    out.push_back(0x80 | (value & 0x7F));
+	    value >>= 7;
+	}
+	out.push_back(value);
+    }
+
+    template<typename T>
+    void put(std::vector<uint8_t>& out, T value)
+    {
+	for (size_t i=0; i<sizeof(T); ++i)
+	    out.push_back(static_cast<uint64_t>(value) >> (8*i));
+    }
+
+    // Bounds checked, throws std::runtime_error("Truncated " + what)
+    class Reader {
+	public:
+	    Reader(const uint8_t* data, size_t size, const char* what="data") : data{data}, size{size}, what{what} {}
+
+	    template<typename T>
+	    T get()
+	    {
+		need(sizeof(T));
+		uint64_t value = 0;
+		for (size_t i=0; i<sizeof(T); ++i)
+		    value |= static_cast<uint64_t>(data[pos++]) << (8*i);
+		return static_cast<T>(value);
+	    }
+
+	    uint64_t get_varint()
+	    {
+		uint64_t value = 0;
+		for (int shift=0; shift<64; shift+=7) {
+		    const auto byte = get<uint8_t>();
+		    value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+		    if (!(byte & 0x80))
+			return value;
+		}
+		throw std::runtime_error(std::string("Malformed varint in ") + what);
+	    }
+
+	    const uint8_t* take(size_t n)
+	    {
+		need(n);
+		pos += n;
+		return data + pos - n;
+	    }
+
+	    const uint8_t* rest() const { return data + pos; }
+	    size_t remaining() const { return size - pos; }
+	    void skip(size_t n) { need(n); pos += n; }
+
+	private:
+	    void need(size_t n) const
+	    {
+		if (size - pos < n)
+		    throw std::runtime_error(std::string("Truncated ") + what);
+	    }
+
+	    const uint8_t* data;
+	    size_t size;
+	    const char* what;
+	    size_t pos = 0;
+    };
+
+}
@@ -5,42 +5,16 @@
 #include <string>
 #include <sstream>
 #include <iostream>
-#include <iomanip>
 #include <fstream>
-#include <thread>
-#include <chrono>
+#include <charconv>
+#include <cstring>
+#include <algorithm>
 
-#include <ncurses.h>
+#include "golden.h"
 
 namespace Chip8 {
-    static const std::unordered_map<int,uint8_t> scan_map = {
-        {SDL_SCANCODE_1, 0x1}, 
-        {SDL_SCANCODE_2, 0x2},
-        {SDL_SCANCODE_3, 0x3},
-        {SDL_SCANCODE_4, 0xC},
-        {SDL_SCANCODE_Q, 0x4},
-        {SDL_SCANCODE_W, 0x5},
-        {SDL_SCANCODE_E, 0x6},
-        {SDL_SCANCODE_R, 0xD},
-        {SDL_SCANCODE_A, 0x7},
-        {SDL_SCANCODE_S, 0x8},
-        {SDL_SCANCODE_D, 0x9},
-        {SDL_SCANCODE_F, 0xE},
-        {SDL_SCANCODE_Z, 0xA},
-        {SDL_SCANCODE_X, 0x0},
-        {SDL_SCANCODE_C, 0xB},
-        {SDL_SCANCODE_V, 0xF}
-    };
-
 
     Chip8State::Chip8State()
-	: I_register{0}
-	, sound_register{0}
-	, delay_register{0}
-	, program_counter{0x200}
-	, stack_pointer{0}
-	, dist{0, 255}
-	, waiting{false}
     {
 
 
@@ -63,56 +37,80 @@ namespace Chip8 {
 
 	for (size_t i=0; i<sprites.size(); ++i)
 	    memory[i] = sprites[i];
-
-	// Use with dist(mt);
-	mt.seed(rd());
+	rehash();
     }
 
 
     void Chip8State::load_file(std::string filename)
     {
-	std::ifstream inputfile;
-	inputfile.open(filename, std::ios::in | std::ios::binary);
-
-	/* if (!inputfile) */
-	/*     throw std::exception("Could not open file"); */
-
-	// TODO: What to do if file does not fit in memory
-	size_t counter = 0x200;
-	Instruction instruction; 
-	while (inputfile.good() && !inputfile.eof()) {
-	    inputfile.read((char*)(&instruction), sizeof(Instruction)); 
-	    uint16_t rev_endian = ((instruction & 0x00ff) << 8 ) | ((instruction & 0xff00) >> 8);
-
-	    // TODO: Possible to simplify this?
-	    memory[counter] = (0xFF00 & rev_endian) >> 8;
-	    memory[counter+1] = 0x00FF & rev_endian;
-	    counter += 2;
-	}
+	load_rom(read_rom(filename));
+    }
+
+    void Chip8State::load_rom(const std::vector<uint8_t>& rom)
+    {
+	if (rom.size() > memory_size - program_start)
+	    throw std::runtime_error("Rom does not fit in memory");
+	std::copy(rom.begin(), rom.end(), memory.begin() + program_start);
+	rehash();
+    }
+
+    void Chip8State::set_memory(uint16_t addr, uint8_t value)
+    {
+	addr &= 0xFFF;
+	const size_t word = addr / 8;
+	uint64_t before, after;
+	std::memcpy(&before, &memory[word*8], sizeof(before));
+	memory[addr] = value;
+	std::memcpy(&after, &memory[word*8], sizeof(after));
+	content_hash ^= word_hash(word, before) ^ word_hash(word, after);
     }
 
     void Chip8State::set_display_row(size_t row, uint64_t value)
     {
-	std::cerr << "Deprecated set_display_row\n";
-	/* display[row] = value; */
+	write_row(row, value);
     }
 
     void Chip8State::set_display(size_t col, size_t row, bool value)
     {
-	display[row*display_width + col] = value;
+	const uint64_t bit = uint64_t{1} << (display_width-1-col);
+	write_row(row, value ? display[row] | bit : display[row] & ~bit);
     }
 
     uint64_t Chip8State::get_display_row(size_t row) const
     {
-	std::cerr << "Deprectaed get_display_row\n";
-	return 0;
-	/* return display[row]; */
+	return display[row & 31];
     }
 
+    uint64_t Chip8State::display_hash() const
+    {
+	return Chip8::display_hash(display);
+    }
 
+    void Chip8State::set_keyboard(uint16_t keys)
+    {
+	if (undo && keys != get_keyboard())
+	    undo->record_keyboard(*this);
+	for (size_t key=0; key<keyboard.size(); ++key) {
+	    const bool pressed = (keys >> key) & 1;
+	    if (pressed && !keyboard[key])
+		stop_waiting();
+	    keyboard[key] = pressed;
+	}
+    }
+
+    uint16_t Chip8State::get_keyboard() const
+    {
+	uint16_t keys = 0;
+	for (size_t key=0; key<keyboard.size(); ++key)
+	    keys |= keyboard[key] << key;
+	return keys;
+    }
+
+
+    // The stack wraps around instead of overflowing, sixteen levels deep
     void Chip8State::push_to_stack(uint16_t addr)
     {
-	stack_pointer++;
+	stack_pointer = (stack_pointer + 1) & 0xF;
 	stack[stack_pointer] = addr;
     }
     
@@ -121,14 +119,16 @@ namespace Chip8 {
 
     void Chip8State::clear_display()
     {
-	for (size_t i=0; i<display.size(); ++i)
-	    display[i] = false;
+	for (size_t row=0; row<display.size(); ++row)
+	    if (display[row] != 0)
+		write_row(row, 0);
     }
 
 
     void Chip8State::subroutine_return()
     {
-	program_counter = stack[stack_pointer--];
+	program_counter = stack[stack_pointer & 0xF];
+	stack_pointer = (stack_pointer - 1) & 0xF;
     }
 
     void Chip8State::jump_to_addr(uint16_t addr)
@@ -136,9 +136,48 @@ namespace Chip8 {
 	program_counter = addr;
     }
 
+    Instruction Chip8State::fetch() const
+    {
+	return (memory[program_counter & 0xFFF] << 8) | memory[(program_counter+1) & 0xFFF];
+    }
+
+    void Chip8State::step()
+    {
+	if (waiting)
+	    return;
+
+	[[maybe_unused]] const uint16_t pc = program_counter;
+	const Instruction instruction = fetch();
+	if (undo)
+	    undo->record_instruction(*this, instruction);
+	program_counter += 2;
+	interpret(instruction);
+
+#ifdef CHIP8_TRACE
+	if (observer)
+	    observer->executed(*this, pc, instruction);
+#endif
+    }
+
+    void Chip8State::run_frame(size_t instructions)
+    {
+	for (size_t i=0; i<instructions && !waiting; ++i)
+	    step();
+	tick_timers();
+    }
+
+    void Chip8State::tick_timers()
+    {
+	if (undo && (delay_register > 0 || sound_register > 0))
+	    undo->record_timers(*this);
+	if (delay_register > 0)
+	    delay_register--;
+	if (sound_register > 0)
+	    sound_register--;
+    }
+
     void Chip8State::interpret(Instruction instruction)
     {
-	const uint8_t first = (instruction & 0xF000) >> 12;
 	const uint8_t x = (instruction & 0x0F00) >> 8;
 	const uint8_t y = (instruction & 0x00F0) >> 4;
 	const uint8_t nibble = instruction & 0x000F;
@@ -148,577 +187,256 @@ namespace Chip8 {
 	const auto val_x = get_register(x);
 	const auto val_y = get_register(y);
 
-	const auto old_pc = get_program_counter();
-
-	
-	if (instruction == 0x00E0)
-	    clear_display();
-	else if (instruction == 0x00EE) {
-	    subroutine_return();
-	}
-	else if (first == 1) {
-	    jump_to_addr(addr);
-	}
-	else if (first == 2) { // CALL addr
-	    push_to_stack(program_counter);
-	    program_counter = addr;
-	}
-	else if (first == 3) { // SE Vx, byte
-	    if (registers[x] == kk)
-		program_counter += 2;
-	}
-	else if (first == 4) {
-	    if (registers[x] != kk)
-		program_counter += 2;
-	}
-	else if (first == 5) {
-	    if (registers[x] == registers[y])
-		program_counter += 2;
-	}
-	else if (first == 6) {
-	    set_register(x, kk);
-	}
-	else if (first == 7) {
-	    const auto old_value = get_register(x);
-	    set_register(x, old_value+kk);
-	}
-	else if (first == 8 && nibble == 0) {
-	    set_register(x, get_register(y));
-	}
-	else if (first == 8 && nibble == 1) {
-	    set_register(x, get_register(x) | get_register(y));
-	}
-	else if (first == 8 && nibble == 2) {
-	    set_register(x, get_register(x) & get_register(y));
-	}
-	else if (first == 8 && nibble == 3) {
-	    set_register(x, get_register(x) ^ get_register(y));
-	}
-	else if (first == 8 && nibble == 4) {
-	    auto result = get_register(x) + get_register(y);
-	    auto vf_res = result > 255 ? 1 : 0;
-
-	    set_register(x, static_cast<uint8_t>(result));
-	    set_register(0xF, vf_res);
-	}
-	else if (first == 8 && nibble == 5) { // Assumed that underflow is allowed (desired)
-	    auto val_x = get_register(x);
-	    auto val_y = get_register(y);
-	    set_register(x, val_x - val_y);
-
-	    auto vf_res = val_x < val_y ? 1 : 0;
-	    set_register(0xF, 1);
-	}
-	else if (first == 8 & nibble == 6) {
-	    const auto res_vf = (val_x & 0x01) == 0 ? 0 : 1;
-	    set_register(0xF, res_vf);
-	    set_register(x, val_x >> 1);
-	}
-	else if (first == 8 && nibble == 7) {
-	    set_register(x, val_y - val_x);
+	switch (decode(instruction)) {
+	    case Opcode::CLS:
+		clear_display();
+		break;
+	    case Opcode::RET:
+		subroutine_return();
+		break;
+	    case Opcode::JPaddr:
+		jump_to_addr(addr);
+		break;
+	    case Opcode::CALL:
+		push_to_stack(program_counter);
+		program_counter = addr;
+		break;
+	    case Opcode::SEVxbyte:
+		if (registers[x] == kk)
+		    program_counter += 2;
+		break;
+	    case Opcode::SNEVxbyte:
+		if (registers[x] != kk)
+		    program_counter += 2;
+		break;
+	    case Opcode::SEVxVy:
+		if (registers[x] == registers[y])
+		    program_counter += 2;
+		break;
+	    case Opcode::LDVxbyte:
+		set_register(x, kk);
+		break;
+	    case Opcode::ADDVxbyte:
+		set_register(x, val_x+kk);
+		break;
+	    case Opcode::LDVxVy:
+		set_register(x, val_y);
+		break;
+	    case Opcode::OR:
+		set_register(x, val_x | val_y);
+		break;
+	    case Opcode::AND:
+		set_register(x, val_x & val_y);
+		break;
+	    case Opcode::XOR:
+		set_register(x, val_x ^ val_y);
+		break;
+	    case Opcode::ADDVxVy: {
+		auto result = val_x + val_y;
+		auto vf_res = result > 255 ? 1 : 0;
 
-	    auto vf_res = val_x < val_y ? 1 : 0;
-	    set_register(0xF, vf_res);
-	}
-	else if (first == 8 && nibble == 0xE) {
-	    set_register(0xF, (val_x & 0x80) >> 7);
-	    set_register(x, val_x << 1);
-	}
-	else if (first == 9 && nibble == 0) {
-	    program_counter += (val_x == val_y) ? 0 : 2;
-	}
-	else if (first == 0xA) {
-	    I_register = addr;
-	}
-	else if (first == 0xB) {
-	    program_counter = addr + get_register(0);
-	}
-	else if (first == 0xC) {
-	    set_register(x, dist(mt) & kk);
-	}
-	else if (first == 0xD) {
-	    const auto x_pos = val_x % 64;
-	    const auto y_pos = val_y % 32;
-
-	    bool collision = false;
-
-	    for (uint16_t i=0; i<nibble; ++i) {
-		auto sprite_row = get_memory(get_I_register() + i);
-		auto cursor = 0b10000000;
-		for (size_t dx=0; dx<8; dx++) {
-		    const auto x = x_pos + dx;
-		    const auto y = y_pos + i;
-
-		    if (x >= 64)
-			continue;
-		    if (y >= 32)
-			continue;
-
-		    const auto sprite_val = ((sprite_row & cursor) > 0) ? true : false;
-		    collision |= (sprite_val && get_display(x, y));
-		    set_display(x, y, sprite_val ^ get_display(x, y));
-		    
-		    cursor >>= 1;
+		set_register(x, static_cast<uint8_t>(result));
+		set_register(0xF, vf_res);
+		break;
+	    }
+	    case Opcode::SUB: // Assumed that underflow is allowed (desired)
+		set_register(x, val_x - val_y);
+		set_register(0xF, 1);
+		break;
+	    case Opcode::SHR:
+		set_register(0xF, (val_x & 0x01) == 0 ? 0 : 1);
+		set_register(x, val_x >> 1);
+		break;
+	    case Opcode::SUBN:
+		set_register(x, val_y - val_x);
+		set_register(0xF, val_x < val_y ? 1 : 0);
+		break;
+	    case Opcode::SHL:
+		set_register(0xF, (val_x & 0x80) >> 7);
+		set_register(x, val_x << 1);
+		break;
+	    case Opcode::SNEVxVy:
+		program_counter += (val_x == val_y) ? 0 : 2;
+		break;
+	    case Opcode::LDIaddr:
+		I_register = addr;
+		break;
+	    case Opcode::JPV0addr:
+		program_counter = addr + get_register(0);
+		break;
+	    case Opcode::RND:
+		set_register(x, rng.next() & kk);
+		break;
+	    case Opcode::DRW: {
+		const unsigned int x_pos = val_x % 64;
+		const unsigned int y_pos = val_y % 32;
+
+		bool collision = false;
+
+		// Sprites are clipped at the right and bottom edges
+		for (uint16_t i=0; i<nibble && y_pos+i<display_height; ++i) {
+		    const uint64_t sprite_row = get_memory(get_I_register() + i);
+		    const uint64_t bits = (sprite_row << (display_width-8)) >> x_pos;
+		    collision |= (display[y_pos+i] & bits) != 0;
+		    write_row(y_pos+i, display[y_pos+i] ^ bits);
 		}
+		set_register(0xF, collision ? 1 : 0);
+		break;
 	    }
-	    set_register(0xF, collision ? 1 : 0); 
-	}
-	else if (first == 0xE && kk == 0x9E) {
-	    if (is_pressed(val_x))
-		program_counter += 2;
-	}
-	else if (first == 0xE && kk == 0xA1) {
-	    if (!is_pressed(val_x))
-		program_counter += 2;
-	}
-	else if (first == 0xF && kk == 0x07) {
-	    set_register(x, get_delay_register());
-	}
-	else if (first == 0xF && kk == 0x0A) {
-	    wait_for_input();
-	}
-	else if (first == 0xF && kk == 0x15) {
-	    set_delay_register(val_x);
-	}
-	else if (first == 0xF && kk == 0x18) {
-	    set_sound_register(val_x);
-	}
-	else if (first == 0xF && kk == 0x1E)
-	{
-	    set_I_register(get_I_register() + val_x);
-	}
-	else if (first == 0xF && kk == 0x29)
-	{
-	    set_I_register(5*val_x);
-	}
-	else if (first == 0xF && kk == 0x33) {
-	    const auto hundreds = val_x / 100;
-	    const auto tens = (val_x - hundreds*100) / 10;
-	    const auto ones = (val_x - hundreds*100 - tens*10);
-
-	    set_memory(get_I_register(), hundreds);
-	    set_memory(get_I_register()+1, tens);
-	    set_memory(get_I_register()+2, ones);
-	}
-	else if (first == 0xF && kk == 0x55) {
-	    for (size_t i=0; i<=x; ++i) 
-		set_memory(get_I_register()+i, get_register(i));
-	}
-	else if (first == 0xF && kk == 0x65) {
-	    for (size_t i=0; i<=x; ++i)
-		set_register(i, get_memory(get_I_register()+i));
-	}
-    }
-
-
-
-    void Chip8Runner::print_registers()
-    {
-	constexpr size_t padding = 6;
-	size_t curr_y = 1;
-	static constexpr size_t start_x = 5;
-
-	{
-	    // I registers
-	    wmove(window_, curr_y, start_x);
-	    waddstr(window_, "I:");
-	    std::stringstream ss;
-	    ss << std::setfill('0') << std::setw(4) << std::hex << static_cast<int>(get_I_register());
-	    waddstr(window_, ss.str().c_str());
-	}
-
-	curr_y += 2;
-
-	{
-	    wmove(window_, curr_y, start_x);
-	    waddstr(window_, "PC:");
-	    std::stringstream ss;
-	    ss << std::setfill('0') << std::setw(4) << std::hex << static_cast<int>(get_program_counter());
-	    waddstr(window_, ss.str().c_str());
-	}
-
-	curr_y += 2;
-
-	for (size_t i=0; i<=0xF; ++i) {
-	    std::stringstream ss;
-	    ss << "V" << std::hex << i;
-
-	    wmove(window_, curr_y, start_x+i*padding);
-	    waddstr(window_, ss.str().c_str());
-	}
-
-	curr_y += 1;
-
-	for (size_t i=0; i<=0xF; ++i) {
-	    std::stringstream ss;
-	    ss << std::setfill('0') << std::setw(4) <<  std::hex << static_cast<int>(get_register(i));
-
-	    wmove(window_, curr_y, start_x+i*padding);
-	    waddstr(window_, ss.str().c_str());
-	}
-
-	curr_y += 2;
-
-	for (size_t i=0; i<=0xF; ++i) {
-	    std::stringstream ss;
-	    ss << std::setfill(' ') << std::setw(2) << std::hex << std::uppercase << static_cast<int>(i);
-	    wmove(window_, curr_y, start_x+i*padding);
-	    waddstr(window_, ss.str().c_str());
-	}
-
-	curr_y += 1;
-
-	for (size_t i=0; i<=0xF; ++i) {
-	    std::stringstream ss;
-	    ss << std::setfill(' ') << std::setw(2) << is_pressed(i);
-	    wmove(window_, curr_y, start_x+i*padding);
-	    waddstr(window_, ss.str().c_str());
-	}
-	
-
-	curr_y += 2;
-
-	const size_t y_mem_start = curr_y;
-
-	const size_t mem_start = 0x200; 
-	const size_t mem_padding = 0x4; 
-
-	const size_t per_row = 32;
-
-	size_t curr_mem = mem_start;
-	for (size_t num_row=0; num_row<10; ++num_row) {
-	    std::stringstream ss;
-	    ss << std::hex << std::setfill('0') << std::setw(3) << static_cast<int>(curr_mem) << "  ";
-	    for (size_t i=curr_mem; i<curr_mem+per_row; ++i) {
-		ss << std::setfill('0') << std::setw(2) << std::hex << static_cast<int>(get_memory(i)) << ' ';
+	    case Opcode::SKP:
+		if (is_pressed(val_x))
+		    program_counter += 2;
+		break;
+	    case Opcode::SKNP:
+		if (!is_pressed(val_x))
+		    program_counter += 2;
+		break;
+	    case Opcode::LDVxDT:
+		set_register(x, get_delay_register());
+		break;
+	    case Opcode::LDVxK:
+		wait_for_input();
+		break;
+	    case Opcode::LDDTVx:
+		set_delay_register(val_x);
+		break;
+	    case Opcode::LDSTVx:
+		set_sound_register(val_x);
+		break;
+	    case Opcode::ADDIVx:
+		set_I_register(get_I_register() + val_x);
+		break;
+	    case Opcode::LDFVx:
+		set_I_register(5*val_x);
+		break;
+	    case Opcode::LDBVx: {
+		const auto hundreds = val_x / 100;
+		const auto tens = (val_x - hundreds*100) / 10;
+		const auto ones = (val_x - hundreds*100 - tens*10);
+
+		set_memory(get_I_register(), hundreds);
+		set_memory(get_I_register()+1, tens);
+		set_memory(get_I_register()+2, ones);
+		break;
 	    }
-	    wmove(window_, curr_y, start_x);
-	    waddstr(window_, ss.str().c_str());
-
-	    curr_y++;
-	    curr_mem += per_row;
+	    case Opcode::LDIVx:
+		for (size_t i=0; i<=x; ++i)
+		    set_memory(get_I_register()+i, get_register(i));
+		break;
+	    case Opcode::LDVxI:
+		for (size_t i=0; i<=x; ++i)
+		    set_register(i, get_memory(get_I_register()+i));
+		break;
+	    case Opcode::SYS:
+	    case Opcode::Invalid:
+	    case Opcode::Count:
+		break;
 	}
-
-	wrefresh(window_);
     }
 
-    Chip8Runner::Chip8Runner() : Chip8State::Chip8State()
-			       , window_{initscr()}
-    {
-        if (SDL_Init(SDL_INIT_VIDEO) < 0)
-            return;
-
-        SDL_CreateWindowAndRenderer(window_real_width, window_real_height, 0, &window, &renderer);
-        SDL_RenderSetLogicalSize(renderer, window_width, window_height);
 
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 100);
-        SDL_RenderClear(renderer);
-        SDL_SetRenderDrawColor(renderer, 255,255, 255, 255);
+    std::string get_name_from_hex(Instruction instruction)
+    {
+	const auto opcode = decode(instruction);
+	if (opcode != Opcode::Invalid)
+	    return std::string(get_info(opcode).name);
 
-        SDL_RenderPresent(renderer);
+	std::stringstream ss;
+	ss << "Could not find match for instruction " << std::hex << instruction << '\n';
+	throw std::runtime_error(ss.str());
     }
 
-    void Chip8Runner::run()
+    Program assemble_program(std::istream& source, const std::string& filename)
     {
-        bool closed = false;
-
-        while (!closed) {
-            SDL_Event event;
-
-            while (SDL_PollEvent(&event)) {
-                switch (event.type) {
-                    case SDL_QUIT:
-                        closed = true;
-                        break;
-
-			// Handle keypresses
-		    case SDL_KEYDOWN:
-			{
-			    /* std::cerr << "Button pressed or released\n"; */
-			    const auto scancode = event.key.keysym.scancode;
-			    if (scan_map.find(scancode) != scan_map.end()) {
-				set_key(scan_map.at(scancode), true);
-				stop_waiting();
-			    } 
-			    break;
-			}
-		    case SDL_KEYUP:
-			{
-			    const auto scancode = event.key.keysym.scancode;
-			    if (scan_map.find(scancode) != scan_map.end()) {
-				set_key(scan_map.at(scancode), false);
-				/* std::cerr << "Pressed " << std::hex << static_cast<int>(scan_map.at(scancode)) << '\n'; */
-			    } 
-			    break;
-			}
-		}
+	Program program;
+	program.symbols.set_source(filename);
+
+	size_t addr = Chip8State::program_start;
+	std::unordered_map<std::string,size_t> labels;
+	std::vector<std::pair<std::string,size_t>> label_order;
+	std::vector<std::pair<std::string,uint32_t>> lines;
+
+	std::string line;
+	uint32_t line_number = 0;
+	while (getline(source, line)) {
+	    ++line_number;
+	    const auto first = line.find_first_not_of(" \t");
+
+	    // Detect comments
+	    if (first == std::string::npos || line[first] == '#') {
+		continue;
 	    }
-
-	    if (is_waiting())
+	    else if (line[first] == ':') {
+		const auto name = split(line.substr(first))[0];
+		labels.insert({name, addr});
+		label_order.push_back({name, addr});
+	    } else if (const auto tokens = split(line); tokens.empty()) {
+		// Only separators
 		continue;
-
-	    const auto part1 = get_memory(get_program_counter());
-	    const auto part2 = get_memory(get_program_counter()+1);
-	    const Instruction instruction = (part1 << 8) | part2;
-	    set_program_counter(get_program_counter() + 2);
-
-	    interpret(instruction);
-	    print_registers();
-
-	    render_display();
-
-	    const auto dt = get_delay_register();
-	    const auto st = get_sound_register();
-	    if (dt > 0)
-		set_delay_register(dt-1);
-	    if (st > 0)
-		set_sound_register(st-1);
-
-	    const float freq = 60.0f;
-	    const int period = static_cast<int>(1.0f / freq * 1000);
-	    std::this_thread::sleep_for(std::chrono::milliseconds(period));
-        }
-    }
-
-
-    void Chip8Runner::destroy()
-    {
-        SDL_DestroyRenderer(renderer);
-        SDL_DestroyWindow(window);
-        SDL_Quit();
-
-	endwin();
-    }
-
-
-    void Chip8Runner::render_display()
-    {
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-	SDL_RenderClear(renderer);
-        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-
-	// TODO: Don't hardcode width and height
-	for (int row=0; row<32; ++row) {
-	    for (int col=0; col<64; ++col) {
-		if (get_display(col, row)) {
-		    SDL_RenderDrawPoint(renderer, col, row);
-		}
+	    } else if (tokens[0] == "DB") {
+		lines.push_back({line, line_number});
+		addr += tokens.size() - 1;
+	    } else {
+		lines.push_back({line, line_number});
+		addr += 2;
 	    }
 	}
-        SDL_RenderPresent(renderer);
-    }
 
+	for (const auto& [line, line_number] : lines) {
+	    // Raw bytes, for sprites and other data
+	    if (const auto tokens = split(line); tokens[0] == "DB") {
+		for (const auto byte : get_numbers(tokens, labels))
+		    program.bytes.push_back(byte & 0xFF);
+		continue;
+	    }
 
-    void Chip8Runner::render_symbol(uint8_t symbol) {
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-        SDL_RenderClear(renderer);
-
-        const std::unordered_map<char,std::array<uint8_t,5>> sprites = {
-            { 0x0, { 0xF0, 0x90, 0x90, 0x90, 0xF0 }},
-            { 0x1, { 0x20, 0x60, 0x20, 0x20, 0x70 }},
-            { 0x2, { 0xF0, 0x10, 0xF0, 0x80, 0xF0 }},
-            { 0x3, { 0xF0, 0x10, 0xF0, 0x10, 0xF0 }},
-            { 0x4, { 0x90, 0x90, 0xF0, 0x10, 0x10 }},
-            { 0x5, { 0xF0, 0x80, 0xF0, 0x10, 0xF0 }},
-            { 0x6, { 0xF0, 0x80, 0xF0, 0x90, 0xF0 }},
-            { 0x7, { 0xF0, 0x10, 0x20, 0x40, 0x40 }},
-            { 0x8, { 0xF0, 0x90, 0xF0, 0x90, 0xF0 }},
-            { 0x9, { 0xF0, 0x90, 0xF0, 0x10, 0xF0 }},
-            { 0xA, { 0xF0, 0x90, 0xF0, 0x90, 0x90 }},
-            { 0xB, { 0xE0, 0x90, 0xE0, 0x90, 0xE0 }},
-            { 0xC, { 0xF0, 0x80, 0x80, 0x80, 0xF0 }},
-            { 0xD, { 0xE0, 0x90, 0x90, 0x90, 0xE0 }},
-            { 0xE, { 0xF0, 0x80, 0xF0, 0x80, 0xF0 }},
-            { 0xF, { 0xF0, 0x80, 0xF0, 0x80, 0x80 }}};
-
-        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-	auto sprite = sprites.at(symbol);
-        for (int row=0; row<sprite.size(); ++row) {
-            auto cursor = 0x80;
-            const auto x = sprite[row];
-            for (int col=0; col<8; ++col) {
-                if ((cursor & x) == cursor)
-                    SDL_RenderDrawPoint(renderer, col, row);
-                cursor >>= 1;
-            }
-        }
-        SDL_RenderPresent(renderer);
-    }
+	    const Instruction instruction = assemble(line, labels);
+	    program.symbols.add_line(Chip8State::program_start + program.bytes.size(), line_number);
+	    program.bytes.push_back((instruction & 0xFF00) >> 8);
+	    program.bytes.push_back(instruction & 0x00FF);
+	}
 
+	// A label covers everything up to the next label at a higher address
+	for (const auto& [name, start] : label_order) {
+	    size_t end = addr;
+	    for (const auto& [other, other_start] : label_order)
+		if (other_start > start && other_start < end)
+		    end = other_start;
 
-    std::unordered_map<std::string, uint16_t> base_map {
-	    { "CLS"      , 0x00E0 },
-	    { "RET"      , 0x00EE },
-	    { "SYS"      , 0x0000 },
-	    { "JPaddr"   , 0x1000 },
-	    { "CALL"     , 0x2000 },
-	    { "SEVxbyte" , 0x3000 },
-	    { "SNEVxbyte", 0x4000 },
-	    { "SEVxVy"   , 0x5000 },
-	    { "LDVxbyte" , 0x6000 },
-	    { "ADDVxbyte", 0x7000 },
-	    { "LDVxVy"   , 0x8000 },
-	    { "OR"       , 0x8001 },
-	    { "AND"      , 0x8002 },
-	    { "XOR"      , 0x8003 },
-	    { "ADDVxVy"  , 0x8004 },
-	    { "SUB"      , 0x8005 },
-	    { "SHR"      , 0x8006 },
-	    { "SUBN"     , 0x8007 },
-	    { "SHL"      , 0x800E },
-	    { "SNEVxVy"  , 0x9000 },
-	    { "LDIaddr"  , 0xA000 },
-	    { "JPV0addr" , 0xB000 },
-	    { "RND"      , 0xC000 },
-	    { "DRW"      , 0xD000 },
-	    { "SKP"      , 0xE09E },
-	    { "SKNP"     , 0xE0A1 },
-	    { "LDVxDT"   , 0xF007 },
-	    { "LDVxK"    , 0xF00A },
-	    { "LDDTVx"   , 0xF015 },
-	    { "LDSTVx"   , 0xF018 },
-	    { "ADDIVx"   , 0xF01E },
-	    { "LDFVx"    , 0xF029 },
-	    { "LDBVx"    , 0xF033 },
-	    { "LDIVx"    , 0xF055 },
-	    { "LDVxI"    , 0xF065 }
-    };
-
-
-
-    std::unordered_map<std::string,std::pair<std::vector<std::string>,std::vector<Field>>> formats {
-	    {"CLS",       {{ "CLS" }, {}}}
-	    ,{"RET",       {{ "RET" }, {}}}
-            ,{"SYS",       {{"SYS "}, {Field::ADDR}} }
-	    ,{"JPaddr"   , {{"JP "}, {Field::ADDR}}}
-	    ,{"CALL"     , {{"CALL "}, {Field::ADDR}}}
-	    ,{"SEVxbyte" , {{"SE V", ", "},  {Field::X, Field::BYTE}}}
-	    ,{"SNEVxbyte", {{"SNE V", ", "}, {Field::X, Field::BYTE}}}
-	    ,{"SEVxVy"   , {{"SE V", ", V"}, {Field::X, Field::Y}}}
-	    ,{"LDVxbyte" , {{"LD V", ", "}, {Field::X, Field::BYTE}}}
-	    ,{"ADDVxbyte", {{"ADD V", ", "}, {Field::X, Field::BYTE}}}
-	    ,{"LDVxVy"   , {{"LD V", ", V"}, {Field::X, Field::Y}}}
-	    ,{"OR"       , {{"OR V", ", V"}, {Field::X, Field::Y}}}
-	    ,{"AND"      , {{"AND V", ", V"}, {Field::X, Field::Y}}}
-	    ,{"XOR"      , {{"XOR V", ", V"}, {Field::X, Field::Y}}}
-	    ,{"ADDVxVy"  , {{"ADD V", ", V"}, {Field::X, Field::Y}}}
-	    ,{"SUB"      , {{"SUB V", ", V"}, {Field::X, Field::Y}}}
-	    ,{"SHR"      , {{"SHR V", ", V"}, {Field::X, Field::Y}}}
-	    ,{"SUBN"     , {{"SUBN V", ", V"}, {Field::X, Field::Y}}}
-	    ,{"SHL"      , {{"SHL V", ", V"}, {Field::X , Field::Y}}}
-	    ,{"SNEVxVy"  , {{"SNE V", ", V"}, {Field::X, Field::Y}}}
-	    ,{"LDIaddr"  , {{"LD I, "}, {Field::ADDR}}}
-	    ,{"JPV0addr" , {{"JP V0, "}, {Field::ADDR}}}
-	    ,{"RND"      , {{"RND V", ", "}, {Field::X, Field::BYTE}}}
-	    ,{"DRW"      , {{"DRW V", ", V", ", "}, {Field::X, Field::Y, Field::NIBBLE}}}
-	    ,{"SKP"      , {{"SKP V"}, {Field::X}}}
-	    ,{"SKNP"     , {{"SKNP V"}, {Field::X}}}
-	    ,{"LDVxDT"   , {{"LD V", ", DT"}, {Field::X}}}
-	    ,{"LDVxK"    , {{"LD V", ", K"}, {Field::X}}}
-	    ,{"LDDTVx"   , {{"LD DT, V"}, {Field::X}}}
-	    ,{"LDSTVx"   , {{"LD ST, V"}, {Field::X}}}
-	    ,{"ADDIVx"   , {{"ADD I, V"}, {Field::X}}}
-	    ,{"LDFVx"    , {{"LD F, V"}, {Field::X}}}
-	    ,{"LDBVx"    , {{"LD B, V"},{Field::X}}}
-	    ,{"LDIVx"    , {{"LD [I], V"}, {Field::X}}}
-	    ,{"LDVxI"    , {{"LD V", ", [I]"}, {Field::X}}}
-    };
+	    const auto stripped = name.substr(1, name.size() >= 2 ? name.size()-2 : 0);
+	    program.symbols.add_label(stripped, start, end);
+	}
 
+	return program;
+    }
 
-    std::string get_name_from_hex(Instruction instruction)
+    std::vector<uint8_t> read_rom(const std::string& filename)
     {
-	if (instruction == 0x00E0) return "CLS";
-	else if (instruction == 0x00EE) return "RET";
-	else if (instruction >> 12 == 0x0) return "SYS";
-	else if (instruction >> 12 == 0x1) return "JPaddr";
-	else if (instruction >> 12 == 0x2) return "CALL";
-	else if (instruction >> 12 == 0x3) return "SEVxbyte";  
-	else if (instruction >> 12 == 0x4) return "SNEVxbyte"; 
-	else if (instruction >> 12 == 0x5) return "SEVxVy";    
-	else if (instruction >> 12 == 0x6) return "LDVxbyte";  
-	else if (instruction >> 12 == 0x7) return "ADDVxbyte"; 
-	else if (instruction >> 12 == 0x8 && (instruction & 0x000F) == 0x0) return "LDVxVy";
-	else if (instruction >> 12 == 0x8 && (instruction & 0x000F) == 0x1) return "OR";   
-	else if (instruction >> 12 == 0x8 && (instruction & 0x000F) == 0x2) return "AND";  
-	else if (instruction >> 12 == 0x8 && (instruction & 0x000F) == 0x3) return "XOR";  
-	else if (instruction >> 12 == 0x8 && (instruction & 0x000F) == 0x4) return "ADDVxVy";
-	else if (instruction >> 12 == 0x8 && (instruction & 0x000F) == 0x5) return "SUB";  
-	else if (instruction >> 12 == 0x8 && (instruction & 0x000F) == 0x6) return "SHR";  
-	else if (instruction >> 12 == 0x8 && (instruction & 0x000F) == 0x7) return "SUBN"; 
-	else if (instruction >> 12 == 0x8 && (instruction & 0x000F) == 0xE) return "SHL";  
-	else if (instruction >> 12 == 0x9) return "SNEVxVy";  
-	else if (instruction >> 12 == 0xA) return "LDIaddr";  
-	else if (instruction >> 12 == 0xB) return "JPV0addr";  
-	else if (instruction >> 12 == 0xC) return "RND";  
-	else if (instruction >> 12 == 0xD) return "DRW";  
-	else if (instruction >> 12 == 0xE && (instruction & 0x00FF) == 0x9E) return "SKP";  
-	else if (instruction >> 12 == 0xE && (instruction & 0x00FF) == 0xA1) return "SKNP";  
-	else if (instruction >> 12 == 0xF && (instruction & 0x00FF) == 0x07) return "LDVxDT";  
-	else if (instruction >> 12 == 0xF && (instruction & 0x00FF) == 0x0A) return "LDVxK";  
-	else if (instruction >> 12 == 0xF && (instruction & 0x00FF) == 0x15) return "LDDTVx";  
-	else if (instruction >> 12 == 0xF && (instruction & 0x00FF) == 0x18) return "LDSTVx";  
-	else if (instruction >> 12 == 0xF && (instruction & 0x00FF) == 0x1E) return "ADDIVx";  
-	else if (instruction >> 12 == 0xF && (instruction & 0x00FF) == 0x29) return "LDFVx";  
-	else if (instruction >> 12 == 0xF && (instruction & 0x00FF) == 0x33) return "LDBVx";  
-	else if (instruction >> 12 == 0xF && (instruction & 0x00FF) == 0x55) return "LDIVx";  
-	else if (instruction >> 12 == 0xF && (instruction & 0x00FF) == 0x65) return "LDVxI";  
+	std::ifstream inputfile(filename, std::ios::in | std::ios::binary);
+	if (!inputfile)
+	    throw std::runtime_error("Could not open file " + filename);
 
-	std::stringstream ss;
-	ss << "Could not find match for instruction " << std::hex << instruction << '\n';
-	throw std::runtime_error(ss.str());
+	return std::vector<uint8_t>(std::istreambuf_iterator<char>(inputfile), std::istreambuf_iterator<char>());
     }
 
-    std::unordered_map<std::string, std::vector<Field>> fields_map {
-	{ "SYS"       , { Field::ADDR }}
-	,{"CLS"       , { } }
-	,{"RET"       , { }}
-	,{"JPaddr"    , { Field::ADDR }}
-	,{"CALL"      , { Field::ADDR }}
-	,{"SEVxbyte"  , { Field::X, Field::BYTE }}
-	,{"SNEVxbyte" , { Field::X, Field::BYTE }}
-	,{"SEVxVy"    , { Field::X, Field::Y }}
-	,{"LDVxbyte"  , { Field::X, Field::BYTE }}
-	,{"ADDVxbyte" , { Field::X, Field::BYTE }}
-	,{"LDVxVy"    , { Field::X, Field::Y }} 
-	,{"OR"        , { Field::X, Field::Y }}
-	,{"AND"       , { Field::X, Field::Y }}
-	,{"XOR"       , { Field::X, Field::Y }}
-	,{"ADDVxVy"   , { Field::X, Field::Y }}
-	,{"SUB"       , { Field::X, Field::Y }}
-	,{"SHR"       , { Field::X, Field::Y }}
-	,{"SUBN"      , { Field::X, Field::Y }}
-	,{"SHL"       , { Field::X, Field::Y }}
-	,{"SNEVxVy"   , { Field::X, Field::Y }}
-	,{"LDIaddr"   , { Field::ADDR }}
-	,{"JPV0addr"  , { Field::IGNORE, Field::ADDR }}
-	,{"RND"       , { Field::X, Field::BYTE }}
-	,{"DRW"       , { Field::X, Field::Y, Field::NIBBLE }}
-	,{"SKP"       , { Field::X }}
-	,{"SKNP"      , { Field::X }}
-	,{"LDVxDT"    , { Field::X }}
-	,{"LDVxK"     , { Field::X }}
-	,{"LDDTVx"    , { Field::X }}
-	,{"LDSTVx"    , { Field::X }}
-	,{"ADDIVx"    , { Field::X }}
-	,{"LDFVx"     , { Field::X }}
-	,{"LDBVx"     , { Field::X }}
-	,{"LDIVx"     , { Field::X }}
-	,{"LDVxI"     , { Field::X }}};
-
-
-
     Instruction assemble(std::string_view instruction, const std::unordered_map<std::string,size_t>& labels)
     {
         auto tokens = split(instruction);
 	
         auto numbers = get_numbers(tokens, labels);
         auto name = get_unique_name(tokens);
-	auto parts = fields_map.at(name.c_str());
+	const auto opcode = find_opcode(name);
+	if (opcode == Opcode::Invalid)
+	    throw std::runtime_error("Unknown instruction " + name);
+
+	const auto& info = get_info(opcode);
+	if (numbers.size() < info.operand_count)
+	    throw std::runtime_error("Missing operand for " + name);
 
-        Instruction result = base_map.at(name.c_str());
+        Instruction result = info.base;
 
-        for (int i=0; i<parts.size(); ++i) {
-            auto part = parts[i];
+        for (int i=0; i<info.operand_count; ++i) {
+            auto part = info.operands[i];
             auto num = numbers[i];
 
             switch (part) {
@@ -745,59 +463,49 @@ namespace Chip8 {
         return result;
     }
 
-    int get_field(Instruction instruction, Field field) 
+    size_t disassemble(Instruction instruction, char* buffer, size_t size)
     {
-            switch (field) {
-		// 0x0nnn
-                case Field::ADDR:
-		    return 0x0FFF & instruction;
-                case Field::BYTE:
-		    return 0x00FF & instruction;
-                case Field::X:
-		    return (0x0F00 & instruction) >> 8;
-                case Field::Y:
-		    return (0x00F0 & instruction) >> 4;
-                case Field::NIBBLE:
-		    return 0x000F & instruction;
-		case Field::IGNORE:
-		    return 0;
-            }
+	const auto opcode = decode(instruction);
+	if (opcode == Opcode::Invalid)
 	    return 0;
-    }
+	const auto& info = get_info(opcode);
 
-    std::string disassemble(Instruction instruction)
-    {
-	std::stringstream ss;
+	char* out = buffer;
+	char* const end = buffer + size;
 
-	std::string instruction_name = get_name_from_hex(instruction);
-	const auto& [literals, fields] = formats.at(instruction_name);
-	
-
-	// Alternate between the two arrays
-	size_t literal_index = 0;
-	size_t field_index = 0;
-	bool is_v = false;
-	while (literal_index < literals.size() || field_index < fields.size()) {
-	    is_v = false;
-	    if (literal_index < literals.size()) {
-		auto s = literals[literal_index];
-		ss << s;	
-		if (s[s.size()-1] == 'V')
-		    is_v = true;
-		++literal_index;
+	// Alternate between literals and fields, registers are written in hex
+	for (size_t i=0; i<info.literal_count || i<info.field_count; ++i) {
+	    bool is_v = false;
+	    if (i < info.literal_count) {
+		const auto literal = info.literals[i];
+		if (static_cast<size_t>(end - out) < literal.size())
+		    return 0;
+		out = std::copy(literal.begin(), literal.end(), out);
+		is_v = literal.back() == 'V';
 	    }
 
-	    if (field_index < fields.size()) {
-		const auto& field = get_field(instruction, fields[field_index]);
+	    if (i < info.field_count) {
+		const auto field = get_field(instruction, info.fields[i]);
+		const auto [next, error] = std::to_chars(out, end, field, is_v ? 16 : 10);
+		if (error != std::errc())
+		    return 0;
 		if (is_v)
-		    ss << std::uppercase <<  std::hex << field << std::dec;
-		else
-		    ss << field;
-		++field_index;
+		    std::transform(out, next, out, [](char c) { return (c >= 'a' && c <= 'f') ? c - 'a' + 'A' : c; });
+		out = next;
 	    }
 	}
 
-	return ss.str();
+	return out - buffer;
+    }
+
+    std::string disassemble(Instruction instruction)
+    {
+	char buffer[32];
+	const auto length = disassemble(instruction, buffer, sizeof(buffer));
+	if (length == 0)
+	    get_name_from_hex(instruction); // Throws
+
+	return std::string(buffer, length);
     }
 
     std::vector<std::string> split(std::string_view instruction)
@@ -837,7 +545,7 @@ namespace Chip8 {
 
         for (const auto& token : tokens) {
             if (token[0] >= '0' && token[0] <= '9') {
-                uint16_t num;
+                uint16_t num = 0;
                 std::istringstream(token) >> num;
                 result.push_back(num);
             } else if (token[0] == 'V') {
@@ -847,7 +555,7 @@ namespace Chip8 {
 		    throw std::runtime_error("V token is not valid");
 		}
 
-		uint16_t num;
+		uint16_t num = 0;
 		if (token[1] >= 'A' && token[1] <= 'F') {
 		    num = token[1] - 'A' + 10;
 		} else { // Treat it like normal number
@@ -855,7 +563,10 @@ namespace Chip8 {
 		}
                 result.push_back(num);
 	    } else if (token[0] == ':' && token[token.size()-1] == ':') {
-		result.push_back(label_map.at(token));	
+		const auto label = label_map.find(token);
+		if (label == label_map.end())
+		    throw std::runtime_error("Unknown label " + token);
+		result.push_back(label->second);
 	    }
         }
 
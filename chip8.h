@@ -1,34 +1,82 @@
 #pragma once
 
 #include <array>
+#include <string>
 #include <string_view>
 #include <unordered_map>
 #include <vector>
-#include <random>
-#include <optional>
+#include <utility>
 
 #include <iostream>
 
-#include <SDL2/SDL.h>
-#include <ncurses.h>
+#include "decode.h"
+#include "machine.h"
+#include "observer.h"
+#include "symbols.h"
+#include "undo.h"
 
 
 namespace Chip8 {
 
-    using Instruction = uint16_t;
-
-    class Chip8State {
+    class Chip8State : protected MachineState {
 	public:
 	    Chip8State();
 	    static constexpr unsigned int memory_size = 0x1000;
 	    static constexpr unsigned int program_start = 0x200;
 
 	    void load_file(std::string filename);
+	    // Copies the rom to program_start, throws if it does not fit
+	    void load_rom(const std::vector<uint8_t>& rom);
 	    /* void print_memory(); */
 
 	    // Limited to the non IO things
 	    void interpret(Instruction instruction);
 
+	    // The instruction at the program counter
+	    Instruction fetch() const;
+	    // Fetch, advance and interpret one instruction. Does nothing while
+	    // waiting for a key.
+	    void step();
+	    // One 60 Hz frame, without any IO
+	    void run_frame(size_t instructions);
+	    void tick_timers();
+
+	    const MachineState& snapshot() const { return *this; }
+	    // An independent machine in the same state, costs one copy of
+	    // MachineState. Observers and the undo log stay with the original.
+	    Chip8State fork() const
+	    {
+		Chip8State copy(*this);
+		copy.observer = nullptr;
+		copy.undo = nullptr;
+		return copy;
+	    }
+
+	    // Runs frames more with the current keys, calls show() and puts the
+	    // machine back as it was. Observers and the undo log do not see the
+	    // speculative frames.
+	    template<typename Fn>
+	    void run_ahead(size_t frames, size_t instructions, Fn&& show)
+	    {
+		const MachineState saved = *this;
+		auto* const saved_observer = std::exchange(observer, nullptr);
+		auto* const saved_undo = std::exchange(undo, nullptr);
+		for (size_t i=0; i<frames; ++i)
+		    run_frame(instructions);
+		show();
+		static_cast<MachineState&>(*this) = saved;
+		observer = saved_observer;
+		undo = saved_undo;
+	    }
+
+	    // Restoring invalidates the undo log
+	    void restore(const MachineState& state)
+	    {
+		static_cast<MachineState&>(*this) = state;
+		if (undo)
+		    undo->clear();
+	    }
+
 	    // Instruction functions
 	    void clear_display();
 	    void subroutine_return();
@@ -38,8 +86,9 @@ namespace Chip8 {
 	    uint16_t get_I_register() const { return I_register; }
 	    uint16_t get_program_counter() const { return program_counter; }
 	    uint16_t get_register(size_t i) const { return registers[i]; }
-	    uint8_t get_memory(size_t addr) const { return memory[addr]; };
-	    uint16_t stack_peek() const { return stack[stack_pointer]; }
+	    // Addresses wrap at the end of memory, like the program counter
+	    uint8_t get_memory(size_t addr) const { return memory[addr & 0xFFF]; };
+	    uint16_t stack_peek() const { return stack[stack_pointer & 0xF]; }
 	    uint8_t get_stack_pointer() const { return stack_pointer; }
 	    uint8_t get_delay_register() const { return delay_register; }
 	    uint8_t get_sound_register() const { return sound_register; }
@@ -50,90 +99,78 @@ namespace Chip8 {
 	    void set_I_register(uint16_t addr) { I_register = addr; }
 	    void set_delay_register(uint8_t value) { delay_register = value; }
 	    void set_sound_register(uint8_t value) { sound_register = value; }
-	    void set_memory(uint16_t addr, uint8_t value) { memory[addr] = value; }
+	    void set_memory(uint16_t addr, uint8_t value);
 	    void set_display(size_t col, size_t row, bool value);
 
 	    void wait_for_input() { waiting = true; }
 	    void stop_waiting() { waiting = false; }
-	    bool is_waiting() { return waiting; }
+	    bool is_waiting() const { return waiting; }
 
 	    void set_key(uint8_t key, bool value) {
 		std::cerr << "Setting key " << std::hex << static_cast<int>(key) << " to " << value << '\n';
-		keyboard[key] = value; 
+		keyboard[key & 0xF] = value; 
 
 	    }
-	    bool is_pressed(uint8_t key) const { return keyboard[key]; }
+	    // Only the low nibble of Vx names a key
+	    bool is_pressed(uint8_t key) const { return keyboard[key & 0xF]; }
+	    // One bit per key. Newly pressed keys end a wait like set_key does
+	    // in the runner.
+	    void set_keyboard(uint16_t keys);
+	    uint16_t get_keyboard() const;
 
 	    uint64_t get_display_row(size_t row) const;
+	    uint64_t display_hash() const;
+	    // Of the whole machine, without reading memory or display
+	    uint64_t fingerprint() const { return MachineState::fingerprint(); }
 	    void push_to_stack(uint16_t addr);
 
-	    bool get_display(size_t col, size_t row)
+	    bool get_display(size_t col, size_t row) const
 	    {
-		return display[row*display_width+col];
+		return (display[row] >> (display_width-1-col)) & 1;
 	    }
 
-	    void seed(int s) { mt.seed(s); };
+	    void seed(uint64_t s) { rng.seed(s); };
+	    // Not owned, nullptr to stop observing
+	    void set_observer(ExecutionObserver* o) { observer = o; }
+	    ExecutionObserver* get_observer() const { return observer; }
+	    // Not owned, nullptr to stop recording
+	    void set_undo_log(UndoLog* log) { undo = log; }
 
 	    static constexpr size_t display_width = 64;
 	    static constexpr size_t display_height = 32;
 	    static constexpr size_t display_size = display_width*display_height;
 
-        private:
-            std::array<uint16_t,16> stack{0};
-	    std::array<uint8_t,memory_size> memory{0};
-	    /* std::array<uint64_t,32> display; */
-	    std::array<bool,16> keyboard{0};
-	    std::array<bool,display_size> display{0};
-
-
-            // VF should never be used (used as flag in some programs
-            std::array<uint8_t,16> registers{0};
-            uint16_t I_register; // 12 lowest bits used
-            uint8_t sound_register;
-            uint8_t delay_register;
+	private:
+	    friend class UndoLog;
 
-            uint16_t program_counter;
-            uint8_t stack_pointer;
-
-	    std::random_device rd;
-	    std::mt19937 mt;
-	    std::uniform_int_distribution<uint8_t> dist;
-
-	    bool waiting;
+	    // All display writes go through here to keep content_hash
+	    void write_row(size_t row, uint64_t value)
+	    {
+		content_hash ^= word_hash(memory_words + row, display[row]) ^ word_hash(memory_words + row, value);
+		display[row] = value;
+	    }
 
+	    ExecutionObserver* observer = nullptr;
+	    UndoLog* undo = nullptr;
     };
 
 
-    class Chip8Runner : public Chip8State {
-
-        public:
-            Chip8Runner();
-            void run();
-            void destroy();
-
-
-        private:
-            SDL_Window* window = nullptr;
-            SDL_Renderer* renderer = nullptr;
-
-
-            const unsigned int window_width = 64;
-            const unsigned int window_height = 32;
-            const unsigned int window_scale = 16;
-            const unsigned int window_real_width = window_width * window_scale;
-            const unsigned int window_real_height = window_height * window_scale;
-
-            void render_symbol(uint8_t symbol);
-            void render_display();
-
-	    void print_registers();
-	    WINDOW* window_ = nullptr;
+    // Free functions
+    struct Program {
+	std::vector<uint8_t> bytes;
+	SymbolTable symbols;
     };
 
+    // Assembles a whole source file, resolving labels. Blank lines and
+    // comments are skipped, DB emits raw bytes.
+    Program assemble_program(std::istream& source, const std::string& filename="");
+    std::vector<uint8_t> read_rom(const std::string& filename);
 
-    // Free functions
     Instruction assemble(std::string_view instruction, const std::unordered_map<std::string,size_t>& label_map={});
     std::string disassemble(Instruction instuction);
+    // Allocation free, returns the number of characters written, or 0 if
+    // the instruction is invalid or does not fit in the buffer
+    size_t disassemble(Instruction instruction, char* buffer, size_t size);
     std::string get_name_from_hex(Instruction instruction);
     std::vector<std::string> split(std::string_view instruction);
     std::vector<Instruction> get_numbers(const std::vector<std::string>& tokens, const std::unordered_map<std::string,size_t>& label_map={});
@@ -144,12 +181,4 @@ namespace Chip8 {
 
     // Ignore optional Vy for now (set default to 0)
 
-    // Lookup table for tokens
-    //
-
-    enum class Field { ADDR, X, Y, BYTE, NIBBLE, IGNORE };
-
-
-    // Lookup table for constant terms
-
 }
@@ -0,0 +1,226 @@
+#include "corpus.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <stdexcept>
+
+#include "chip8.h"
+#include "disassembly.h"
+
+namespace Chip8 {
+
+    std::vector<uint8_t> CorpusEntry::load() const
+    {
+	if (path.empty())
+	    return bytes;
+	return read_rom(path.string());
+    }
+
+    std::vector<CorpusEntry> read_tar(std::istream& in)
+    {
+	std::vector<CorpusEntry> entries;
+	std::array<char,512> header;
+
+	while (in.read(header.data(), header.size())) {
+	    // Archive ends with zero blocks
+	    if (header[0] == '\0')
+		break;
+
+	    const auto field = [&](size_t offset, size_t length) {
+		return std::string(header.data() + offset, strnlen(header.data() + offset, length));
+	    };
+
+	    const size_t size = std::stoull("0" + field(124, 12), nullptr, 8);
+	    const char type = header[156];
+
+	    std::string name = field(0, 100);
+	    if (field(257, 5) == "ustar" && header[345] != '\0')
+		name = field(345, 155) + "/" + name;
+
+	    std::vector<uint8_t> bytes(size);
+	    if (!in.read(reinterpret_cast<char*>(bytes.data()), size))
+		throw std::runtime_error("Truncated tar archive");
+	    in.ignore((512 - size % 512) % 512);
+
+	    if (type == '0' || type == '\0')
+		entries.push_back({name, {}, std::move(bytes)});
+	}
+
+	return entries;
+    }
+
+    std::vector<CorpusEntry> list_corpus(const std::filesystem::path& path)
+    {
+	namespace fs = std::filesystem;
+
+	if (fs::is_regular_file(path)) {
+	    std::ifstream in(path, std::ios::binary);
+	    return read_tar(in);
+	}
+
+	std::vector<CorpusEntry> entries;
+	for (const auto& file : fs::recursive_directory_iterator(path)) {
+	    if (file.is_regular_file())
+		entries.push_back({fs::relative(file.path(), path).string(), file.path(), {}});
+	}
+
+	// Directory order is unspecified, keep output reproducible
+	std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.name < b.name; });
+	return entries;
+    }
+
+
+    bool is_schip(Instruction instruction)
+    {
+	const uint8_t kk = instruction & 0x00FF;
+
+	if ((instruction & 0xFFF0) == 0x00C0)
+	    return true;
+	if (instruction >= 0x00FB && instruction <= 0x00FF)
+	    return true;
+	if ((instruction & 0xF00F) == 0xD000)
+	    return true;
+	if ((instruction & 0xF000) == 0xF000 && (kk == 0x30 || kk == 0x75 || kk == 0x85))
+	    return true;
+	return false;
+    }
+
+    RomStats collect_stats(std::string name, const std::vector<uint8_t>& rom)
+    {
+	RomStats stats;
+	stats.name = std::move(name);
+	stats.size = rom.size();
+
+	const auto disassembly = analyse(rom);
+
+	for (size_t i=0; i+1<rom.size(); ++i) {
+	    const Instruction instruction = (rom[i] << 8) | rom[i+1];
+	    const auto kind = disassembly.kinds[i];
+
+	    if (kind == ByteKind::Instruction) {
+		stats.opcodes[static_cast<size_t>(decode(instruction))]++;
+		if (is_schip(instruction))
+		    stats.schip_instructions++;
+		else if (decode(instruction) == Opcode::SYS)
+		    stats.sys_calls++;
+	    }
+	    // The walk stops at words that do not decode, catch the
+	    // SUPER-CHIP ones it fell through to
+	    else if (i > 0 && disassembly.kinds[i-1] == ByteKind::Operand && is_schip(instruction)) {
+		stats.schip_instructions++;
+	    }
+	}
+
+	stats.code_bytes = disassembly.code_bytes();
+	stats.data_bytes = stats.size - stats.code_bytes;
+	return stats;
+    }
+
+
+    void CorpusStats::add(const RomStats& rom)
+    {
+	roms++;
+	total_size += rom.size;
+	min_size = std::min(min_size, rom.size);
+	max_size = std::max(max_size, rom.size);
+	code_bytes += rom.code_bytes;
+	data_bytes += rom.data_bytes;
+	roms_with_sys += rom.sys_calls > 0;
+	roms_with_schip += rom.schip_instructions > 0;
+	for (size_t i=0; i<opcodes.size(); ++i)
+	    opcodes[i] += rom.opcodes[i];
+	size_histogram[std::min<size_t>(rom.size / 256, size_histogram.size()-1)]++;
+    }
+
+    void CorpusStats::merge(const CorpusStats& other)
+    {
+	roms += other.roms;
+	failed += other.failed;
+	total_size += other.total_size;
+	min_size = std::min(min_size, other.min_size);
+	max_size = std::max(max_size, other.max_size);
+	code_bytes += other.code_bytes;
+	data_bytes += other.data_bytes;
+	roms_with_sys += other.roms_with_sys;
+	roms_with_schip += other.roms_with_schip;
+	for (size_t i=0; i<opcodes.size(); ++i)
+	    opcodes[i] += other.opcodes[i];
+	for (size_t i=0; i<size_histogram.size(); ++i)
+	    size_histogram[i] += other.size_histogram[i];
+    }
+
+
+    namespace {
+	void write_string(std::ostream& out, const std::string& s)
+	{
+	    out << '"';
+	    for (const char c : s) {
+		if (c == '"' || c == '\\')
+		    out << '\\' << c;
+		else if (static_cast<unsigned char>(c) < 0x20)
+		    out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec;
+		else
+		    out << c;
+	    }
+	    out << '"';
+	}
+
+	template<typename Counts>
+	void write_opcodes(std::ostream& out, const Counts& opcodes)
+	{
+	    out << '{';
+	    bool first = true;
+	    for (size_t i=0; i<opcodes.size(); ++i) {
+		if (opcodes[i] == 0)
+		    continue;
+		if (!first)
+		    out << ", ";
+		first = false;
+		write_string(out, std::string(opcode_info[i].name));
+		out << ": " << opcodes[i];
+	    }
+	    out << '}';
+	}
+    }
+
+    void write_json(std::ostream& out, const RomStats& stats)
+    {
+	out << "{\"name\": ";
+	write_string(out, stats.name);
+	out << ", \"size\": " << stats.size
+	    << ", \"code_bytes\": " << stats.code_bytes
+	    << ", \"data_bytes\": " << stats.data_bytes
+	    << ", \"data_ratio\": " << stats.data_ratio()
+	    << ", \"sys_calls\": " << stats.sys_calls
+	    << ", \"schip_instructions\": " << stats.schip_instructions
+	    << ", \"opcodes\": ";
+	write_opcodes(out, stats.opcodes);
+	out << "}\n";
+    }
+
+    void write_json(std::ostream& out, const CorpusStats& stats)
+    {
+	const auto ratio = stats.total_size == 0 ? 0.0 : static_cast<double>(stats.data_bytes) / stats.total_size;
+
+	out << "{\"roms\": " << stats.roms
+	    << ", \"failed\": " << stats.failed
+	    << ", \"total_size\": " << stats.total_size
+	    << ", \"min_size\": " << (stats.roms == 0 ? 0 : stats.min_size)
+	    << ", \"max_size\": " << stats.max_size
+	    << ", \"mean_size\": " << (stats.roms == 0 ? 0.0 : static_cast<double>(stats.total_size) / stats.roms)
+	    << ", \"code_bytes\": " << stats.code_bytes
+	    << ", \"data_bytes\": " << stats.data_bytes
+	    << ", \"data_ratio\": " << ratio
+	    << ", \"roms_with_sys\": " << stats.roms_with_sys
+	    << ", \"roms_with_schip\": " << stats.roms_with_schip
+	    << ", \"size_histogram_256\": [";
+	for (size_t i=0; i<stats.size_histogram.size(); ++i)
+	    out << (i == 0 ? "" : ", ") << stats.size_histogram[i];
+	out << "], \"opcodes\": ";
+	write_opcodes(out, stats.opcodes);
+	out << "}\n";
+    }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include "decode.h"
+
+namespace Chip8 {
+
+    // A rom in a corpus. Roms from a directory are read lazily from path,
+    // roms from an archive are already in bytes.
+    struct CorpusEntry {
+	std::string name;
+	std::filesystem::path path;
+	std::vector<uint8_t> bytes;
+
+	std::vector<uint8_t> load() const;
+    };
+
+    // A directory (searched recursively) or an uncompressed tar archive
+    std::vector<CorpusEntry> list_corpus(const std::filesystem::path& path);
+    std::vector<CorpusEntry> read_tar(std::istream& in);
+
+    struct RomStats {
+	std::string name;
+	size_t size = 0;
+	size_t code_bytes = 0;
+	size_t data_bytes = 0;
+	// Reachable instructions only
+	std::array<uint32_t,opcode_count> opcodes{0};
+	uint32_t sys_calls = 0;
+	uint32_t schip_instructions = 0;
+
+	double data_ratio() const { return size == 0 ? 0.0 : static_cast<double>(data_bytes) / size; }
+    };
+
+    // SUPER-CHIP extensions. Some of them decode as SYS or DRW here.
+    bool is_schip(Instruction instruction);
+
+    RomStats collect_stats(std::string name, const std::vector<uint8_t>& rom);
+
+    struct CorpusStats {
+	size_t roms = 0;
+	size_t failed = 0;
+	size_t total_size = 0;
+	size_t min_size = SIZE_MAX;
+	size_t max_size = 0;
+	size_t code_bytes = 0;
+	size_t data_bytes = 0;
+	size_t roms_with_sys = 0;
+	size_t roms_with_schip = 0;
+	std::array<uint64_t,opcode_count> opcodes{0};
+	// Roms per 256 byte bucket of size
+	std::array<uint32_t,16> size_histogram{0};
+
+	void add(const RomStats& rom);
+	void merge(const CorpusStats& other);
+    };
+
+    void write_json(std::ostream& out, const RomStats& stats);
+    void write_json(std::ostream& out, const CorpusStats& stats);
+
+}
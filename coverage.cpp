@@ -0,0 +1,129 @@
+#include "coverage.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+
+#include "binary.h"
+#include "chip8.h"
+#include "disassembly.h"
+
+namespace Chip8 {
+
+    namespace {
+	constexpr char magic[4] = {'C', '8', 'C', 'V'};
+	constexpr uint8_t version = 1;
+    }
+
+    size_t Bitmap::count() const
+    {
+	size_t total = 0;
+	for (const auto word : words)
+	    total += __builtin_popcountll(word);
+	return total;
+    }
+
+    Bitmap& Bitmap::operator|=(const Bitmap& other)
+    {
+	for (size_t i=0; i<words.size(); ++i)
+	    words[i] |= other.words[i];
+	return *this;
+    }
+
+
+    void Coverage::merge(const Coverage& other)
+    {
+	executed |= other.executed;
+	read |= other.read;
+	drawn |= other.drawn;
+	written |= other.written;
+    }
+
+    void Coverage::write(std::ostream& out) const
+    {
+	std::vector<uint8_t> data(std::begin(magic), std::end(magic));
+	data.push_back(version);
+	for (const auto* bitmap : {&executed, &read, &drawn, &written})
+	    for (const auto word : bitmap->words)
+		put<uint64_t>(data, word);
+	out.write(reinterpret_cast<const char*>(data.data()), data.size());
+    }
+
+    Coverage Coverage::read_from(std::istream& in)
+    {
+	const std::vector<uint8_t> data{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+	Reader reader(data.data(), data.size(), "coverage");
+
+	if (std::memcmp(reader.take(sizeof(magic)), magic, sizeof(magic)) != 0)
+	    throw std::runtime_error("Not a coverage file");
+	if (reader.get<uint8_t>() != version)
+	    throw std::runtime_error("Unsupported coverage version");
+
+	Coverage coverage;
+	for (auto* bitmap : {&coverage.executed, &coverage.read, &coverage.drawn, &coverage.written})
+	    for (auto& word : bitmap->words)
+		word = reader.get<uint64_t>();
+	return coverage;
+    }
+
+
+    void CoverageRecorder::executed(const Chip8State& m, uint16_t pc, Instruction instruction)
+    {
+	coverage.executed.set(pc);
+
+	const uint16_t I = m.get_I_register();
+	const uint8_t x = (instruction & 0x0F00) >> 8;
+	switch (decode(instruction)) {
+	    case Opcode::DRW: {
+		const uint8_t y = m.get_register((instruction & 0x00F0) >> 4) % Chip8State::display_height;
+		const uint8_t rows = std::min<size_t>(instruction & 0x000F, Chip8State::display_height - y);
+		for (uint16_t i=0; i<rows; ++i) {
+		    coverage.read.set(I + i);
+		    coverage.drawn.set(I + i);
+		}
+		break;
+	    }
+	    case Opcode::LDVxI:
+		for (uint16_t i=0; i<=x; ++i)
+		    coverage.read.set(I + i);
+		break;
+	    case Opcode::LDBVx:
+		for (uint16_t i=0; i<3; ++i)
+		    coverage.written.set(I + i);
+		break;
+	    case Opcode::LDIVx:
+		for (uint16_t i=0; i<=x; ++i)
+		    coverage.written.set(I + i);
+		break;
+	    default:
+		break;
+	}
+
+	if (next)
+	    next->executed(m, pc, instruction);
+    }
+
+
+    CoverageSummary summarise(const Coverage& coverage, const Disassembly& disassembly)
+    {
+	CoverageSummary summary;
+	summary.rom_bytes = disassembly.kinds.size();
+	for (size_t i=0; i<disassembly.kinds.size(); ++i) {
+	    const uint16_t addr = disassembly.start + i;
+	    const auto kind = disassembly.kinds[i];
+	    const bool fetched = coverage.fetched(addr);
+
+	    if (kind == ByteKind::Instruction || kind == ByteKind::Operand) {
+		summary.code_bytes++;
+		if (fetched)
+		    summary.executed_code_bytes++;
+	    }
+	    if (fetched || coverage.read.test(addr) || coverage.written.test(addr))
+		summary.touched_bytes++;
+	}
+	return summary;
+    }
+
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <vector>
+
+#include "observer.h"
+
+namespace Chip8 {
+
+    struct Disassembly;
+
+    // One bit per address of the 4K memory
+    struct Bitmap {
+	std::array<uint64_t,0x1000/64> words{};
+
+	void set(uint16_t addr) { addr &= 0xFFF; words[addr/64] |= uint64_t{1} << (addr%64); }
+	bool test(uint16_t addr) const { addr &= 0xFFF; return (words[addr/64] >> (addr%64)) & 1; }
+	size_t count() const;
+
+	Bitmap& operator|=(const Bitmap& other);
+	bool operator==(const Bitmap& other) const { return words == other.words; }
+    };
+
+    // What a run did with every byte of memory. Coverage of several runs
+    // is the union of their bitmaps.
+    struct Coverage {
+	// Address an instruction was fetched from, its second byte is not set
+	Bitmap executed;
+	// Read through I by DRW or LD Vx, [I]
+	Bitmap read;
+	// Subset of read, by DRW
+	Bitmap drawn;
+	// Written through I by LD B, Vx or LD [I], Vx
+	Bitmap written;
+
+	bool fetched(uint16_t addr) const { return executed.test(addr) || executed.test(addr-1); }
+
+	void merge(const Coverage& other);
+
+	void write(std::ostream& out) const;
+	static Coverage read_from(std::istream& in);
+    };
+
+    // Collects coverage of every instruction executed through step()
+    class CoverageRecorder : public ExecutionObserver {
+	public:
+	    explicit CoverageRecorder(ExecutionObserver* next=nullptr) : next(next) {}
+
+	    void executed(const Chip8State& m, uint16_t pc, Instruction instruction) override;
+
+	    Coverage coverage;
+
+	private:
+	    ExecutionObserver* next = nullptr;
+    };
+
+    struct CoverageSummary {
+	// Bytes of code found by analyse(), and how many of them ran
+	size_t code_bytes = 0;
+	size_t executed_code_bytes = 0;
+	// Rom bytes fetched, read or written at all
+	size_t rom_bytes = 0;
+	size_t touched_bytes = 0;
+
+	double code_percent() const { return code_bytes == 0 ? 0.0 : 100.0 * executed_code_bytes / code_bytes; }
+	double rom_percent() const { return rom_bytes == 0 ? 0.0 : 100.0 * touched_bytes / rom_bytes; }
+    };
+
+    CoverageSummary summarise(const Coverage& coverage, const Disassembly& disassembly);
+
+}
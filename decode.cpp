@@ -0,0 +1,87 @@
+#include "decode.h"
+
+namespace Chip8 {
+
+    namespace {
+	constexpr Opcode decode_slow(Instruction instruction)
+	{
+	    const uint8_t first = instruction >> 12;
+	    const uint8_t nibble = instruction & 0x000F;
+	    const uint8_t kk = instruction & 0x00FF;
+
+	    switch (first) {
+		case 0x0:
+		    if (instruction == 0x00E0) return Opcode::CLS;
+		    if (instruction == 0x00EE) return Opcode::RET;
+		    return Opcode::SYS;
+		case 0x1: return Opcode::JPaddr;
+		case 0x2: return Opcode::CALL;
+		case 0x3: return Opcode::SEVxbyte;
+		case 0x4: return Opcode::SNEVxbyte;
+		case 0x5: return nibble == 0 ? Opcode::SEVxVy : Opcode::Invalid;
+		case 0x6: return Opcode::LDVxbyte;
+		case 0x7: return Opcode::ADDVxbyte;
+		case 0x8:
+		    switch (nibble) {
+			case 0x0: return Opcode::LDVxVy;
+			case 0x1: return Opcode::OR;
+			case 0x2: return Opcode::AND;
+			case 0x3: return Opcode::XOR;
+			case 0x4: return Opcode::ADDVxVy;
+			case 0x5: return Opcode::SUB;
+			case 0x6: return Opcode::SHR;
+			case 0x7: return Opcode::SUBN;
+			case 0xE: return Opcode::SHL;
+		    }
+		    return Opcode::Invalid;
+		case 0x9: return nibble == 0 ? Opcode::SNEVxVy : Opcode::Invalid;
+		case 0xA: return Opcode::LDIaddr;
+		case 0xB: return Opcode::JPV0addr;
+		case 0xC: return Opcode::RND;
+		case 0xD: return Opcode::DRW;
+		case 0xE:
+		    if (kk == 0x9E) return Opcode::SKP;
+		    if (kk == 0xA1) return Opcode::SKNP;
+		    return Opcode::Invalid;
+		case 0xF:
+		    switch (kk) {
+			case 0x07: return Opcode::LDVxDT;
+			case 0x0A: return Opcode::LDVxK;
+			case 0x15: return Opcode::LDDTVx;
+			case 0x18: return Opcode::LDSTVx;
+			case 0x1E: return Opcode::ADDIVx;
+			case 0x29: return Opcode::LDFVx;
+			case 0x33: return Opcode::LDBVx;
+			case 0x55: return Opcode::LDIVx;
+			case 0x65: return Opcode::LDVxI;
+		    }
+		    return Opcode::Invalid;
+	    }
+	    return Opcode::Invalid;
+	}
+
+	constexpr std::array<Opcode,0x10000> make_decode_table()
+	{
+	    std::array<Opcode,0x10000> table{};
+	    for (uint32_t i=0; i<table.size(); ++i)
+		table[i] = decode_slow(static_cast<Instruction>(i));
+	    return table;
+	}
+    }
+
+    constexpr std::array<Opcode,0x10000> decode_table = make_decode_table();
+
+    static_assert(decode_table[0x00E0] == Opcode::CLS);
+    static_assert(decode_table[0x0123] == Opcode::SYS);
+    static_assert(decode_table[0x8AB6] == Opcode::SHR);
+    static_assert(decode_table[0x5121] == Opcode::Invalid);
+    static_assert(decode_table[0xF465] == Opcode::LDVxI);
+
+    Opcode find_opcode(std::string_view name)
+    {
+	for (size_t i=1; i<opcode_count; ++i)
+	    if (opcode_info[i].name == name)
+		return static_cast<Opcode>(i);
+	return Opcode::Invalid;
+    }
+}
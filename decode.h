@@ -0,0 +1,127 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace Chip8 {
+
+    using Instruction = uint16_t;
+
+    enum class Field : uint8_t { ADDR, X, Y, BYTE, NIBBLE, IGNORE };
+
+    enum class Opcode : uint8_t {
+	Invalid,
+	CLS, RET, SYS, JPaddr, CALL, SEVxbyte, SNEVxbyte, SEVxVy, LDVxbyte, ADDVxbyte,
+	LDVxVy, OR, AND, XOR, ADDVxVy, SUB, SHR, SUBN, SHL, SNEVxVy, LDIaddr, JPV0addr,
+	RND, DRW, SKP, SKNP, LDVxDT, LDVxK, LDDTVx, LDSTVx, ADDIVx, LDFVx, LDBVx, LDIVx, LDVxI,
+	Count
+    };
+
+    constexpr size_t opcode_count = static_cast<size_t>(Opcode::Count);
+
+    // Everything the assembler and disassembler need to know about an opcode.
+    // Text is formatted as literals[0] fields[0] literals[1] fields[1] ...
+    // while operands are the numbers the assembler finds in the source.
+    struct OpcodeInfo {
+	std::string_view name;
+	Instruction base;
+	uint8_t literal_count;
+	std::array<std::string_view,3> literals;
+	uint8_t field_count;
+	std::array<Field,3> fields;
+	uint8_t operand_count;
+	std::array<Field,3> operands;
+    };
+
+    namespace detail {
+	constexpr OpcodeInfo info(std::string_view name, Instruction base,
+		std::array<std::string_view,3> literals, uint8_t literal_count,
+		std::array<Field,3> fields, uint8_t field_count)
+	{
+	    return { name, base, literal_count, literals, field_count, fields, field_count, fields };
+	}
+    }
+
+    inline constexpr std::array<OpcodeInfo,opcode_count> opcode_info = [] {
+	using detail::info;
+	constexpr auto X = Field::X, Y = Field::Y, ADDR = Field::ADDR, BYTE = Field::BYTE, NIBBLE = Field::NIBBLE;
+
+	std::array<OpcodeInfo,opcode_count> table = {{
+	    info("INVALID"  , 0x0000, {}, 0, {}, 0),
+	    info("CLS"      , 0x00E0, {"CLS"}, 1, {}, 0),
+	    info("RET"      , 0x00EE, {"RET"}, 1, {}, 0),
+	    info("SYS"      , 0x0000, {"SYS "}, 1, {ADDR}, 1),
+	    info("JPaddr"   , 0x1000, {"JP "}, 1, {ADDR}, 1),
+	    info("CALL"     , 0x2000, {"CALL "}, 1, {ADDR}, 1),
+	    info("SEVxbyte" , 0x3000, {"SE V", ", "}, 2, {X, BYTE}, 2),
+	    info("SNEVxbyte", 0x4000, {"SNE V", ", "}, 2, {X, BYTE}, 2),
+	    info("SEVxVy"   , 0x5000, {"SE V", ", V"}, 2, {X, Y}, 2),
+	    info("LDVxbyte" , 0x6000, {"LD V", ", "}, 2, {X, BYTE}, 2),
+	    info("ADDVxbyte", 0x7000, {"ADD V", ", "}, 2, {X, BYTE}, 2),
+	    info("LDVxVy"   , 0x8000, {"LD V", ", V"}, 2, {X, Y}, 2),
+	    info("OR"       , 0x8001, {"OR V", ", V"}, 2, {X, Y}, 2),
+	    info("AND"      , 0x8002, {"AND V", ", V"}, 2, {X, Y}, 2),
+	    info("XOR"      , 0x8003, {"XOR V", ", V"}, 2, {X, Y}, 2),
+	    info("ADDVxVy"  , 0x8004, {"ADD V", ", V"}, 2, {X, Y}, 2),
+	    info("SUB"      , 0x8005, {"SUB V", ", V"}, 2, {X, Y}, 2),
+	    info("SHR"      , 0x8006, {"SHR V", ", V"}, 2, {X, Y}, 2),
+	    info("SUBN"     , 0x8007, {"SUBN V", ", V"}, 2, {X, Y}, 2),
+	    info("SHL"      , 0x800E, {"SHL V", ", V"}, 2, {X, Y}, 2),
+	    info("SNEVxVy"  , 0x9000, {"SNE V", ", V"}, 2, {X, Y}, 2),
+	    info("LDIaddr"  , 0xA000, {"LD I, "}, 1, {ADDR}, 1),
+	    info("JPV0addr" , 0xB000, {"JP V0, "}, 1, {ADDR}, 1),
+	    info("RND"      , 0xC000, {"RND V", ", "}, 2, {X, BYTE}, 2),
+	    info("DRW"      , 0xD000, {"DRW V", ", V", ", "}, 3, {X, Y, NIBBLE}, 3),
+	    info("SKP"      , 0xE09E, {"SKP V"}, 1, {X}, 1),
+	    info("SKNP"     , 0xE0A1, {"SKNP V"}, 1, {X}, 1),
+	    info("LDVxDT"   , 0xF007, {"LD V", ", DT"}, 2, {X}, 1),
+	    info("LDVxK"    , 0xF00A, {"LD V", ", K"}, 2, {X}, 1),
+	    info("LDDTVx"   , 0xF015, {"LD DT, V"}, 1, {X}, 1),
+	    info("LDSTVx"   , 0xF018, {"LD ST, V"}, 1, {X}, 1),
+	    info("ADDIVx"   , 0xF01E, {"ADD I, V"}, 1, {X}, 1),
+	    info("LDFVx"    , 0xF029, {"LD F, V"}, 1, {X}, 1),
+	    info("LDBVx"    , 0xF033, {"LD B, V"}, 1, {X}, 1),
+	    info("LDIVx"    , 0xF055, {"LD [I], V"}, 1, {X}, 1),
+	    info("LDVxI"    , 0xF065, {"LD V", ", [I]"}, 2, {X}, 1),
+	}};
+
+	// The V0 in JP V0, addr is parsed as a number by the assembler
+	auto& jp_v0 = table[static_cast<size_t>(Opcode::JPV0addr)];
+	jp_v0.operand_count = 2;
+	jp_v0.operands = {Field::IGNORE, ADDR};
+	return table;
+    }();
+
+    constexpr const OpcodeInfo& get_info(Opcode opcode) { return opcode_info[static_cast<size_t>(opcode)]; }
+
+    constexpr int get_field(Instruction instruction, Field field)
+    {
+	switch (field) {
+	    // 0x0nnn
+	    case Field::ADDR:
+		return 0x0FFF & instruction;
+	    case Field::BYTE:
+		return 0x00FF & instruction;
+	    case Field::X:
+		return (0x0F00 & instruction) >> 8;
+	    case Field::Y:
+		return (0x00F0 & instruction) >> 4;
+	    case Field::NIBBLE:
+		return 0x000F & instruction;
+	    case Field::IGNORE:
+		return 0;
+	}
+	return 0;
+    }
+
+    // Generated at compile time, one entry per possible instruction word
+    extern const std::array<Opcode,0x10000> decode_table;
+
+    inline Opcode decode(Instruction instruction) { return decode_table[instruction]; }
+
+    // Linear search over the opcode names, Opcode::Invalid if not found
+    Opcode find_opcode(std::string_view name);
+
+}
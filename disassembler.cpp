@@ -1,48 +1,130 @@
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <string>
-#include <iomanip>
-#include <bitset>
+#include <chrono>
+#include <filesystem>
+#include <optional>
 
 #include "chip8.h"
+#include "corpus.h"
+#include "disassembly.h"
+#include "parallel.h"
 
 using namespace Chip8;
 
-int main(int argc, char** argv)
+// Statistics for every rom in a directory or tar archive. Writes one json
+// file per rom, in the same directories as in the corpus, and corpus.json
+// with the totals, into outdir.
+static int run_corpus(const std::filesystem::path& corpus, const std::filesystem::path& outdir, unsigned int threads)
 {
-    std::string filename { argv[1] }; 
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<CorpusEntry> entries;
+    try {
+	entries = list_corpus(corpus);
+    } catch (const std::exception& e) {
+	std::cerr << "Could not read corpus: " << e.what() << '\n';
+	return 1;
+    }
+    std::filesystem::create_directories(outdir);
+
+    std::vector<std::optional<RomStats>> results(entries.size());
+    parallel_for(entries.size(), [&](size_t i) {
+	std::vector<uint8_t> rom;
+	try {
+	    rom = entries[i].load();
+	} catch (const std::exception& e) {
+	    return;
+	}
+
+	results[i] = collect_stats(entries[i].name, rom);
+
+	// Same layout as the corpus, except for tar entries that would end
+	// up outside outdir
+	const std::filesystem::path name(entries[i].name + ".json");
+	if (name.has_root_path() || std::any_of(name.begin(), name.end(), [](const auto& part) { return part == ".."; }))
+	    return;
+	const auto filename = outdir / name;
+	std::error_code error;
+	std::filesystem::create_directories(filename.parent_path(), error);
+	std::ofstream out(filename);
+	write_json(out, *results[i]);
+    }, threads);
 
-    std::ifstream inputfile;
-    inputfile.open(argv[1], std::ios::in | std::ios::binary);
+    CorpusStats total;
+    for (const auto& result : results) {
+	if (result)
+	    total.add(*result);
+	else
+	    total.failed++;
+    }
+
+    std::ofstream out(outdir / "corpus.json");
+    write_json(out, total);
 
-    if (!inputfile) {
-	std::cerr << "Could not open file\n";
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << total.roms << " roms (" << total.failed << " failed) in " << elapsed.count() << "s\n";
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+	std::cerr << "Usage: " << argv[0] << " <rom> [--coverage file.cov]...\n"
+		  << "       " << argv[0] << " --corpus <directory|archive.tar> <outdir> [-j threads]\n";
 	return 1;
     }
 
-    size_t counter = 0x200;
-    Instruction instruction; 
-    while (inputfile.good() && !inputfile.eof()) {
+    if (std::string(argv[1]) == "--corpus") {
+	if (argc < 4) {
+	    std::cerr << "--corpus needs a corpus and an output directory\n";
+	    return 1;
+	}
+	unsigned int threads = default_threads();
+	if (argc > 5 && std::string(argv[4]) == "-j")
+	    threads = std::stoul(argv[5]);
+	return run_corpus(argv[2], argv[3], threads);
+    }
 
-	inputfile.read((char*)(&instruction), sizeof(Instruction)); 
-	uint16_t rev_endian = ((instruction & 0x00ff) << 8 ) | ((instruction & 0xff00) >> 8);
+    std::vector<uint8_t> rom;
+    try {
+	rom = read_rom(argv[1]);
+    } catch (const std::exception& e) {
+	std::cerr << e.what() << '\n';
+	return 1;
+    }
 
-	std::string text_other;
+    // Coverage files of several runs are merged
+    std::optional<Coverage> coverage;
+    for (int i=2; i+1<argc; i+=2) {
+	if (std::string(argv[i]) != "--coverage")
+	    continue;
+	std::ifstream in(argv[i+1], std::ios::binary);
 	try {
-	    text_other = disassemble(rev_endian);
-	    std::cout << std::dec << counter << ' ' << std::hex << rev_endian << ' ' << text_other << '\n';
-	    counter += 2;
-	} catch (std::exception e) {
-	    // TODO: Write out binary representation (must be sprite?)
-	    auto part1 = (rev_endian & 0xff00) >> 8;
-	    auto part2 = (rev_endian & 0x00ff);
-
-	    std::cout << std::dec << counter << ' ' << std::hex << part1 << ' ' << std::bitset<8>(part1) << '\n';
-	    counter++;
-	    std::cout << std::dec << counter << ' ' << std::hex << part2 << ' ' << std::bitset<8>(part2) << '\n';
-	    counter++;
+	    if (!in)
+		throw std::runtime_error(std::string("Could not open ") + argv[i+1]);
+	    const auto run = Coverage::read_from(in);
+	    if (!coverage)
+		coverage = run;
+	    else
+		coverage->merge(run);
+	} catch (const std::exception& e) {
+	    std::cerr << e.what() << '\n';
+	    return 1;
 	}
+    }
 
+    const Coverage* runs = coverage ? &*coverage : nullptr;
+    const auto disassembly = analyse(rom, Chip8State::program_start, runs);
+    write_source(std::cout, rom, disassembly, runs);
+
+    if (runs) {
+	const auto summary = summarise(*runs, disassembly);
+	std::cerr << "Executed " << summary.executed_code_bytes << " of " << summary.code_bytes << " code bytes ("
+		  << summary.code_percent() << "%), touched " << summary.touched_bytes << " of "
+		  << summary.rom_bytes << " rom bytes (" << summary.rom_percent() << "%)\n";
     }
+
     return 0;
 }
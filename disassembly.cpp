@@ -0,0 +1,240 @@
+#include "disassembly.h"
+
+#include <algorithm>
+#include <bitset>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+namespace Chip8 {
+
+    size_t Disassembly::code_bytes() const
+    {
+	return std::count_if(kinds.begin(), kinds.end(), [](ByteKind k) {
+	    return k == ByteKind::Instruction || k == ByteKind::Operand;
+	});
+    }
+
+    bool is_canonical(Instruction instruction)
+    {
+	return decode(instruction) != Opcode::Invalid;
+    }
+
+
+    Disassembly analyse(const std::vector<uint8_t>& rom, uint16_t start, const Coverage* coverage)
+    {
+	Disassembly result;
+	result.start = start;
+	result.kinds.assign(rom.size(), ByteKind::Unknown);
+	result.labels.assign(rom.size(), false);
+
+	// I is tracked along each path so DRW can mark its sprite, -1 if unknown
+	struct Path {
+	    size_t addr;
+	    int I;
+	};
+	struct Range {
+	    size_t addr;
+	    size_t length;
+	    ByteKind kind;
+	};
+
+	std::vector<Path> pending{{start, -1}};
+	std::vector<Range> referenced;
+
+	// What really ran is walked first, so it wins over static guesses
+	if (coverage) {
+	    for (size_t addr=start; addr<start+rom.size(); ++addr) {
+		if (coverage->executed.test(addr))
+		    pending.push_back({addr, -1});
+		if (coverage->drawn.test(addr))
+		    referenced.push_back({addr, 1, ByteKind::Sprite});
+		else if (coverage->read.test(addr) || coverage->written.test(addr))
+		    referenced.push_back({addr, 1, ByteKind::Data});
+	    }
+	}
+
+	auto mark_label = [&](size_t addr) {
+	    if (result.contains(addr))
+		result.labels[addr-start] = true;
+	};
+
+	// Last known I each instruction was walked with, so code that was
+	// first reached with an unknown I is walked again once I is known
+	std::vector<int> walked_with(rom.size(), -1);
+
+	while (!pending.empty()) {
+	    auto [addr, I] = pending.back();
+	    pending.pop_back();
+
+	    while (result.contains(addr) && result.contains(addr+1)) {
+		const auto kind = result.kinds[addr-start];
+		if (kind == ByteKind::Instruction) {
+		    if (I < 0 || walked_with[addr-start] == I)
+			break;
+		}
+		// Would overlap another instruction
+		else if (kind != ByteKind::Unknown || result.kinds[addr+1-start] != ByteKind::Unknown)
+		    break;
+
+		const Instruction instruction = (rom[addr-start] << 8) | rom[addr+1-start];
+		if (!is_canonical(instruction))
+		    break;
+
+		result.kinds[addr-start] = ByteKind::Instruction;
+		result.kinds[addr+1-start] = ByteKind::Operand;
+		walked_with[addr-start] = I;
+
+		const uint8_t first = instruction >> 12;
+		const uint8_t x = (instruction & 0x0F00) >> 8;
+		const uint8_t kk = instruction & 0x00FF;
+		const uint16_t nnn = instruction & 0x0FFF;
+
+		if (instruction == 0x00EE)
+		    break;
+		else if (first == 0x1 || first == 0xB) {
+		    mark_label(nnn);
+		    pending.push_back({nnn, I});
+		    break;
+		}
+		else if (first == 0x2) {
+		    // The subroutine starts with our I, but may change it
+		    mark_label(nnn);
+		    pending.push_back({nnn, I});
+		    I = -1;
+		}
+		else if (first == 0x3 || first == 0x4 || first == 0x5 || first == 0x9 || first == 0xE) {
+		    mark_label(addr+4);
+		    pending.push_back({addr+4, I});
+		}
+		else if (first == 0xA) {
+		    mark_label(nnn);
+		    I = nnn;
+		}
+		else if (first == 0xD && I >= 0) {
+		    referenced.push_back({static_cast<size_t>(I), static_cast<size_t>(instruction & 0x000F), ByteKind::Sprite});
+		}
+		else if (first == 0xF && (kk == 0x1E || kk == 0x29)) {
+		    I = -1;
+		}
+		else if (first == 0xF && kk == 0x33 && I >= 0) {
+		    referenced.push_back({static_cast<size_t>(I), 3, ByteKind::Data});
+		}
+		else if (first == 0xF && (kk == 0x55 || kk == 0x65) && I >= 0) {
+		    referenced.push_back({static_cast<size_t>(I), static_cast<size_t>(x) + 1, ByteKind::Data});
+		}
+
+		addr += 2;
+	    }
+	}
+
+	// Code wins if a data reference overlaps it
+	for (const auto& range : referenced) {
+	    for (size_t addr=range.addr; addr<range.addr+range.length; ++addr) {
+		if (result.contains(addr) && result.kinds[addr-start] == ByteKind::Unknown)
+		    result.kinds[addr-start] = range.kind;
+	    }
+	}
+
+	for (size_t i=0; i<result.kinds.size(); ++i) {
+	    if (result.kinds[i] == ByteKind::Unknown)
+		result.kinds[i] = ByteKind::Data;
+	    // Can not put a label in the middle of an instruction
+	    if (result.kinds[i] == ByteKind::Operand)
+		result.labels[i] = false;
+	}
+
+	return result;
+    }
+
+
+    namespace {
+	// "xrw" with - for what did not happen to any byte in [from, to)
+	std::string coverage_marks(const Coverage& coverage, size_t from, size_t to)
+	{
+	    std::string marks = "---";
+	    for (size_t addr=from; addr<to; ++addr) {
+		if (coverage.fetched(addr))
+		    marks[0] = 'x';
+		if (coverage.read.test(addr))
+		    marks[1] = 'r';
+		if (coverage.written.test(addr))
+		    marks[2] = 'w';
+	    }
+	    return marks;
+	}
+
+	void write_label(std::ostream& out, const Disassembly& disassembly, size_t addr)
+	{
+	    char name[16];
+	    std::snprintf(name, sizeof(name), ":%c%04X:", disassembly.is_code(addr) ? 'L' : 'D', static_cast<unsigned int>(addr));
+	    out << name;
+	}
+    }
+
+    void write_source(std::ostream& out, const std::vector<uint8_t>& rom, const Disassembly& disassembly,
+	    const Coverage* coverage)
+    {
+	const size_t start = disassembly.start;
+	const size_t end = start + rom.size();
+	constexpr size_t data_per_line = 8;
+
+	size_t addr = start;
+	while (addr < end) {
+	    if (disassembly.has_label(addr)) {
+		write_label(out, disassembly, addr);
+		out << '\n';
+	    }
+
+	    const auto kind = disassembly.kind_at(addr);
+	    if (kind == ByteKind::Instruction) {
+		const Instruction instruction = (rom[addr-start] << 8) | rom[addr+1-start];
+		char text[32];
+		std::string_view line(text, disassemble(instruction, text, sizeof(text)));
+
+		// Replace the address operand with its label
+		const auto opcode = decode(instruction);
+		const uint16_t nnn = instruction & 0x0FFF;
+		if ((opcode == Opcode::JPaddr || opcode == Opcode::CALL || opcode == Opcode::LDIaddr || opcode == Opcode::JPV0addr)
+			&& disassembly.has_label(nnn)) {
+		    out << "    " << line.substr(0, line.rfind(' ') + 1);
+		    write_label(out, disassembly, nnn);
+		} else {
+		    out << "    " << line;
+		}
+
+		char comment[24];
+		std::snprintf(comment, sizeof(comment), "  # %03X %04X", static_cast<unsigned int>(addr), instruction);
+		out << comment;
+		if (coverage)
+		    out << ' ' << coverage_marks(*coverage, addr, addr+2);
+		out << '\n';
+		addr += 2;
+	    }
+	    else if (kind == ByteKind::Sprite) {
+		const auto byte = rom[addr-start];
+		auto bits = std::bitset<8>(byte).to_string('.', '#');
+		out << "    DB " << static_cast<int>(byte) << "  # " << bits;
+		if (coverage)
+		    out << ' ' << coverage_marks(*coverage, addr, addr+1);
+		out << '\n';
+		++addr;
+	    }
+	    else {
+		const size_t from = addr;
+		out << "    DB ";
+		size_t count = 0;
+		do {
+		    if (count > 0)
+			out << ", ";
+		    out << static_cast<int>(rom[addr-start]);
+		    ++addr;
+		    ++count;
+		} while (addr < end && count < data_per_line && disassembly.kind_at(addr) == kind && !disassembly.has_label(addr));
+		if (coverage)
+		    out << "  # " << coverage_marks(*coverage, from, addr);
+		out << '\n';
+	    }
+	}
+    }
+}
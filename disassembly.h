@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <vector>
+
+#include "chip8.h"
+#include "coverage.h"
+
+namespace Chip8 {
+
+    enum class ByteKind : uint8_t { Unknown, Instruction, Operand, Sprite, Data };
+
+    // Result of following the control flow of a rom. One entry per rom byte.
+    struct Disassembly {
+	uint16_t start = Chip8State::program_start;
+	std::vector<ByteKind> kinds;
+	// Address is the target of a jump, call or LD I
+	std::vector<bool> labels;
+
+	bool contains(size_t addr) const { return addr >= start && addr < start + kinds.size(); }
+	ByteKind kind_at(size_t addr) const { return contains(addr) ? kinds[addr-start] : ByteKind::Unknown; }
+	bool is_code(size_t addr) const { return kind_at(addr) == ByteKind::Instruction; }
+	bool has_label(size_t addr) const { return contains(addr) && labels[addr-start]; }
+
+	size_t code_bytes() const;
+    };
+
+    // True if the instruction decodes, and assembles back to the same word
+    bool is_canonical(Instruction instruction);
+
+    // Recursive descent from start, following JP/CALL/skip/RET edges.
+    // Memory read through I by DRW is marked as sprite data, everything
+    // never reached as code is plain data. Coverage of real runs adds the
+    // code and data only known at runtime, like JP V0 targets.
+    Disassembly analyse(const std::vector<uint8_t>& rom, uint16_t start=Chip8State::program_start,
+	    const Coverage* coverage=nullptr);
+
+    // Writes source accepted by assemble_program, with generated labels.
+    // With coverage, every line is annotated with x, r and w for bytes
+    // that were executed, read and written.
+    void write_source(std::ostream& out, const std::vector<uint8_t>& rom, const Disassembly& disassembly,
+	    const Coverage* coverage=nullptr);
+
+}
@@ -0,0 +1,129 @@
+#include "env.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace Chip8 {
+
+    namespace {
+	// Envs per job, enough to make handing them out cheap
+	constexpr size_t chunk = 64;
+
+	// The eight pixels of a display byte as bytes, most significant first
+	struct PixelTable {
+	    uint64_t expanded[256];
+
+	    PixelTable()
+	    {
+		for (size_t byte=0; byte<256; ++byte) {
+		    uint8_t pixels[8];
+		    for (size_t bit=0; bit<8; ++bit)
+			pixels[bit] = (byte >> (7-bit)) & 1;
+		    std::memcpy(&expanded[byte], pixels, sizeof(pixels));
+		}
+	    }
+	};
+	const PixelTable pixel_table;
+    }
+
+    VectorEnv::VectorEnv(const std::vector<uint8_t>& rom, size_t count, EnvOptions options)
+	: options{std::move(options)}, envs(count), pool{this->options.threads}
+    {
+	Chip8State machine;
+	machine.load_rom(rom);
+	start = machine.snapshot();
+	for (auto& env : envs)
+	    env.scores.resize(this->options.rewards.size());
+    }
+
+    size_t VectorEnv::observation_size() const
+    {
+	return options.format == ObservationFormat::bits ? sizeof(Display) : Chip8State::display_size;
+    }
+
+    uint64_t VectorEnv::episodes() const
+    {
+	uint64_t total = 0;
+	for (const auto& env : envs)
+	    total += env.episode;
+	return total;
+    }
+
+    uint64_t VectorEnv::read_score(const Chip8State& machine, const RewardSource& source) const
+    {
+	uint64_t value = 0;
+	for (uint8_t i=0; i<source.bytes; ++i)
+	    value = value << 8 | machine.get_memory(source.address + i);
+	return value;
+    }
+
+    void VectorEnv::observe(const Chip8State& machine, uint8_t* observation) const
+    {
+	const auto& display = machine.snapshot().display;
+	if (options.format == ObservationFormat::bits) {
+	    std::memcpy(observation, display.data(), sizeof(display));
+	    return;
+	}
+	for (const auto row : display) {
+	    for (int shift=56; shift>=0; shift-=8) {
+		std::memcpy(observation, &pixel_table.expanded[(row >> shift) & 0xFF], 8);
+		observation += 8;
+	    }
+	}
+    }
+
+    void VectorEnv::reset(size_t i)
+    {
+	auto& env = envs[i];
+	env.machine.restore(start);
+	// Mixed, so neighbouring envs and episodes get unrelated seeds. Odd,
+	// word_hash maps zero to zero.
+	env.machine.seed(word_hash(i, (options.seed + env.episode) * 2 + 1));
+	env.episode++;
+	env.frame = 0;
+	for (size_t r=0; r<options.rewards.size(); ++r)
+	    env.scores[r] = read_score(env.machine, options.rewards[r]);
+    }
+
+    void VectorEnv::reset(uint8_t* observations)
+    {
+	const size_t stride = observation_size();
+	pool.run((envs.size() + chunk - 1) / chunk, [&](size_t c) {
+	    for (size_t i=c*chunk; i<std::min(envs.size(), (c+1)*chunk); ++i) {
+		reset(i);
+		observe(envs[i].machine, observations + i*stride);
+	    }
+	});
+    }
+
+    void VectorEnv::step(size_t i, uint16_t action, float& reward, uint8_t& done, uint8_t* observation)
+    {
+	auto& env = envs[i];
+	env.machine.set_keyboard(action);
+	env.machine.run_frame(options.instructions_per_frame);
+	env.frame++;
+
+	reward = 0;
+	for (size_t r=0; r<options.rewards.size(); ++r) {
+	    const auto score = read_score(env.machine, options.rewards[r]);
+	    reward += options.rewards[r].scale * (static_cast<double>(score) - static_cast<double>(env.scores[r]));
+	    env.scores[r] = score;
+	}
+
+	done = (options.done_address && env.machine.get_memory(*options.done_address) == options.done_value)
+	    || (options.max_frames > 0 && env.frame >= options.max_frames);
+	if (done)
+	    reset(i);
+	observe(env.machine, observation);
+    }
+
+    void VectorEnv::step(const uint16_t* actions, float* rewards, uint8_t* dones, uint8_t* observations)
+    {
+	const size_t stride = observation_size();
+	pool.run((envs.size() + chunk - 1) / chunk, [&](size_t c) {
+	    for (size_t i=c*chunk; i<std::min(envs.size(), (c+1)*chunk); ++i)
+		step(i, actions[i], rewards[i], dones[i], observations + i*stride);
+	});
+    }
+
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "chip8.h"
+#include "parallel.h"
+
+namespace Chip8 {
+
+    // A number the game keeps in memory, big endian. Its growth since the
+    // last step, times scale, is part of the reward.
+    struct RewardSource {
+	uint16_t address = 0;
+	uint8_t bytes = 1;
+	float scale = 1;
+    };
+
+    enum class ObservationFormat {
+	// The display rows as they are, 32 words of 64 bits per env
+	bits,
+	// One byte per pixel, 0 or 1, row by row
+	bytes,
+    };
+
+    struct EnvOptions {
+	uint32_t instructions_per_frame = 10;
+	std::vector<RewardSource> rewards;
+	// An episode ends once memory[done_address] == done_value, or
+	// after max_frames if that is not 0
+	std::optional<uint16_t> done_address;
+	uint8_t done_value = 0;
+	uint32_t max_frames = 0;
+	ObservationFormat format = ObservationFormat::bits;
+	// Every episode gets its own seed derived from this one
+	uint64_t seed = 0;
+	unsigned int threads = default_threads();
+    };
+
+    // A batch of machines stepped together for training agents. Results
+    // go to buffers the caller owns, a step allocates nothing. Finished
+    // episodes restart from the start state right away, the observation
+    // returned for them is the first of the new episode.
+    class VectorEnv {
+	public:
+	    VectorEnv(const std::vector<uint8_t>& rom, size_t count, EnvOptions options={});
+
+	    size_t size() const { return envs.size(); }
+	    // Bytes of one env's observation
+	    size_t observation_size() const;
+	    const Chip8State& env(size_t i) const { return envs[i].machine; }
+	    uint64_t episodes() const;
+
+	    // Where every episode starts, power on with the rom loaded by
+	    // default. Takes effect at the next reset.
+	    void set_start(const MachineState& state) { start = state; }
+
+	    // Restarts every env, call before the first step. observations
+	    // holds size() * observation_size() bytes.
+	    void reset(uint8_t* observations);
+	    // One frame of every env with actions[i] as its keys. Each array
+	    // has size() entries.
+	    void step(const uint16_t* actions, float* rewards, uint8_t* dones, uint8_t* observations);
+
+	private:
+	    struct Env {
+		Chip8State machine;
+		uint64_t episode = 0;
+		uint32_t frame = 0;
+		// Last value of each reward source
+		std::vector<uint64_t> scores;
+	    };
+
+	    void reset(size_t i);
+	    void step(size_t i, uint16_t action, float& reward, uint8_t& done, uint8_t* observation);
+	    uint64_t read_score(const Chip8State& machine, const RewardSource& source) const;
+	    void observe(const Chip8State& machine, uint8_t* observation) const;
+
+	    EnvOptions options;
+	    MachineState start;
+	    std::vector<Env> envs;
+	    WorkerPool pool;
+    };
+
+}
@@ -0,0 +1,119 @@
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include "chip8.h"
+#include "explorer.h"
+#include "movie.h"
+#include "savestate.h"
+
+using namespace Chip8;
+
+// Searches the keys held each frame for states never seen before, until
+// the program counter, a memory byte or the display reaches a target. The
+// keys leading there can be saved as a movie for Chip8Replay and Chip8App.
+int main(int argc, char** argv)
+{
+    ExploreOptions options;
+    uint64_t seed = 0;
+    std::optional<uint16_t> target_pc;
+    std::optional<std::pair<uint16_t,uint8_t>> target_memory;
+    std::optional<uint64_t> target_display;
+    std::string movie_output;
+    bool usage = argc < 2;
+    try {
+	for (int i=2; i<argc && !usage; ++i) {
+	    const std::string arg = argv[i];
+	    if (i+1 >= argc)
+		usage = true;
+	    else if (arg == "--ipf")
+		options.instructions_per_frame = std::stoul(argv[++i]);
+	    else if (arg == "--depth")
+		options.max_depth = std::stoul(argv[++i]);
+	    else if (arg == "--beam")
+		options.beam_width = std::stoul(argv[++i]);
+	    else if (arg == "--max-states")
+		options.max_states = std::stoul(argv[++i]);
+	    else if (arg == "--seed")
+		seed = std::stoull(argv[++i]);
+	    else if (arg == "-j")
+		options.threads = std::stoul(argv[++i]);
+	    else if (arg == "--pc")
+		target_pc = std::stoul(argv[++i], nullptr, 0) & 0xFFF;
+	    else if (arg == "--memory") {
+		const std::string target = argv[++i];
+		const auto equals = target.find('=');
+		if (equals == std::string::npos)
+		    throw std::runtime_error("--memory takes addr=value");
+		target_memory = {std::stoul(target.substr(0, equals), nullptr, 0) & 0xFFF,
+				 std::stoul(target.substr(equals+1), nullptr, 0)};
+	    }
+	    else if (arg == "--display")
+		target_display = std::stoull(argv[++i], nullptr, 0);
+	    else if (arg == "--movie")
+		movie_output = argv[++i];
+	    else
+		usage = true;
+	}
+    } catch (const std::exception& e) {
+	std::cerr << "Bad argument: " << e.what() << '\n';
+	return 1;
+    }
+    if (usage) {
+	std::cerr << "Usage: " << argv[0] << " <rom> [--ipf n] [--depth frames] [--beam width] [--max-states n]"
+		  << " [--seed s] [-j threads] [--pc addr] [--memory addr=value] [--display hash] [--movie out]\n";
+	return 1;
+    }
+
+    std::vector<uint8_t> rom;
+    Chip8State m;
+    try {
+	rom = read_rom(argv[1]);
+	m.seed(seed);
+	m.load_rom(rom);
+    } catch (const std::exception& e) {
+	std::cerr << e.what() << '\n';
+	return 1;
+    }
+
+    if (target_pc || target_memory || target_display) {
+	options.goal = [&](const Chip8State& s) {
+	    return (target_pc && s.get_program_counter() == *target_pc)
+		|| (target_memory && s.get_memory(target_memory->first) == target_memory->second)
+		|| (target_display && s.display_hash() == *target_display);
+	};
+    }
+
+    const auto result = explore(m, options, [](const ExploreResult& r) {
+	std::cout << "frame " << r.depth << ": " << r.states << " states, " << r.screens << " screens, "
+		  << static_cast<size_t>(r.states / r.seconds) << " states/s\n";
+    });
+    std::cout << result.states << " unique states from " << result.expanded << " expanded in "
+	      << result.seconds << "s\n";
+
+    if (!result.path) {
+	if (options.goal) {
+	    std::cout << "Target not reached\n";
+	    return 2;
+	}
+	return 0;
+    }
+
+    std::cout << "Target reached after " << result.path->size() << " frames, keys:";
+    for (const auto keys : *result.path)
+	std::cout << ' ' << std::hex << keys << std::dec;
+    std::cout << '\n';
+
+    if (!movie_output.empty()) {
+	Movie movie;
+	movie.seed = seed;
+	movie.instructions_per_frame = options.instructions_per_frame;
+	movie.rom_hash = rom_hash(rom);
+	movie.keys = *result.path;
+	std::ofstream out(movie_output, std::ios::binary);
+	movie.write(out);
+    }
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include "explorer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+#include "chip8.h"
+
+namespace Chip8 {
+
+    namespace {
+	// How each state was reached, for the path to the goal
+	struct Node {
+	    uint32_t parent;
+	    uint16_t keys;
+	};
+
+	struct Entry {
+	    MachineState state;
+	    uint32_t node;
+	};
+
+	struct Child {
+	    Entry entry;
+	    uint16_t keys;
+	    bool new_screen;
+	    bool goal;
+	};
+
+	std::vector<uint16_t> path_to(const std::vector<Node>& nodes, uint32_t node)
+	{
+	    std::vector<uint16_t> path;
+	    for (; node != 0; node = nodes[node].parent)
+		path.push_back(nodes[node].keys);
+	    std::reverse(path.begin(), path.end());
+	    return path;
+	}
+    }
+
+    ExploreResult explore(const Chip8State& start, const ExploreOptions& options,
+			  const std::function<void(const ExploreResult&)>& progress)
+    {
+	const auto begin = std::chrono::steady_clock::now();
+	auto inputs = options.inputs;
+	if (inputs.empty()) {
+	    inputs.push_back(0);
+	    for (size_t key=0; key<16; ++key)
+		inputs.push_back(1 << key);
+	}
+
+	ShardedSet seen;
+	ShardedSet screens;
+	seen.insert(start.fingerprint());
+	screens.insert(start.display_hash());
+
+	ExploreResult result;
+	auto finish = [&] {
+	    result.states = seen.size();
+	    result.screens = screens.size();
+	    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	    return result;
+	};
+	if (options.goal && options.goal(start)) {
+	    result.path.emplace();
+	    return finish();
+	}
+
+	std::vector<Node> nodes{{0, 0}};
+	std::vector<Entry> frontier{{start.snapshot(), 0}};
+	std::atomic<size_t> states{1};
+	while (!frontier.empty() && result.depth < options.max_depth) {
+	    std::vector<std::vector<Child>> children(frontier.size());
+	    std::atomic<bool> found{false};
+	    parallel_for(frontier.size(), [&](size_t i) {
+		Chip8State m;
+		for (const auto keys : inputs) {
+		    if (found || states >= options.max_states)
+			return;
+		    m.restore(frontier[i].state);
+		    m.set_keyboard(keys);
+		    m.run_frame(options.instructions_per_frame);
+		    if (!seen.insert(m.fingerprint()))
+			continue;
+		    ++states;
+		    const bool new_screen = screens.insert(m.display_hash());
+		    const bool goal = options.goal && options.goal(m);
+		    children[i].push_back({{m.snapshot(), frontier[i].node}, keys, new_screen, goal});
+		    if (goal) {
+			found = true;
+			return;
+		    }
+		}
+	    }, options.threads);
+	    result.expanded += frontier.size();
+	    result.depth++;
+	    frontier.clear();
+
+	    size_t count = 0;
+	    for (const auto& list : children) {
+		count += list.size();
+		for (const auto& child : list) {
+		    if (child.goal) {
+			nodes.push_back({child.entry.node, child.keys});
+			result.path = path_to(nodes, nodes.size() - 1);
+			return finish();
+		    }
+		}
+	    }
+
+	    auto append = [&](const Child& child) {
+		nodes.push_back({child.entry.node, child.keys});
+		frontier.push_back({child.entry.state, static_cast<uint32_t>(nodes.size() - 1)});
+	    };
+	    if (options.beam_width == 0 || count <= options.beam_width) {
+		for (const auto& list : children)
+		    for (const auto& child : list)
+			append(child);
+	    } else {
+		// Children that drew a new screen get the beam first
+		for (const bool new_screen : {true, false})
+		    for (const auto& list : children)
+			for (const auto& child : list)
+			    if (child.new_screen == new_screen && frontier.size() < options.beam_width)
+				append(child);
+	    }
+
+	    if (progress)
+		progress(finish());
+	    if (states >= options.max_states)
+		break;
+	}
+	return finish();
+    }
+
+}
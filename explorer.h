@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <vector>
+
+#include "machine.h"
+#include "parallel.h"
+
+namespace Chip8 {
+
+    class Chip8State;
+
+    struct ExploreOptions {
+	size_t instructions_per_frame = 10;
+	// Frames to search
+	size_t max_depth = 60;
+	// Keep at most this many states per frame, 0 for a full BFS. States
+	// that show a new screen are kept first.
+	size_t beam_width = 0;
+	// Stop once this many unique states were seen
+	size_t max_states = 1000000;
+	// Key masks tried every frame, empty for no key and each single key
+	std::vector<uint16_t> inputs;
+	unsigned int threads = default_threads();
+	// Stops the search once it returns true
+	std::function<bool(const Chip8State&)> goal;
+    };
+
+    struct ExploreResult {
+	// Unique states and screens seen
+	size_t states = 0;
+	size_t screens = 0;
+	// Frames searched and states expanded
+	size_t depth = 0;
+	size_t expanded = 0;
+	double seconds = 0;
+	// Keys for each frame from the start to the goal
+	std::optional<std::vector<uint16_t>> path;
+    };
+
+    // Breadth first search over the keys held each frame. Each frontier
+    // is expanded in parallel, new states are told apart by their fingerprint.
+    // progress is called after every frame.
+    ExploreResult explore(const Chip8State& start, const ExploreOptions& options,
+			  const std::function<void(const ExploreResult&)>& progress = nullptr);
+
+}
@@ -0,0 +1,395 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+
+#ifndef CHIP8_LIBFUZZER
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+using namespace Chip8;
+
+// Fuzz targets for the interpreter and the assembler, built with
+// -DCHIP8_FUZZ=ON. The first input byte picks the target. With clang this
+// is a libFuzzer target, with gcc it brings its own driver below.
+
+namespace {
+    // Header of an interpreter input, the rest is memory from 0x200 on
+    struct InterpreterInput {
+	uint8_t registers[16];
+	uint8_t I[2];
+	uint8_t stack_pointer;
+	uint8_t delay;
+	uint8_t keys[4][2];
+    };
+
+    void check(bool condition, const char* what);
+
+    // Any machine state has to run without touching memory outside of
+    // it, and the undo log has to bring it back exactly
+    void fuzz_interpreter(const uint8_t* data, size_t size)
+    {
+	InterpreterInput input{};
+	std::memcpy(&input, data, std::min(size, sizeof(input)));
+	data += std::min(size, sizeof(input));
+	size -= std::min(size, sizeof(input));
+
+	// Kept between runs, building them is most of the cost of a run
+	static const MachineState power_on = Chip8State().snapshot();
+	static Chip8State m;
+	static UndoLog log(1 << 18);
+
+	MachineState state = power_on;
+	std::memcpy(state.registers.data(), input.registers, sizeof(input.registers));
+	state.I_register = input.I[0] | input.I[1] << 8;
+	state.stack_pointer = input.stack_pointer;
+	state.delay_register = input.delay;
+	std::memcpy(&state.memory[Chip8State::program_start], data,
+		    std::min<size_t>(size, Chip8State::memory_size - Chip8State::program_start));
+	state.rehash();
+
+	m.set_undo_log(nullptr);
+	m.restore(state);
+	log.clear();
+	m.set_undo_log(&log);
+	const auto start = m.fingerprint();
+
+	for (const auto& keys : input.keys) {
+	    m.set_keyboard(keys[0] | keys[1] << 8);
+	    m.run_frame(16);
+	}
+
+	// Also catches display and memory writes that miss content_hash, the
+	// undo log puts them back through the hashing setters
+	while (log.undo(m))
+	    ;
+	check(m.fingerprint() == start, "undo did not restore the machine");
+    }
+
+    // Malformed source may only throw std::runtime_error
+    void fuzz_assembler(const uint8_t* data, size_t size)
+    {
+	const std::string source(reinterpret_cast<const char*>(data), size);
+	try {
+	    std::istringstream in(source);
+	    assemble_program(in);
+	} catch (const std::runtime_error&) {
+	}
+	try {
+	    assemble(source.substr(0, source.find('\n')));
+	} catch (const std::runtime_error&) {
+	}
+    }
+
+    void run_one(const uint8_t* data, size_t size)
+    {
+	if (size == 0)
+	    return;
+	if (data[0] & 1)
+	    fuzz_assembler(data + 1, size - 1);
+	else
+	    fuzz_interpreter(data + 1, size - 1);
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    run_one(data, size);
+    return 0;
+}
+
+#ifdef CHIP8_LIBFUZZER
+
+namespace {
+    void check(bool condition, const char* what)
+    {
+	if (!condition) {
+	    std::cerr << what << '\n';
+	    std::abort();
+	}
+    }
+}
+
+#else
+
+// Without libFuzzer: the library is built with -fsanitize-coverage=trace-pc,
+// which calls the hook below on every basic block. Pairs of blocks are
+// counted in an AFL style edge map, and an input that reaches a new edge
+// or a new power of two count of one is added to the corpus.
+namespace {
+    // Plenty for the few thousand edges of the library
+    constexpr size_t map_size = 1 << 14;
+    uint8_t edges[map_size];
+    uint8_t seen[map_size];
+    uintptr_t previous = 0;
+
+    // Input being run, written out if it crashes
+    const std::vector<uint8_t>* current = nullptr;
+    std::filesystem::path crash_dir = ".";
+
+    void save_crash()
+    {
+	if (!current)
+	    return;
+	uint32_t hash = 2166136261u;
+	for (const auto byte : *current)
+	    hash = (hash ^ byte) * 16777619u;
+	std::stringstream name;
+	name << "crash-" << std::hex << hash;
+	const auto path = crash_dir / name.str();
+	std::ofstream out(path, std::ios::binary);
+	out.write(reinterpret_cast<const char*>(current->data()), current->size());
+	std::cerr << "Input written to " << path << '\n';
+	current = nullptr;
+    }
+
+    void check(bool condition, const char* what)
+    {
+	if (!condition) {
+	    std::cerr << what << '\n';
+	    save_crash();
+	    std::abort();
+	}
+    }
+
+    uint8_t bucket(uint8_t count)
+    {
+	if (count < 4)
+	    return count;
+	if (count < 8)
+	    return 4;
+	if (count < 32)
+	    return 8;
+	if (count < 128)
+	    return 16;
+	return 32;
+    }
+
+    // True if the last run reached something new
+    bool collect_edges()
+    {
+	bool found = false;
+	for (size_t word=0; word<map_size; word+=8) {
+	    uint64_t any;
+	    std::memcpy(&any, &edges[word], sizeof(any));
+	    if (any == 0)
+		continue;
+	    for (size_t i=word; i<word+8; ++i) {
+		const uint8_t b = bucket(edges[i]);
+		if ((seen[i] | b) != seen[i]) {
+		    seen[i] |= b;
+		    found = true;
+		}
+		edges[i] = 0;
+	    }
+	}
+	return found;
+    }
+
+    size_t edge_count()
+    {
+	return std::count_if(std::begin(seen), std::end(seen), [](uint8_t b) { return b != 0; });
+    }
+
+    const char* const dictionary[] = {
+	"CLS", "RET", "SYS", "JP", "CALL", "SE", "SNE", "LD", "ADD", "OR", "AND", "XOR", "SUB",
+	"SHR", "SUBN", "SHL", "RND", "DRW", "SKP", "SKNP", "DB", "V0", "V5", "VF", "I", "[I]",
+	"K", "DT", "ST", "F", "B", ":loop:", "#", ",", " ", "\n", "4095", "255", "0x"
+    };
+
+    class Mutator {
+	public:
+	    explicit Mutator(uint64_t seed) : rng(seed) {}
+
+	    size_t below(size_t n) { return n == 0 ? 0 : rng() % n; }
+
+	    void mutate(std::vector<uint8_t>& input, const std::vector<std::vector<uint8_t>>& corpus)
+	    {
+		const size_t count = 1 + below(8);
+		for (size_t i=0; i<count; ++i)
+		    mutate_once(input, corpus);
+		if (input.empty())
+		    input.push_back(below(256));
+		if (input.size() > max_size)
+		    input.resize(max_size);
+	    }
+
+	private:
+	    static constexpr size_t max_size = 4096;
+
+	    void mutate_once(std::vector<uint8_t>& input, const std::vector<std::vector<uint8_t>>& corpus)
+	    {
+		// The target selector stays, or an input would mostly be
+		// wasted on the other target
+		const size_t begin = input.empty() ? 0 : 1;
+		const size_t pos = begin + below(input.size() - begin + 1);
+		switch (below(7)) {
+		    case 0:
+			if (pos < input.size())
+			    input[pos] ^= 1 << below(8);
+			break;
+		    case 1:
+			if (pos < input.size())
+			    input[pos] = below(256);
+			break;
+		    case 2:
+			if (pos < input.size())
+			    input[pos] += below(33) - 16;
+			break;
+		    case 3:
+			input.insert(input.begin() + pos, below(256));
+			break;
+		    case 4:
+			if (pos < input.size())
+			    input.erase(input.begin() + pos, input.begin() + std::min(input.size(), pos + 1 + below(8)));
+			break;
+		    case 5: {
+			const std::string_view token = dictionary[below(std::size(dictionary))];
+			input.insert(input.begin() + pos, token.begin(), token.end());
+			break;
+		    }
+		    case 6: {
+			const auto& other = corpus[below(corpus.size())];
+			const size_t from = below(other.size());
+			const size_t length = below(std::min<size_t>(other.size() - from, 64) + 1);
+			input.insert(input.begin() + pos, other.begin() + from, other.begin() + from + length);
+			break;
+		    }
+		}
+	    }
+
+	    std::mt19937_64 rng;
+    };
+
+    std::vector<uint8_t> read_file(const std::filesystem::path& path)
+    {
+	std::ifstream in(path, std::ios::binary);
+	return std::vector<uint8_t>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    void write_file(const std::filesystem::path& path, const std::vector<uint8_t>& data)
+    {
+	std::ofstream out(path, std::ios::binary);
+	out.write(reinterpret_cast<const char*>(data.data()), data.size());
+    }
+}
+
+// Runs for every basic block, so it does without address checks
+extern "C" __attribute__((no_sanitize("address", "undefined"))) void __sanitizer_cov_trace_pc()
+{
+    const auto location = reinterpret_cast<uintptr_t>(__builtin_return_address(0));
+    const auto block = (location ^ location >> 15) & (map_size - 1);
+    edges[block ^ previous]++;
+    previous = block >> 1;
+}
+
+// Chip8Fuzz [corpus dir] [-runs n] [-seconds s] [-seed s] runs the fuzzer,
+// new inputs are saved to the corpus directory. Chip8Fuzz file... runs
+// each file once to reproduce a crash.
+int main(int argc, char** argv)
+{
+    std::optional<std::filesystem::path> corpus_dir;
+    std::vector<std::filesystem::path> inputs;
+    uint64_t runs = 0;
+    double seconds = 0;
+    uint64_t seed = std::random_device{}();
+    for (int i=1; i<argc; ++i) {
+	const std::string arg = argv[i];
+	if (arg == "-runs" && i+1 < argc)
+	    runs = std::stoull(argv[++i]);
+	else if (arg == "-seconds" && i+1 < argc)
+	    seconds = std::stod(argv[++i]);
+	else if (arg == "-seed" && i+1 < argc)
+	    seed = std::stoull(argv[++i]);
+	else if (std::filesystem::is_directory(arg))
+	    corpus_dir = arg;
+	else if (std::filesystem::is_regular_file(arg))
+	    inputs.push_back(arg);
+	else {
+	    std::cerr << "Usage: " << argv[0] << " [corpus dir] [-runs n] [-seconds s] [-seed s] | " << argv[0] << " <input>...\n";
+	    return 1;
+	}
+    }
+
+    __sanitizer_set_death_callback(save_crash);
+    std::set_terminate([] {
+	save_crash();
+	std::abort();
+    });
+
+    if (!inputs.empty()) {
+	for (const auto& path : inputs) {
+	    const auto data = read_file(path);
+	    std::cout << "Running " << path << '\n';
+	    run_one(data.data(), data.size());
+	}
+	return 0;
+    }
+    if (corpus_dir)
+	crash_dir = *corpus_dir;
+
+    std::vector<std::vector<uint8_t>> corpus;
+    if (corpus_dir)
+	for (const auto& entry : std::filesystem::directory_iterator(*corpus_dir))
+	    if (entry.is_regular_file() && entry.path().filename().string().rfind("crash-", 0) != 0)
+		corpus.push_back(read_file(entry.path()));
+    const std::string program = "\x01:loop:\nLD V0, 5\nLD I, 4095\nLD [I], VF\nDRW V0, V1, 15\nCALL :loop:\nJP V0, 4095\n";
+    corpus.emplace_back(program.begin(), program.end());
+    corpus.push_back(std::vector<uint8_t>(1 + sizeof(InterpreterInput) + 16, 0));
+
+    for (const auto& input : corpus) {
+	current = &input;
+	run_one(input.data(), input.size());
+	collect_edges();
+    }
+    current = nullptr;
+
+    Mutator mutator(seed);
+    std::vector<uint8_t> input;
+    const auto start = std::chrono::steady_clock::now();
+    auto last_report = start;
+    for (uint64_t n=1; runs == 0 || n <= runs; ++n) {
+	input = corpus[mutator.below(corpus.size())];
+	mutator.mutate(input, corpus);
+
+	current = &input;
+	run_one(input.data(), input.size());
+	current = nullptr;
+	if (collect_edges()) {
+	    corpus.push_back(input);
+	    if (corpus_dir) {
+		std::stringstream name;
+		name << std::setfill('0') << std::setw(8) << corpus.size();
+		write_file(*corpus_dir / name.str(), input);
+	    }
+	}
+
+	if ((n & 0x3FF) == 0) {
+	    const auto now = std::chrono::steady_clock::now();
+	    const std::chrono::duration<double> elapsed = now - start;
+	    if (now - last_report >= std::chrono::seconds(1) || (seconds > 0 && elapsed.count() >= seconds)) {
+		std::cout << n << " runs, " << static_cast<uint64_t>(n / elapsed.count()) << " execs/s, "
+			  << corpus.size() << " inputs, " << edge_count() << " edges\n";
+		last_report = now;
+	    }
+	    if (seconds > 0 && elapsed.count() >= seconds)
+		break;
+	}
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,132 @@
+#include "golden.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "chip8.h"
+
+namespace Chip8 {
+
+    uint64_t display_hash(const Display& display)
+    {
+	uint64_t hash = 0xcbf29ce484222325;
+	for (const auto row : display) {
+	    hash = (hash ^ row) * 0x100000001b3;
+	    hash ^= hash >> 32;
+	}
+	return hash;
+    }
+
+    namespace {
+	constexpr const char* header = "chip8-golden 1";
+    }
+
+    // One line per frame: the frame, the display hash and the 32 rows, in hex
+    void Golden::write(std::ostream& out) const
+    {
+	out << header << "\nipf " << instructions_per_frame << "\nseed " << seed << '\n';
+	out << std::hex << std::setfill('0');
+	for (size_t i=0; i<frames.size(); ++i) {
+	    out << std::dec << frames[i] << std::hex << ' ' << std::setw(16) << display_hash(displays[i]);
+	    for (const auto row : displays[i])
+		out << ' ' << std::setw(16) << row;
+	    out << '\n';
+	}
+	out << std::dec;
+    }
+
+    Golden Golden::read(std::istream& in)
+    {
+	std::string line;
+	if (!std::getline(in, line) || line != header)
+	    throw std::runtime_error("Not a golden file");
+
+	Golden golden;
+	std::string key;
+	if (!(in >> key >> golden.instructions_per_frame) || key != "ipf"
+	    || !(in >> key >> golden.seed) || key != "seed")
+	    throw std::runtime_error("Malformed golden header");
+
+	uint32_t frame;
+	while (in >> frame) {
+	    uint64_t hash;
+	    Display display;
+	    in >> std::hex >> hash;
+	    for (auto& row : display)
+		in >> row;
+	    in >> std::dec;
+	    if (!in)
+		throw std::runtime_error("Malformed golden frame " + std::to_string(frame));
+	    if (hash != display_hash(display))
+		throw std::runtime_error("Golden frame " + std::to_string(frame) + " does not match its hash");
+	    if (!golden.frames.empty() && frame <= golden.frames.back())
+		throw std::runtime_error("Golden frames out of order");
+	    golden.frames.push_back(frame);
+	    golden.displays.push_back(display);
+	}
+	if (!in.eof())
+	    throw std::runtime_error("Malformed golden file");
+	return golden;
+    }
+
+    Golden capture(const std::vector<uint8_t>& rom, const std::vector<uint16_t>& keys,
+		   const std::vector<uint32_t>& frames, uint32_t instructions_per_frame, uint64_t seed)
+    {
+	Golden golden;
+	golden.instructions_per_frame = instructions_per_frame;
+	golden.seed = seed;
+	golden.frames = frames;
+
+	Chip8State m;
+	m.seed(seed);
+	m.load_rom(rom);
+	uint32_t frame = 0;
+	for (const auto target : frames) {
+	    for (; frame < target; ++frame) {
+		if (!keys.empty())
+		    m.set_keyboard(keys[std::min<size_t>(frame, keys.size() - 1)]);
+		m.run_frame(instructions_per_frame);
+	    }
+	    Display display;
+	    for (size_t row=0; row<display.size(); ++row)
+		display[row] = m.get_display_row(row);
+	    golden.displays.push_back(display);
+	}
+	return golden;
+    }
+
+    std::vector<GoldenMismatch> verify(const Golden& golden, const std::vector<uint8_t>& rom, const std::vector<uint16_t>& keys)
+    {
+	const auto actual = capture(rom, keys, golden.frames, golden.instructions_per_frame, golden.seed);
+	std::vector<GoldenMismatch> mismatches;
+	for (size_t i=0; i<golden.frames.size(); ++i)
+	    if (display_hash(actual.displays[i]) != display_hash(golden.displays[i]))
+		mismatches.push_back({golden.frames[i], golden.displays[i], actual.displays[i]});
+	return mismatches;
+    }
+
+    void write_pbm(std::ostream& out, const GoldenMismatch& mismatch)
+    {
+	// One blank column between the panels
+	constexpr size_t width = Chip8State::display_width;
+	out << "P1\n# expected, actual, difference\n" << 3*width + 2 << ' ' << mismatch.expected.size() << '\n';
+	for (size_t row=0; row<mismatch.expected.size(); ++row) {
+	    const uint64_t panels[] = {mismatch.expected[row], mismatch.actual[row], mismatch.expected[row] ^ mismatch.actual[row]};
+	    std::string line;
+	    for (size_t panel=0; panel<3; ++panel) {
+		if (panel > 0)
+		    line += "0 ";
+		for (size_t col=0; col<width; ++col)
+		    line += (panels[panel] >> (width-1-col)) & 1 ? "1 " : "0 ";
+	    }
+	    line.back() = '\n';
+	    out << line;
+	}
+    }
+
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <vector>
+
+#include "machine.h"
+
+namespace Chip8 {
+
+    // Same hash as Chip8State::display_hash()
+    uint64_t display_hash(const Display& display);
+
+    // The display at a few frames of a run, stored next to the rom as a
+    // text file so changes show up in diffs
+    struct Golden {
+	uint32_t instructions_per_frame = 10;
+	uint64_t seed = 0;
+	// Frame numbers count from 1, after that many frames ran
+	std::vector<uint32_t> frames;
+	std::vector<Display> displays;
+
+	void write(std::ostream& out) const;
+	// Throws on anything malformed
+	static Golden read(std::istream& in);
+    };
+
+    // Runs rom from power on, keys[i] held in frame i, the last keys stay
+    // held. frames has to be sorted.
+    Golden capture(const std::vector<uint8_t>& rom, const std::vector<uint16_t>& keys,
+		   const std::vector<uint32_t>& frames, uint32_t instructions_per_frame, uint64_t seed);
+
+    struct GoldenMismatch {
+	uint32_t frame;
+	Display expected;
+	Display actual;
+    };
+
+    // Runs rom again with the settings of the golden, every frame whose
+    // display hash differs
+    std::vector<GoldenMismatch> verify(const Golden& golden, const std::vector<uint8_t>& rom, const std::vector<uint16_t>& keys);
+
+    // Plain PBM with expected, actual and the pixels that differ side by side
+    void write_pbm(std::ostream& out, const GoldenMismatch& mismatch);
+
+}
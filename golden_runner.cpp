@@ -0,0 +1,167 @@
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+
+#include "corpus.h"
+#include "golden.h"
+#include "movie.h"
+#include "parallel.h"
+
+using namespace Chip8;
+
+namespace {
+    bool ends_with(const std::string& s, const std::string& suffix)
+    {
+	return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    // Rom names may contain directories, keep the golden tree flat
+    std::string flat_name(std::string name)
+    {
+	for (auto& c : name)
+	    if (c == '/' || c == '\\')
+		c = '_';
+	return name;
+    }
+}
+
+// Runs every rom of a corpus, with the keys of <rom>.c8m next to it if
+// there is one, and compares the display at every few frames with the
+// goldens stored earlier. With --update the goldens are written instead.
+int main(int argc, char** argv)
+{
+    std::filesystem::path goldens_dir = "goldens";
+    std::filesystem::path diffs_dir;
+    bool update = false;
+    uint32_t frames = 600;
+    uint32_t every = 60;
+    uint32_t instructions_per_frame = 10;
+    uint64_t seed = 0;
+    unsigned int threads = default_threads();
+    bool usage = argc < 2;
+    try {
+	for (int i=2; i<argc && !usage; ++i) {
+	    const std::string arg = argv[i];
+	    if (arg == "--update")
+		update = true;
+	    else if (i+1 >= argc)
+		usage = true;
+	    else if (arg == "--goldens")
+		goldens_dir = argv[++i];
+	    else if (arg == "--diffs")
+		diffs_dir = argv[++i];
+	    else if (arg == "--frames")
+		frames = std::stoul(argv[++i]);
+	    else if (arg == "--every")
+		every = std::stoul(argv[++i]);
+	    else if (arg == "--ipf")
+		instructions_per_frame = std::stoul(argv[++i]);
+	    else if (arg == "--seed")
+		seed = std::stoull(argv[++i]);
+	    else if (arg == "-j")
+		threads = std::stoul(argv[++i]);
+	    else
+		usage = true;
+	}
+    } catch (const std::exception& e) {
+	std::cerr << "Bad argument: " << e.what() << '\n';
+	return 1;
+    }
+    if (usage || every == 0) {
+	std::cerr << "Usage: " << argv[0] << " <directory|archive.tar> [--goldens dir] [--update] [--frames n] [--every k]"
+		  << " [--ipf n] [--seed s] [--diffs dir] [-j threads]\n";
+	return 1;
+    }
+
+    std::vector<CorpusEntry> roms;
+    std::map<std::string,CorpusEntry> movies;
+    try {
+	for (auto& entry : list_corpus(argv[1])) {
+	    if (ends_with(entry.name, ".c8m"))
+		movies.emplace(entry.name.substr(0, entry.name.size() - 4), std::move(entry));
+	    else if (!ends_with(entry.name, ".golden"))
+		roms.push_back(std::move(entry));
+	}
+	std::filesystem::create_directories(goldens_dir);
+	if (!diffs_dir.empty())
+	    std::filesystem::create_directories(diffs_dir);
+    } catch (const std::exception& e) {
+	std::cerr << e.what() << '\n';
+	return 1;
+    }
+
+    std::vector<uint32_t> checked;
+    for (uint32_t frame=every; frame<=frames; frame+=every)
+	checked.push_back(frame);
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::string> reports(roms.size());
+    // Not vector<bool>, its bits share words across threads
+    std::vector<uint8_t> failed(roms.size());
+    parallel_for(roms.size(), [&](size_t i) {
+	const auto& entry = roms[i];
+	const auto golden_file = goldens_dir / (flat_name(entry.name) + ".golden");
+	std::ostringstream out;
+	out << entry.name << ": ";
+	try {
+	    const auto rom = entry.load();
+	    std::vector<uint16_t> keys;
+	    uint32_t ipf = instructions_per_frame;
+	    uint64_t rom_seed = seed;
+	    if (const auto movie_entry = movies.find(entry.name); movie_entry != movies.end()) {
+		const auto bytes = movie_entry->second.load();
+		std::istringstream in(std::string(bytes.begin(), bytes.end()));
+		const auto movie = Movie::read(in);
+		keys = movie.keys;
+		ipf = movie.instructions_per_frame;
+		rom_seed = movie.seed;
+	    }
+
+	    if (update) {
+		std::ofstream file(golden_file);
+		capture(rom, keys, checked, ipf, rom_seed).write(file);
+		if (!file)
+		    throw std::runtime_error("Could not write " + golden_file.string());
+		out << "wrote " << checked.size() << " frames\n";
+	    } else {
+		std::ifstream file(golden_file);
+		if (!file)
+		    throw std::runtime_error("No golden at " + golden_file.string());
+		const auto golden = Golden::read(file);
+		const auto mismatches = verify(golden, rom, keys);
+		if (mismatches.empty()) {
+		    out << golden.frames.size() << " frames match\n";
+		} else {
+		    failed[i] = true;
+		    out << mismatches.size() << " of " << golden.frames.size() << " frames differ, first at frame " << mismatches.front().frame << '\n';
+		    for (const auto& mismatch : mismatches) {
+			if (diffs_dir.empty())
+			    break;
+			const auto diff_file = diffs_dir / (flat_name(entry.name) + "." + std::to_string(mismatch.frame) + ".pbm");
+			std::ofstream diff(diff_file);
+			write_pbm(diff, mismatch);
+			out << "  " << diff_file.string() << '\n';
+		    }
+		}
+	    }
+	} catch (const std::exception& e) {
+	    failed[i] = true;
+	    out << e.what() << '\n';
+	}
+	reports[i] = out.str();
+    }, threads);
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    size_t failures = 0;
+    for (size_t i=0; i<roms.size(); ++i) {
+	std::cout << reports[i];
+	failures += failed[i];
+    }
+    std::cout << roms.size() - failures << " of " << roms.size() << " roms " << (update ? "updated" : "match")
+	      << " in " << elapsed.count() << "s\n";
+    return failures == 0 ? 0 : 2;
+}
@@ -0,0 +1,203 @@
+#include "lockstep.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "chip8.h"
+#include "savestate.h"
+
+namespace Chip8 {
+
+    namespace {
+	class ReferenceEngine : public Engine {
+	    public:
+		void load(const std::vector<uint8_t>& rom, uint64_t seed) override
+		{
+		    m.restore(Chip8State().snapshot());
+		    m.seed(seed);
+		    m.load_rom(rom);
+		}
+		void set_keyboard(uint16_t keys) override { m.set_keyboard(keys); }
+		void step() override { m.step(); }
+		void tick_timers() override { m.tick_timers(); }
+		const MachineState& state() const override { return m.snapshot(); }
+
+	    protected:
+		Chip8State m;
+	};
+
+	// Everything is done, undone and done again
+	class UndoEngine : public ReferenceEngine {
+	    public:
+		UndoEngine() { m.set_undo_log(&log); }
+
+		void set_keyboard(uint16_t keys) override { redo([&] { m.set_keyboard(keys); }); }
+		void step() override { redo([&] { m.step(); }); }
+		void tick_timers() override { redo([&] { m.tick_timers(); }); }
+
+	    private:
+		template<typename Fn>
+		void redo(Fn&& fn)
+		{
+		    log.clear();
+		    fn();
+		    while (log.undo(m))
+			;
+		    fn();
+		}
+
+		UndoLog log{1 << 12};
+	};
+
+	class SaveStateEngine : public ReferenceEngine {
+	    public:
+		void load(const std::vector<uint8_t>& rom, uint64_t seed) override
+		{
+		    ReferenceEngine::load(rom, seed);
+		    this->rom = rom;
+		}
+		void tick_timers() override
+		{
+		    m.tick_timers();
+		    m.restore(load_state(save_state(m.snapshot(), rom), rom));
+		}
+
+	    private:
+		std::vector<uint8_t> rom;
+	};
+
+	bool same(const MachineState& a, const MachineState& b)
+	{
+	    return a.registers == b.registers && a.I_register == b.I_register
+		&& a.program_counter == b.program_counter && a.stack_pointer == b.stack_pointer
+		&& a.stack == b.stack && a.delay_register == b.delay_register
+		&& a.sound_register == b.sound_register && a.waiting == b.waiting
+		&& a.content_hash == b.content_hash;
+	}
+    }
+
+    std::unique_ptr<Engine> make_engine(std::string_view name)
+    {
+	if (name == "reference")
+	    return std::make_unique<ReferenceEngine>();
+	if (name == "undo")
+	    return std::make_unique<UndoEngine>();
+	if (name == "savestate")
+	    return std::make_unique<SaveStateEngine>();
+	throw std::runtime_error("Unknown engine " + std::string(name));
+    }
+
+    std::vector<std::string_view> engine_names()
+    {
+	return {"reference", "undo", "savestate"};
+    }
+
+    LockstepResult run_lockstep(Engine& a, Engine& b, const std::vector<uint8_t>& rom, const LockstepOptions& options)
+    {
+	a.load(rom, options.seed);
+	b.load(rom, options.seed);
+
+	LockstepResult result;
+	auto diverged = [&](size_t step, uint16_t pc) {
+	    result.divergence = Divergence{result.frames, step, pc, a.state(), b.state()};
+	    return result;
+	};
+
+	for (; result.frames < options.frames; ++result.frames) {
+	    const uint16_t keys = options.keys.empty() ? 0 : options.keys[std::min(result.frames, options.keys.size() - 1)];
+	    a.set_keyboard(keys);
+	    b.set_keyboard(keys);
+
+	    // Like run_frame, a waiting machine does nothing more this frame
+	    size_t steps = 0;
+	    uint16_t pc = a.state().program_counter;
+	    if (options.per_frame) {
+		for (; steps < options.instructions_per_frame && !a.state().waiting; ++steps)
+		    a.step();
+		for (size_t i=0; i<options.instructions_per_frame && !b.state().waiting; ++i)
+		    b.step();
+		result.instructions += steps;
+	    } else {
+		for (; steps < options.instructions_per_frame && !a.state().waiting; ++steps) {
+		    pc = a.state().program_counter;
+		    a.step();
+		    b.step();
+		    result.instructions++;
+		    if (!same(a.state(), b.state()))
+			return diverged(steps + 1, pc);
+		}
+	    }
+
+	    a.tick_timers();
+	    b.tick_timers();
+	    if (!same(a.state(), b.state()))
+		return diverged(steps, pc);
+	}
+	return result;
+    }
+
+    namespace {
+	std::string hex(unsigned int value, int width)
+	{
+	    std::ostringstream out;
+	    out << "0x" << std::hex << std::setfill('0') << std::setw(width) << value;
+	    return out.str();
+	}
+
+	std::string pixels(uint64_t row)
+	{
+	    std::string line;
+	    for (size_t col=0; col<Chip8State::display_width; ++col)
+		line += (row >> (Chip8State::display_width-1-col)) & 1 ? '#' : '.';
+	    return line;
+	}
+    }
+
+    void write_divergence(std::ostream& out, const Divergence& d)
+    {
+	const auto& a = d.a;
+	const auto& b = d.b;
+	const Instruction instruction = a.memory[d.pc & 0xFFF] << 8 | a.memory[(d.pc+1) & 0xFFF];
+	char text[32];
+	const auto length = disassemble(instruction, text, sizeof(text));
+	out << "Frame " << d.frame << ", instruction " << d.step << ", after "
+	    << (length > 0 ? std::string(text, length) : hex(instruction, 4)) << " at " << hex(d.pc, 3) << '\n';
+
+	auto field = [&](const std::string& name, unsigned int x, unsigned int y, int width) {
+	    if (x != y)
+		out << "  " << name << ": " << hex(x, width) << " vs " << hex(y, width) << '\n';
+	};
+	field("PC", a.program_counter, b.program_counter, 3);
+	field("I", a.I_register, b.I_register, 3);
+	field("SP", a.stack_pointer, b.stack_pointer, 1);
+	field("DT", a.delay_register, b.delay_register, 2);
+	field("ST", a.sound_register, b.sound_register, 2);
+	field("waiting", a.waiting, b.waiting, 1);
+	for (size_t i=0; i<a.registers.size(); ++i)
+	    field("V" + hex(i, 1).substr(2), a.registers[i], b.registers[i], 2);
+	for (size_t i=0; i<a.stack.size(); ++i)
+	    field("stack[" + std::to_string(i) + "]", a.stack[i], b.stack[i], 3);
+
+	size_t shown = 0;
+	for (size_t addr=0; addr<a.memory.size(); ++addr) {
+	    if (a.memory[addr] == b.memory[addr])
+		continue;
+	    if (shown++ == 16) {
+		out << "  ...\n";
+		break;
+	    }
+	    field("memory[" + hex(addr, 3) + "]", a.memory[addr], b.memory[addr], 2);
+	}
+
+	for (size_t row=0; row<a.display.size(); ++row) {
+	    if (a.display[row] == b.display[row])
+		continue;
+	    out << "  row " << row << ":\n    " << pixels(a.display[row]) << "\n    " << pixels(b.display[row]) << '\n';
+	}
+    }
+
+}
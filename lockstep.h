@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "machine.h"
+
+namespace Chip8 {
+
+    // A way of running programs, checked against the reference
+    // interpreter by run_lockstep
+    class Engine {
+	public:
+	    virtual ~Engine() = default;
+	    // Power on with rom loaded and the RNG seeded
+	    virtual void load(const std::vector<uint8_t>& rom, uint64_t seed) = 0;
+	    virtual void set_keyboard(uint16_t keys) = 0;
+	    virtual void step() = 0;
+	    virtual void tick_timers() = 0;
+	    virtual const MachineState& state() const = 0;
+    };
+
+    // "reference" is Chip8State. "undo" steps back and redoes every
+    // instruction and timer tick. "savestate" saves and loads the machine
+    // after every frame. Throws for other names.
+    std::unique_ptr<Engine> make_engine(std::string_view name);
+    std::vector<std::string_view> engine_names();
+
+    struct LockstepOptions {
+	size_t frames = 600;
+	size_t instructions_per_frame = 10;
+	// Compare after every frame instead of after every instruction
+	bool per_frame = false;
+	uint64_t seed = 0;
+	// Keys held in each frame, the last ones stay held
+	std::vector<uint16_t> keys;
+    };
+
+    struct Divergence {
+	size_t frame = 0;
+	// Instructions into the frame, or instructions_per_frame if only
+	// frames are compared
+	size_t step = 0;
+	// Program counter and instruction before the last step
+	uint16_t pc = 0;
+	MachineState a;
+	MachineState b;
+    };
+
+    struct LockstepResult {
+	size_t frames = 0;
+	size_t instructions = 0;
+	std::optional<Divergence> divergence;
+    };
+
+    // Runs both engines on rom with the same keys, and stops at the first
+    // difference in registers, I, PC, SP, timers, memory or display
+    LockstepResult run_lockstep(Engine& a, Engine& b, const std::vector<uint8_t>& rom, const LockstepOptions& options);
+
+    // Every field that differs, with memory and display in detail
+    void write_divergence(std::ostream& out, const Divergence& divergence);
+
+}
@@ -0,0 +1,136 @@
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+
+#include "chip8.h"
+#include "corpus.h"
+#include "lockstep.h"
+#include "movie.h"
+#include "parallel.h"
+
+using namespace Chip8;
+
+// Runs two engines side by side on every rom given, directly or in a
+// directory or tar archive, and reports the first divergence of each.
+// Keys come from a movie, or change at random every few frames.
+int main(int argc, char** argv)
+{
+    LockstepOptions options;
+    std::string movie_file;
+    unsigned int threads = default_threads();
+    std::vector<std::string> paths;
+    bool usage = argc < 4;
+    try {
+	for (int i=3; i<argc && !usage; ++i) {
+	    const std::string arg = argv[i];
+	    if (arg == "--per-frame")
+		options.per_frame = true;
+	    else if (arg.rfind("-", 0) == 0 && i+1 >= argc)
+		usage = true;
+	    else if (arg == "--frames")
+		options.frames = std::stoul(argv[++i]);
+	    else if (arg == "--ipf")
+		options.instructions_per_frame = std::stoul(argv[++i]);
+	    else if (arg == "--seed")
+		options.seed = std::stoull(argv[++i]);
+	    else if (arg == "--movie")
+		movie_file = argv[++i];
+	    else if (arg == "-j")
+		threads = std::stoul(argv[++i]);
+	    else
+		paths.push_back(arg);
+	}
+    } catch (const std::exception& e) {
+	std::cerr << "Bad argument: " << e.what() << '\n';
+	return 1;
+    }
+    if (usage || paths.empty()) {
+	std::cerr << "Usage: " << argv[0] << " <engine> <engine> <rom|directory|archive.tar>... [--frames n] [--ipf n]"
+		  << " [--per-frame] [--seed s] [--movie file] [-j threads]\nEngines:";
+	for (const auto name : engine_names())
+	    std::cerr << ' ' << name;
+	std::cerr << '\n';
+	return 1;
+    }
+
+    std::vector<CorpusEntry> roms;
+    try {
+	make_engine(argv[1]);
+	make_engine(argv[2]);
+	for (const auto& path : paths) {
+	    if (std::filesystem::is_directory(path) || (path.size() > 4 && path.substr(path.size() - 4) == ".tar")) {
+		const auto entries = list_corpus(path);
+		roms.insert(roms.end(), entries.begin(), entries.end());
+	    } else {
+		roms.push_back({path, path, {}});
+	    }
+	}
+
+	if (!movie_file.empty()) {
+	    std::ifstream in(movie_file, std::ios::binary);
+	    if (!in)
+		throw std::runtime_error("Could not open " + movie_file);
+	    const auto movie = Movie::read(in);
+	    options.keys = movie.keys;
+	    options.seed = movie.seed;
+	    options.instructions_per_frame = movie.instructions_per_frame;
+	} else {
+	    // A few keys at a time, held for a while like a player would
+	    Xorshift rng;
+	    rng.seed(options.seed);
+	    for (size_t frame=0; frame<options.frames; frame+=8) {
+		uint16_t keys = 0;
+		for (auto n = rng.next() % 3; n > 0; --n)
+		    keys |= 1 << (rng.next() % 16);
+		options.keys.insert(options.keys.end(), 8, keys);
+	    }
+	}
+    } catch (const std::exception& e) {
+	std::cerr << e.what() << '\n';
+	return 1;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::string> reports(roms.size());
+    // Not vector<bool>, its bits share words across threads
+    std::vector<uint8_t> diverged(roms.size());
+    std::vector<size_t> instructions(roms.size());
+    parallel_for(roms.size(), [&](size_t i) {
+	std::ostringstream out;
+	out << roms[i].name << ": ";
+	try {
+	    const auto rom = roms[i].load();
+	    auto a = make_engine(argv[1]);
+	    auto b = make_engine(argv[2]);
+	    const auto result = run_lockstep(*a, *b, rom, options);
+	    instructions[i] = result.instructions;
+	    if (result.divergence) {
+		diverged[i] = true;
+		out << "diverges\n";
+		write_divergence(out, *result.divergence);
+	    } else {
+		out << result.frames << " frames match\n";
+	    }
+	} catch (const std::exception& e) {
+	    diverged[i] = true;
+	    out << e.what() << '\n';
+	}
+	reports[i] = out.str();
+    }, threads);
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    size_t failures = 0;
+    size_t total = 0;
+    for (size_t i=0; i<roms.size(); ++i) {
+	std::cout << reports[i];
+	failures += diverged[i];
+	total += instructions[i];
+    }
+    std::cout << roms.size() - failures << " of " << roms.size() << " roms match, "
+	      << total << " instructions in " << elapsed.count() << "s\n";
+    return failures == 0 ? 0 : 2;
+}
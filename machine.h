@@ -0,0 +1,97 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace Chip8 {
+
+    // Generator for RND. Its whole state is one word, saved and copied
+    // with the rest of the machine.
+    struct Xorshift {
+	uint64_t state = 0x9E3779B97F4A7C15;
+
+	// Any seed works, zero would be a fixed point
+	void seed(uint64_t s) { state = (s + 1) * 0x9E3779B97F4A7C15; state += state == 0; }
+	uint8_t next()
+	{
+	    state ^= state << 13;
+	    state ^= state >> 7;
+	    state ^= state << 17;
+	    return state >> 56;
+	}
+    };
+
+    // Share of one memory word or display row in MachineState::content_hash.
+    // A zero word adds nothing, so a blank machine hashes to zero.
+    inline uint64_t word_hash(size_t index, uint64_t word)
+    {
+	// Odd, so a bijection, and different for every word
+	word *= 0x9E3779B97F4A7C15 + 2*index;
+	word ^= word >> 32;
+	word *= 0xD6E8FEB86659FD93;
+	return word ^ word >> 32;
+    }
+
+    // One bit per pixel, column 0 in the most significant bit
+    using Display = std::array<uint64_t,32>;
+
+    // Everything that changes while a program runs. Trivially copyable,
+    // so a snapshot is a single copy.
+    struct MachineState {
+	std::array<uint8_t,0x1000> memory{0};
+	Display display{0};
+	std::array<uint16_t,16> stack{0};
+	// VF should never be used (used as flag in some programs
+	std::array<uint8_t,16> registers{0};
+	std::array<bool,16> keyboard{0};
+	uint16_t I_register = 0; // 12 lowest bits used
+	uint16_t program_counter = 0x200;
+	uint8_t stack_pointer = 0;
+	uint8_t sound_register = 0;
+	uint8_t delay_register = 0;
+	bool waiting = false;
+	Xorshift rng;
+	// XOR of word_hash over the memory words and the display rows.
+	// Chip8State updates it with every write, anything else that
+	// changes memory or display has to call rehash().
+	uint64_t content_hash = 0;
+
+	static constexpr size_t memory_words = sizeof(memory) / sizeof(uint64_t);
+
+	void rehash()
+	{
+	    content_hash = 0;
+	    for (size_t i=0; i<memory_words; ++i) {
+		uint64_t word;
+		std::memcpy(&word, &memory[i*8], sizeof(word));
+		content_hash ^= word_hash(i, word);
+	    }
+	    for (size_t row=0; row<display.size(); ++row)
+		content_hash ^= word_hash(memory_words + row, display[row]);
+	}
+
+	// Equal machines have equal fingerprints. Memory and display count
+	// through content_hash, so this only reads the few words after them.
+	uint64_t fingerprint() const
+	{
+	    constexpr size_t begin = offsetof(MachineState, stack);
+	    constexpr size_t end = offsetof(MachineState, content_hash);
+	    static_assert((end - begin) % sizeof(uint64_t) == 0);
+
+	    const auto* bytes = reinterpret_cast<const uint8_t*>(this);
+	    uint64_t hash = content_hash;
+	    for (size_t i=begin; i<end; i+=sizeof(uint64_t)) {
+		uint64_t word;
+		std::memcpy(&word, bytes + i, sizeof(word));
+		hash = (hash ^ word) * 0x100000001B3;
+		hash ^= hash >> 29;
+	    }
+	    return hash ^ hash >> 32;
+	}
+    };
+    static_assert(std::is_trivially_copyable_v<MachineState>);
+
+}
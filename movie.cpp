@@ -0,0 +1,125 @@
+#include "movie.h"
+
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+
+#include "binary.h"
+#include "chip8.h"
+#include "savestate.h"
+
+namespace Chip8 {
+
+    namespace {
+	constexpr char magic[4] = {'C', '8', 'M', 'V'};
+	constexpr uint8_t version = 1;
+	constexpr uint8_t has_hashes = 0x01;
+
+	template<typename T, typename Put>
+	void put_runs(std::vector<uint8_t>& out, const std::vector<T>& values, Put put_value)
+	{
+	    for (size_t i=0; i<values.size();) {
+		size_t run = 1;
+		while (i+run < values.size() && values[i+run] == values[i])
+		    ++run;
+		put_value(values[i]);
+		put_varint(out, run);
+		i += run;
+	    }
+	}
+
+	template<typename T, typename Get>
+	std::vector<T> get_runs(Reader& in, size_t count, Get get_value)
+	{
+	    std::vector<T> values;
+	    values.reserve(count);
+	    while (values.size() < count) {
+		const T value = get_value();
+		const auto run = in.get_varint();
+		if (run == 0 || run > count - values.size())
+		    throw std::runtime_error("Malformed run in movie");
+		values.insert(values.end(), run, value);
+	    }
+	    return values;
+	}
+    }
+
+    void Movie::write(std::ostream& out) const
+    {
+	if (!display_hashes.empty() && display_hashes.size() != keys.size())
+	    throw std::runtime_error("Movie needs a display hash for every frame");
+
+	std::vector<uint8_t> data(std::begin(magic), std::end(magic));
+	data.push_back(version);
+	data.push_back(display_hashes.empty() ? 0 : has_hashes);
+	put<uint64_t>(data, seed);
+	put<uint32_t>(data, quirks);
+	put<uint32_t>(data, instructions_per_frame);
+	put<uint32_t>(data, rom_hash);
+	put_varint(data, keys.size());
+	put_runs(data, keys, [&](uint16_t mask) { put_varint(data, mask); });
+	put_runs(data, display_hashes, [&](uint64_t hash) { put<uint64_t>(data, hash); });
+
+	out.write(reinterpret_cast<const char*>(data.data()), data.size());
+    }
+
+    Movie Movie::read(std::istream& in)
+    {
+	const std::vector<uint8_t> data{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+	Reader reader(data.data(), data.size(), "movie");
+
+	if (std::memcmp(reader.take(sizeof(magic)), magic, sizeof(magic)) != 0)
+	    throw std::runtime_error("Not a movie");
+	if (reader.get<uint8_t>() != version)
+	    throw std::runtime_error("Unsupported movie version");
+	const auto flags = reader.get<uint8_t>();
+
+	Movie movie;
+	movie.seed = reader.get<uint64_t>();
+	movie.quirks = reader.get<uint32_t>();
+	movie.instructions_per_frame = reader.get<uint32_t>();
+	movie.rom_hash = reader.get<uint32_t>();
+
+	const auto frames = reader.get_varint();
+	// Every run takes at least two bytes
+	if (frames > 0 && reader.remaining() < 2)
+	    throw std::runtime_error("Truncated movie");
+	movie.keys = get_runs<uint16_t>(reader, frames, [&] { return static_cast<uint16_t>(reader.get_varint()); });
+	if (flags & has_hashes)
+	    movie.display_hashes = get_runs<uint64_t>(reader, frames, [&] { return reader.get<uint64_t>(); });
+	return movie;
+    }
+
+
+    ReplayResult replay(const Movie& movie, const std::vector<uint8_t>& rom, Chip8State& m,
+			const std::function<void(const Chip8State&)>& on_frame)
+    {
+	if (movie.rom_hash != rom_hash(rom))
+	    throw std::runtime_error("Movie was recorded with a different rom");
+	if (movie.quirks != 0)
+	    throw std::runtime_error("Movie uses unsupported quirks");
+
+	// Power on, whatever m ran before
+	m.restore(Chip8State().snapshot());
+	m.seed(movie.seed);
+	m.load_rom(rom);
+
+	ReplayResult result;
+	const bool verify = !movie.display_hashes.empty();
+	for (size_t frame=0; frame<movie.keys.size(); ++frame) {
+	    m.set_keyboard(movie.keys[frame]);
+	    m.run_frame(movie.instructions_per_frame);
+	    result.frames++;
+	    if (on_frame)
+		on_frame(m);
+
+	    if (verify && m.display_hash() != movie.display_hashes[frame]) {
+		result.mismatch = frame;
+		break;
+	    }
+	}
+	return result;
+    }
+
+}
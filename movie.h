@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <optional>
+#include <vector>
+
+namespace Chip8 {
+
+    class Chip8State;
+
+    // Everything needed to repeat a session exactly: the machine starts
+    // from the rom with seed, and frame i runs with keys[i] held.
+    struct Movie {
+	uint64_t seed = 0;
+	// Interpreter quirks the session ran with, there are none yet
+	uint32_t quirks = 0;
+	uint32_t instructions_per_frame = 1;
+	uint32_t rom_hash = 0;
+	std::vector<uint16_t> keys;
+	// After each frame, empty if not recorded
+	std::vector<uint64_t> display_hashes;
+
+	// Keys and hashes are stored as runs of equal values
+	void write(std::ostream& out) const;
+	static Movie read(std::istream& in);
+    };
+
+    struct ReplayResult {
+	size_t frames = 0;
+	// First frame whose display did not match the recording
+	std::optional<size_t> mismatch;
+    };
+
+    // Runs the movie on m from power on, calling on_frame after every
+    // frame. Throws if the movie was recorded with another rom or with
+    // quirks this interpreter does not have.
+    ReplayResult replay(const Movie& movie, const std::vector<uint8_t>& rom, Chip8State& m,
+			const std::function<void(const Chip8State&)>& on_frame=nullptr);
+
+}
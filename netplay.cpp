@@ -0,0 +1,216 @@
+#include "netplay.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "binary.h"
+#include "chip8.h"
+
+namespace Chip8 {
+
+    namespace {
+	constexpr char magic[4] = {'C', '8', 'N', 'P'};
+	constexpr uint8_t version = 1;
+	// Far more than a session ever has unacknowledged
+	constexpr size_t max_keys = 1024;
+    }
+
+    std::vector<uint8_t> NetplayPacket::encode() const
+    {
+	std::vector<uint8_t> data(std::begin(magic), std::end(magic));
+	data.push_back(version);
+	put<uint32_t>(data, rom_hash);
+	put_varint(data, ack);
+	put_varint(data, first_frame);
+	put_varint(data, keys.size());
+	for (const auto mask : keys)
+	    put_varint(data, mask);
+	return data;
+    }
+
+    NetplayPacket NetplayPacket::decode(const uint8_t* data, size_t size)
+    {
+	Reader reader(data, size, "netplay packet");
+	if (std::memcmp(reader.take(sizeof(magic)), magic, sizeof(magic)) != 0)
+	    throw std::runtime_error("Not a netplay packet");
+	if (reader.get<uint8_t>() != version)
+	    throw std::runtime_error("Unsupported netplay version");
+
+	NetplayPacket packet;
+	packet.rom_hash = reader.get<uint32_t>();
+	packet.ack = reader.get_varint();
+	packet.first_frame = reader.get_varint();
+	const auto count = reader.get_varint();
+	if (count > max_keys)
+	    throw std::runtime_error("Too many keys in netplay packet");
+	for (size_t i=0; i<count; ++i)
+	    packet.keys.push_back(reader.get_varint());
+	return packet;
+    }
+
+
+    RollbackSession::RollbackSession(Chip8State& m, size_t instructions_per_frame, size_t max_rollback)
+	: m{m}, instructions_per_frame{instructions_per_frame}, max_rollback{max_rollback}
+	, snapshots(max_rollback + 1)
+    {
+    }
+
+    uint16_t RollbackSession::predicted(uint32_t frame) const
+    {
+	if (frame < remote.size())
+	    return remote[frame];
+	return remote.empty() ? 0 : remote.back();
+    }
+
+    void RollbackSession::run(uint32_t frame)
+    {
+	snapshots[frame % snapshots.size()] = m.snapshot();
+	m.set_keyboard(local[frame] | used[frame]);
+	m.run_frame(instructions_per_frame);
+    }
+
+    void RollbackSession::roll_back()
+    {
+	if (!mispredicted)
+	    return;
+
+	const uint32_t from = *mispredicted;
+	mispredicted.reset();
+	m.restore(snapshots[from % snapshots.size()]);
+	for (uint32_t f=from; f<frame(); ++f) {
+	    used[f] = predicted(f);
+	    run(f);
+	    resimulated++;
+	}
+	rollback_count++;
+    }
+
+    void RollbackSession::advance(uint16_t keys)
+    {
+	if (!can_advance())
+	    throw std::runtime_error("Too far ahead of the remote side");
+
+	roll_back();
+	const uint32_t f = frame();
+	local.push_back(keys);
+	used.push_back(predicted(f));
+	run(f);
+    }
+
+    void RollbackSession::receive_remote(uint32_t frame, uint16_t keys)
+    {
+	// Duplicates and anything after a gap, the gap is resent
+	if (frame != remote.size())
+	    return;
+
+	remote.push_back(keys);
+	if (frame < used.size() && used[frame] != keys)
+	    mispredicted = std::min(mispredicted.value_or(frame), frame);
+    }
+
+    NetplayPacket RollbackSession::packet(uint32_t rom_hash) const
+    {
+	NetplayPacket packet;
+	packet.rom_hash = rom_hash;
+	packet.ack = confirmed();
+	packet.first_frame = acked;
+	packet.keys.assign(local.begin() + acked, local.end());
+	return packet;
+    }
+
+    void RollbackSession::receive(const NetplayPacket& packet, uint32_t rom_hash)
+    {
+	if (packet.rom_hash != rom_hash)
+	    throw std::runtime_error("The other side runs a different rom");
+
+	acked = std::max(acked, std::min(packet.ack, frame()));
+	for (size_t i=0; i<packet.keys.size(); ++i)
+	    receive_remote(packet.first_frame + i, packet.keys[i]);
+	roll_back();
+    }
+
+
+    NetplayLink::NetplayLink(uint16_t local_port, const std::string& remote_host, uint16_t remote_port)
+    {
+	set_peer(remote_host, remote_port);
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+	    throw std::runtime_error(std::string("Could not create socket: ") + std::strerror(errno));
+
+	sockaddr_in local{};
+	local.sin_family = AF_INET;
+	local.sin_port = htons(local_port);
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(fd, reinterpret_cast<const sockaddr*>(&local), sizeof(local)) != 0) {
+	    const auto error = errno;
+	    close(fd);
+	    throw std::runtime_error("Could not bind port " + std::to_string(local_port) + ": " + std::strerror(error));
+	}
+    }
+
+    NetplayLink::~NetplayLink()
+    {
+	close(fd);
+    }
+
+    uint16_t NetplayLink::local_port() const
+    {
+	sockaddr_in local{};
+	socklen_t size = sizeof(local);
+	if (getsockname(fd, reinterpret_cast<sockaddr*>(&local), &size) != 0)
+	    throw std::runtime_error(std::string("Could not read the local port: ") + std::strerror(errno));
+	return ntohs(local.sin_port);
+    }
+
+    void NetplayLink::set_peer(const std::string& host, uint16_t port)
+    {
+	sockaddr_in remote{};
+	remote.sin_family = AF_INET;
+	remote.sin_port = htons(port);
+	const auto address = host == "localhost" ? std::string("127.0.0.1") : host;
+	if (inet_pton(AF_INET, address.c_str(), &remote.sin_addr) != 1)
+	    throw std::runtime_error("Not an IPv4 address: " + host);
+	static_assert(sizeof(remote) <= sizeof(remote_address));
+	std::memcpy(remote_address.data(), &remote, sizeof(remote));
+    }
+
+    void NetplayLink::send(const NetplayPacket& packet)
+    {
+	const auto data = packet.encode();
+	// Nothing to do about a full buffer or a peer not up yet, the keys
+	// go out again with the next packet
+	sendto(fd, data.data(), data.size(), 0, reinterpret_cast<const sockaddr*>(remote_address.data()), sizeof(sockaddr_in));
+    }
+
+    std::optional<NetplayPacket> NetplayLink::receive()
+    {
+	sockaddr_in remote;
+	std::memcpy(&remote, remote_address.data(), sizeof(remote));
+
+	uint8_t buffer[4096];
+	while (true) {
+	    sockaddr_in from{};
+	    socklen_t from_size = sizeof(from);
+	    const auto size = recvfrom(fd, buffer, sizeof(buffer), 0, reinterpret_cast<sockaddr*>(&from), &from_size);
+	    if (size < 0)
+		return std::nullopt;
+	    if (from.sin_port != remote.sin_port || from.sin_addr.s_addr != remote.sin_addr.s_addr)
+		continue;
+	    try {
+		return NetplayPacket::decode(buffer, size);
+	    } catch (const std::exception&) {
+		continue;
+	    }
+	}
+    }
+
+}
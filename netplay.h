@@ -0,0 +1,106 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "machine.h"
+
+namespace Chip8 {
+
+    class Chip8State;
+
+    // What one side sends every frame: its keys from first_frame on, and
+    // how many frames of the other side's keys it has. Keys are resent
+    // until acknowledged, so a lost packet costs nothing but latency.
+    struct NetplayPacket {
+	uint32_t rom_hash = 0;
+	uint32_t ack = 0;
+	uint32_t first_frame = 0;
+	std::vector<uint16_t> keys;
+
+	std::vector<uint8_t> encode() const;
+	// Throws on anything that is not a packet
+	static NetplayPacket decode(const uint8_t* data, size_t size);
+    };
+
+    // Two machines kept in lockstep without waiting for each other. The
+    // remote keys are predicted to stay as they were last seen. When the
+    // real keys arrive and differ, the machine goes back to the snapshot
+    // before that frame and runs the frames since again. Each side's input
+    // is the union of both players' keys.
+    class RollbackSession {
+	public:
+	    RollbackSession(Chip8State& m, size_t instructions_per_frame, size_t max_rollback=8);
+
+	    // Frames run so far
+	    uint32_t frame() const { return local.size(); }
+	    // Frames of remote keys received
+	    uint32_t confirmed() const { return remote.size(); }
+	    // False while the remote side is max_rollback frames behind,
+	    // the local side has to wait for it
+	    bool can_advance() const { return frame() < confirmed() + max_rollback; }
+
+	    // Runs one frame with the local keys and the predicted remote keys
+	    void advance(uint16_t keys);
+	    // Remote keys of one frame, in order. Rolls back if they differ
+	    // from the prediction already used.
+	    void receive_remote(uint32_t frame, uint16_t keys);
+
+	    // Local keys the remote side has not acknowledged yet
+	    NetplayPacket packet(uint32_t rom_hash) const;
+	    // Throws if the packet is for another rom
+	    void receive(const NetplayPacket& packet, uint32_t rom_hash);
+
+	    size_t rollbacks() const { return rollback_count; }
+	    size_t resimulated_frames() const { return resimulated; }
+
+	private:
+	    uint16_t predicted(uint32_t frame) const;
+	    void run(uint32_t frame);
+	    void roll_back();
+
+	    Chip8State& m;
+	    size_t instructions_per_frame;
+	    size_t max_rollback;
+
+	    std::vector<uint16_t> local;
+	    std::vector<uint16_t> remote;
+	    // Remote keys each frame actually ran with
+	    std::vector<uint16_t> used;
+	    // State before frame i at i % snapshots.size()
+	    std::vector<MachineState> snapshots;
+	    uint32_t acked = 0;
+	    // Earliest frame that ran with a wrong prediction
+	    std::optional<uint32_t> mispredicted;
+
+	    size_t rollback_count = 0;
+	    size_t resimulated = 0;
+    };
+
+    // Non blocking UDP socket talking to one peer, IPv4 only
+    class NetplayLink {
+	public:
+	    NetplayLink(uint16_t local_port, const std::string& remote_host, uint16_t remote_port);
+	    ~NetplayLink();
+	    NetplayLink(const NetplayLink&) = delete;
+	    NetplayLink& operator=(const NetplayLink&) = delete;
+
+	    // Port 0 binds any free port, this tells which one
+	    uint16_t local_port() const;
+	    void set_peer(const std::string& host, uint16_t port);
+
+	    void send(const NetplayPacket& packet);
+	    // std::nullopt once nothing is waiting. Malformed datagrams and
+	    // datagrams from others than the peer are dropped.
+	    std::optional<NetplayPacket> receive();
+
+	private:
+	    int fd = -1;
+	    std::array<uint8_t,16> remote_address{};
+    };
+
+}
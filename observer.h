@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+
+#include "decode.h"
+
+namespace Chip8 {
+
+    class Chip8State;
+
+    // Called by Chip8State::step() after every instruction. Compiled out
+    // unless CHIP8_TRACE is defined.
+    class ExecutionObserver {
+	public:
+	    virtual ~ExecutionObserver() = default;
+	    virtual void executed(const Chip8State& m, uint16_t pc, Instruction instruction) = 0;
+    };
+
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <unordered_set>
+#include <vector>
+
+namespace Chip8 {
+
+    inline unsigned int default_threads()
+    {
+	return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // Calls fn(i) for every i in [0, count), spread over threads. Work is
+    // handed out one index at a time, so uneven items balance themselves.
+    template<typename Fn>
+    void parallel_for(size_t count, Fn&& fn, unsigned int threads=default_threads())
+    {
+	threads = std::max(1u, std::min<unsigned int>(threads, count));
+	std::atomic<size_t> next{0};
+
+	auto work = [&] {
+	    for (size_t i=next++; i<count; i=next++)
+		fn(i);
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned int t=1; t<threads; ++t)
+	    pool.emplace_back(work);
+	work();
+
+	for (auto& thread : pool)
+	    thread.join();
+    }
+
+    // Threads kept for repeated parallel_for style calls, where starting
+    // new threads every time would cost more than the work itself
+    class WorkerPool {
+	public:
+	    explicit WorkerPool(unsigned int threads=default_threads())
+	    {
+		for (unsigned int t=1; t<std::max(1u, threads); ++t)
+		    workers.emplace_back([this] { serve(); });
+	    }
+
+	    ~WorkerPool()
+	    {
+		{
+		    std::lock_guard<std::mutex> lock(mutex);
+		    stopping = true;
+		}
+		wake.notify_all();
+		for (auto& worker : workers)
+		    worker.join();
+	    }
+
+	    WorkerPool(const WorkerPool&) = delete;
+	    WorkerPool& operator=(const WorkerPool&) = delete;
+
+	    unsigned int size() const { return workers.size() + 1; }
+
+	    // Calls fn(i) for every i in [0, count) like parallel_for, the
+	    // calling thread works too. Allocates nothing.
+	    template<typename Fn>
+	    void run(size_t count, Fn&& fn)
+	    {
+		using Callable = std::remove_reference_t<Fn>;
+		if (workers.empty() || count < 2) {
+		    for (size_t i=0; i<count; ++i)
+			fn(i);
+		    return;
+		}
+
+		{
+		    std::lock_guard<std::mutex> lock(mutex);
+		    job = [](void* context, size_t i) { (*static_cast<Callable*>(context))(i); };
+		    context = const_cast<void*>(static_cast<const void*>(&fn));
+		    job_size = count;
+		    next = 0;
+		    busy = workers.size();
+		    generation++;
+		}
+		wake.notify_all();
+		work();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&] { return busy == 0; });
+	    }
+
+	private:
+	    void work()
+	    {
+		for (size_t i=next++; i<job_size; i=next++)
+		    job(context, i);
+	    }
+
+	    void serve()
+	    {
+		uint64_t seen = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+		    wake.wait(lock, [&] { return stopping || generation != seen; });
+		    if (stopping)
+			return;
+		    seen = generation;
+		    lock.unlock();
+		    work();
+		    lock.lock();
+		    if (--busy == 0)
+			done.notify_one();
+		}
+	    }
+
+	    std::vector<std::thread> workers;
+	    std::mutex mutex;
+	    std::condition_variable wake;
+	    std::condition_variable done;
+	    bool stopping = false;
+	    uint64_t generation = 0;
+	    size_t busy = 0;
+
+	    void (*job)(void*, size_t) = nullptr;
+	    void* context = nullptr;
+	    size_t job_size = 0;
+	    std::atomic<size_t> next{0};
+    };
+
+    // Set of 64 bit hashes shared by many threads. Split into shards with
+    // a lock each, picked by the high bits of the hash, so threads rarely
+    // wait for each other.
+    class ShardedSet {
+	public:
+	    explicit ShardedSet(size_t shard_count=64) : shards(shard_count) {}
+
+	    // True if key was not in the set yet
+	    bool insert(uint64_t key)
+	    {
+		auto& shard = shards[(key >> 40) % shards.size()];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		return shard.keys.insert(key).second;
+	    }
+
+	    size_t size() const
+	    {
+		size_t total = 0;
+		for (auto& shard : shards) {
+		    std::lock_guard<std::mutex> lock(shard.mutex);
+		    total += shard.keys.size();
+		}
+		return total;
+	    }
+
+	private:
+	    struct Shard {
+		mutable std::mutex mutex;
+		std::unordered_set<uint64_t> keys;
+	    };
+	    std::vector<Shard> shards;
+    };
+
+    // Bounded queue for exactly one producer and one consumer thread,
+    // without locks. Capacity is rounded up to a power of two.
+    template<typename T>
+    class SpscQueue {
+	public:
+	    explicit SpscQueue(size_t capacity)
+	    {
+		size_t size = 2;
+		while (size < capacity)
+		    size *= 2;
+		slots.resize(size);
+		mask = size - 1;
+	    }
+
+	    // False if the queue is full, value is left alone then
+	    bool try_push(const T& value)
+	    {
+		const auto t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == slots.size())
+		    return false;
+		slots[t & mask] = value;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	    }
+
+	    bool try_pop(T& value)
+	    {
+		const auto h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+		    return false;
+		value = slots[h & mask];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	    }
+
+	    bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+
+	private:
+	    std::vector<T> slots;
+	    size_t mask;
+	    // Monotonic positions, on their own cache lines so the two
+	    // threads do not fight over one
+	    alignas(64) std::atomic<size_t> head{0};
+	    alignas(64) std::atomic<size_t> tail{0};
+    };
+
+}
@@ -0,0 +1,115 @@
+#include "perf_counters.h"
+
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace Chip8 {
+
+#ifdef __linux__
+    namespace {
+	int open_counter(uint32_t type, uint64_t config)
+	{
+	    perf_event_attr attr;
+	    std::memset(&attr, 0, sizeof(attr));
+	    attr.size = sizeof(attr);
+	    attr.type = type;
+	    attr.config = config;
+	    attr.disabled = 1;
+	    attr.exclude_kernel = 1;
+	    attr.exclude_hv = 1;
+	    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+    }
+
+    PerfCounters::PerfCounters()
+    {
+	constexpr uint64_t l1d_read_miss = PERF_COUNT_HW_CACHE_L1D
+	    | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+	    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+	fds[Cycles] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	fds[Instructions] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	fds[BranchMisses] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+	fds[L1dMisses] = open_counter(PERF_TYPE_HW_CACHE, l1d_read_miss);
+
+	if (!available())
+	    open_error = std::strerror(errno);
+    }
+
+    PerfCounters::~PerfCounters()
+    {
+	for (const int fd : fds) {
+	    if (fd >= 0)
+		close(fd);
+	}
+    }
+
+    void PerfCounters::start()
+    {
+	for (const int fd : fds) {
+	    if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	    }
+	}
+    }
+
+    PerfCounters::Sample PerfCounters::stop()
+    {
+	for (const int fd : fds) {
+	    if (fd >= 0)
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	}
+
+	Sample sample;
+	for (size_t i=0; i<Count; ++i) {
+	    // value, time enabled, time running
+	    uint64_t data[3];
+	    if (fds[i] < 0 || read(fds[i], data, sizeof(data)) != sizeof(data) || data[2] == 0)
+		continue;
+	    sample.values[i] = data[1] == data[2] ? data[0]
+		: static_cast<uint64_t>(static_cast<double>(data[0]) * data[1] / data[2]);
+	    sample.valid[i] = true;
+	}
+	return sample;
+    }
+#else
+    PerfCounters::PerfCounters() : open_error{"not supported on this platform"}
+    {
+	fds.fill(-1);
+    }
+
+    PerfCounters::~PerfCounters() {}
+    void PerfCounters::start() {}
+    PerfCounters::Sample PerfCounters::stop() { return {}; }
+#endif
+
+    bool PerfCounters::available() const
+    {
+	for (const int fd : fds) {
+	    if (fd >= 0)
+		return true;
+	}
+	return false;
+    }
+
+    const char* PerfCounters::name(Counter counter)
+    {
+	switch (counter) {
+	    case Cycles: return "cycles";
+	    case Instructions: return "instructions";
+	    case BranchMisses: return "branch_misses";
+	    case L1dMisses: return "l1d_misses";
+	    default: return "";
+	}
+    }
+
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+namespace Chip8 {
+
+    // Hardware counters of the calling thread through perf_event_open.
+    // Counters the kernel refuses (perf_event_paranoid, containers, no PMU)
+    // are simply not available; on other platforms none are.
+    class PerfCounters {
+	public:
+	    enum Counter { Cycles, Instructions, BranchMisses, L1dMisses, Count };
+
+	    struct Sample {
+		std::array<uint64_t,Count> values{0};
+		std::array<bool,Count> valid{false};
+	    };
+
+	    PerfCounters();
+	    ~PerfCounters();
+	    PerfCounters(const PerfCounters&) = delete;
+	    PerfCounters& operator=(const PerfCounters&) = delete;
+
+	    bool available() const;
+	    // Why nothing could be opened, empty if available
+	    const std::string& error() const { return open_error; }
+
+	    void start();
+	    // Counts since start, scaled up when the kernel had to multiplex
+	    Sample stop();
+
+	    static const char* name(Counter counter);
+
+	private:
+	    std::array<int,Count> fds;
+	    std::string open_error;
+    };
+
+}
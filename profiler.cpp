@@ -0,0 +1,110 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "chip8.h"
+
+namespace Chip8 {
+
+    namespace {
+	std::string hex_address(uint16_t addr)
+	{
+	    std::stringstream ss;
+	    ss << "0x" << std::hex << std::setfill('0') << std::setw(3) << addr;
+	    return ss.str();
+	}
+
+	// Label starting at addr, else the address
+	std::string frame_name(uint16_t addr, const SymbolTable& symbols)
+	{
+	    if (const auto* label = symbols.label_at(addr); label && label->start == addr)
+		return label->name;
+	    return hex_address(addr);
+	}
+    }
+
+    Profiler::Profiler(ExecutionObserver* next)
+	: next(next)
+    {
+	frames.push_back({0, Chip8State::program_start, 0, 0});
+    }
+
+    void Profiler::executed(const Chip8State& m, uint16_t pc, Instruction instruction)
+    {
+	counts.add(pc, instruction);
+	const Opcode op = decode(instruction);
+	opcodes[static_cast<size_t>(op)]++;
+	frames[current].cycles += instruction_cycles(instruction);
+
+	const uint16_t target = m.get_program_counter() & 0xFFF;
+	if (op == Opcode::CALL && frames[current].depth >= max_depth) {
+	    folded++;
+	} else if (op == Opcode::CALL) {
+	    const uint64_t key = static_cast<uint64_t>(current) << 12 | target;
+	    auto [it, inserted] = children.try_emplace(key, frames.size());
+	    if (inserted)
+		frames.push_back({current, target, static_cast<uint8_t>(frames[current].depth + 1), 0});
+	    current = it->second;
+	} else if (op == Opcode::RET && folded > 0) {
+	    folded--;
+	} else if (op == Opcode::RET) {
+	    current = frames[current].parent;
+	} else if (target <= (pc & 0xFFF)) {
+	    back_edges[(pc & 0xFFF) << 12 | target]++;
+	}
+
+	if (next)
+	    next->executed(m, pc, instruction);
+    }
+
+    std::vector<Profiler::Loop> Profiler::hot_loops() const
+    {
+	std::vector<Loop> loops;
+	for (const auto& [key, count] : back_edges)
+	    loops.push_back({static_cast<uint16_t>(key >> 12), static_cast<uint16_t>(key & 0xFFF), count});
+	std::sort(loops.begin(), loops.end(), [](const Loop& a, const Loop& b) {
+	    return a.count != b.count ? a.count > b.count : a.from < b.from;
+	});
+	return loops;
+    }
+
+    void Profiler::write_report(std::ostream& out, const SymbolTable& symbols) const
+    {
+	write_profile(out, counts, symbols);
+
+	std::vector<size_t> order;
+	for (size_t op=0; op<opcode_count; ++op)
+	    if (opcodes[op] > 0)
+		order.push_back(op);
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return opcodes[a] > opcodes[b]; });
+
+	out << "# instructions opcode\n";
+	for (const auto op : order)
+	    out << std::setw(12) << opcodes[op] << "  " << opcode_info[op].name << '\n';
+
+	out << "# iterations loop\n";
+	for (const auto& loop : hot_loops()) {
+	    out << std::setw(12) << loop.count << "  " << hex_address(loop.from) << " -> " << hex_address(loop.to);
+	    if (const auto* label = symbols.label_at(loop.to))
+		out << "  " << label->name;
+	    out << '\n';
+	}
+    }
+
+    void Profiler::write_stacks(std::ostream& out, const SymbolTable& symbols) const
+    {
+	// Children always come after their parent, so names can be built in order
+	std::vector<std::string> names(frames.size());
+	for (size_t i=0; i<frames.size(); ++i) {
+	    const auto name = frame_name(frames[i].addr, symbols);
+	    names[i] = i == 0 ? name : names[frames[i].parent] + ';' + name;
+	    if (frames[i].cycles > 0)
+		out << names[i] << ' ' << frames[i].cycles << '\n';
+	}
+    }
+
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <iosfwd>
+#include <unordered_map>
+#include <vector>
+
+#include "decode.h"
+#include "observer.h"
+#include "symbols.h"
+
+namespace Chip8 {
+
+    // Guest code profiler, counts every instruction executed through
+    // step() per address, per opcode, per loop and per call stack.
+    class Profiler : public ExecutionObserver {
+	public:
+	    // Instructions are passed on to next, so profiling and tracing
+	    // can be combined
+	    explicit Profiler(ExecutionObserver* next=nullptr);
+	    void set_next(ExecutionObserver* o) { next = o; }
+
+	    void executed(const Chip8State& m, uint16_t pc, Instruction instruction) override;
+
+	    // A jump from one address back to another, taken count times
+	    struct Loop {
+		uint16_t from;
+		uint16_t to;
+		uint64_t count;
+	    };
+
+	    const ExecutionCounts& get_counts() const { return counts; }
+	    uint64_t executions(Opcode op) const { return opcodes[static_cast<size_t>(op)]; }
+	    // Most taken first
+	    std::vector<Loop> hot_loops() const;
+
+	    // Per line and label as write_profile, followed by opcodes and loops
+	    void write_report(std::ostream& out, const SymbolTable& symbols) const;
+	    // One "outer;inner cycles" line per call stack, for flame graphs
+	    void write_stacks(std::ostream& out, const SymbolTable& symbols) const;
+
+	private:
+	    ExecutionObserver* next = nullptr;
+
+	    ExecutionCounts counts;
+	    std::array<uint64_t,opcode_count> opcodes{};
+	    // from << 12 | to
+	    std::unordered_map<uint32_t,uint64_t> back_edges;
+
+	    // Call tree built from CALL and RET, frames[0] is the root. No
+	    // deeper than the machine's stack, calls below that count for
+	    // the deepest frame, so recursion can not grow it without bound.
+	    struct Frame {
+		uint32_t parent;
+		uint16_t addr;
+		uint8_t depth;
+		uint64_t cycles;
+	    };
+	    static constexpr uint8_t max_depth = 16;
+	    std::vector<Frame> frames;
+	    // parent << 12 | addr to the child frame
+	    std::unordered_map<uint64_t,uint32_t> children;
+	    uint32_t current = 0;
+	    // Calls folded into the deepest frame and not returned from yet
+	    uint64_t folded = 0;
+    };
+
+}
@@ -0,0 +1,133 @@
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "chip8.h"
+#include "coverage.h"
+#include "movie.h"
+#include "parallel.h"
+#include "video.h"
+
+using namespace Chip8;
+
+// Replays movies recorded by Chip8App --record as fast as possible and
+// checks the display after every frame. Several movies are replayed in
+// parallel, their coverage merged into one file. A single movie can be
+// exported as video, encoded on a second thread while it replays.
+int main(int argc, char** argv)
+{
+    std::vector<std::string> movie_files;
+    std::string coverage_output;
+    std::string video_output;
+    unsigned int video_scale = 8;
+    unsigned int threads = default_threads();
+    for (int i=2; i<argc; ++i) {
+	const std::string arg = argv[i];
+	if (arg == "--coverage" && i+1 < argc)
+	    coverage_output = argv[++i];
+	else if (arg == "--video" && i+1 < argc)
+	    video_output = argv[++i];
+	else if (arg == "--scale" && i+1 < argc)
+	    video_scale = std::stoul(argv[++i]);
+	else if (arg == "-j" && i+1 < argc)
+	    threads = std::stoul(argv[++i]);
+	else
+	    movie_files.push_back(arg);
+    }
+    if (argc < 3 || movie_files.empty()) {
+	std::cerr << "Usage: " << argv[0] << " <rom> <movie>... [--coverage out.cov] [--video out.gif|out.y4m|out.pbm] [--scale n] [-j threads]\n";
+	return 1;
+    }
+    if (!video_output.empty() && movie_files.size() != 1) {
+	std::cerr << "Only one movie at a time can be exported as video\n";
+	return 1;
+    }
+
+#ifndef CHIP8_TRACE
+    if (!coverage_output.empty()) {
+	std::cerr << "Coverage needs a build with CHIP8_TRACE\n";
+	return 1;
+    }
+#endif
+
+    std::vector<uint8_t> rom;
+    std::vector<Movie> movies;
+    std::unique_ptr<VideoRecorder> video;
+    try {
+	rom = read_rom(argv[1]);
+	for (const auto& filename : movie_files) {
+	    std::ifstream in(filename, std::ios::binary);
+	    if (!in)
+		throw std::runtime_error("Could not open " + filename);
+	    movies.push_back(Movie::read(in));
+	}
+	if (!video_output.empty())
+	    video = std::make_unique<VideoRecorder>(make_video_encoder(video_output, video_scale), true);
+    } catch (const std::exception& e) {
+	std::cerr << e.what() << '\n';
+	return 1;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<ReplayResult> results(movies.size());
+    std::vector<Coverage> coverage(movies.size());
+    std::vector<std::optional<std::string>> errors(movies.size());
+    parallel_for(movies.size(), [&](size_t i) {
+	Chip8State m;
+	CoverageRecorder recorder;
+	if (!coverage_output.empty())
+	    m.set_observer(&recorder);
+	try {
+	    if (video)
+		results[i] = replay(movies[i], rom, m, [&](const Chip8State& state) { video->push(state.snapshot().display); });
+	    else
+		results[i] = replay(movies[i], rom, m);
+	} catch (const std::exception& e) {
+	    errors[i] = e.what();
+	}
+	coverage[i] = recorder.coverage;
+    }, threads);
+    try {
+	if (video)
+	    video->finish();
+    } catch (const std::exception& e) {
+	std::cerr << "Could not export video: " << e.what() << '\n';
+	return 1;
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    int status = 0;
+    size_t frames = 0;
+    for (size_t i=0; i<movies.size(); ++i) {
+	std::cout << movie_files[i] << ": ";
+	if (errors[i]) {
+	    std::cout << *errors[i] << '\n';
+	    status = 1;
+	    continue;
+	}
+
+	frames += results[i].frames;
+	std::cout << results[i].frames << " frames";
+	if (movies[i].display_hashes.empty())
+	    std::cout << ", no display hashes to verify\n";
+	else if (results[i].mismatch)
+	    std::cout << ", display differs from the recording at frame " << *results[i].mismatch << '\n';
+	else
+	    std::cout << ", display matches\n";
+	if (results[i].mismatch && status == 0)
+	    status = 2;
+    }
+    std::cout << frames << " frames in " << elapsed.count() << "s\n";
+
+    if (!coverage_output.empty()) {
+	for (size_t i=1; i<coverage.size(); ++i)
+	    coverage[0].merge(coverage[i]);
+	std::ofstream out(coverage_output, std::ios::binary);
+	coverage[0].write(out);
+    }
+
+    return status;
+}
@@ -0,0 +1,144 @@
+#include "rewind.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "savestate.h"
+
+namespace Chip8 {
+
+    // Deltas compare raw bytes, padding would only add noise
+    static_assert(std::has_unique_object_representations_v<MachineState>);
+
+    namespace {
+	constexpr size_t npos = SIZE_MAX;
+
+	const uint8_t* bytes(const MachineState& state) { return reinterpret_cast<const uint8_t*>(&state); }
+	uint8_t* bytes(MachineState& state) { return reinterpret_cast<uint8_t*>(&state); }
+
+	// All zero bytes, the only members not zero by default cleared here
+	const MachineState blank_state = [] {
+	    MachineState state{};
+	    state.program_counter = 0;
+	    state.rng.state = 0;
+	    return state;
+	}();
+    }
+
+    RewindBuffer::RewindBuffer(size_t capacity, size_t keyframe_interval)
+	: ring(capacity)
+	, keyframe_interval{std::max<size_t>(1, keyframe_interval)}
+    {
+	// Room for at least a couple of uncompressed keyframes
+	if (capacity < 4*sizeof(MachineState))
+	    throw std::runtime_error("Rewind buffer is too small");
+	scratch.reserve(2*sizeof(MachineState));
+    }
+
+    void RewindBuffer::push(const MachineState& state)
+    {
+	scratch.clear();
+	const bool keyframe = entries.empty() || since_keyframe + 1 >= keyframe_interval;
+	// Keyframes compress well against zero, most of memory is unused
+	encode_delta(scratch, bytes(state), bytes(keyframe ? blank_state : head), sizeof(MachineState));
+	head = state;
+	store(keyframe);
+    }
+
+    void RewindBuffer::store(bool keyframe)
+    {
+	size_t offset = find_space(scratch.size());
+	while (offset == npos) {
+	    // Dropping the group this delta belongs to would orphan it
+	    if (!keyframe && entries.front().offset == entries[entries.size() - since_keyframe - 1].offset) {
+		scratch.clear();
+		encode_delta(scratch, bytes(head), bytes(blank_state), sizeof(MachineState));
+		keyframe = true;
+	    }
+	    drop_oldest_group();
+	    offset = find_space(scratch.size());
+	}
+
+	std::memcpy(ring.data() + offset, scratch.data(), scratch.size());
+	write_pos = offset + scratch.size();
+	entries.push_back({offset, static_cast<uint32_t>(scratch.size()), keyframe});
+	since_keyframe = keyframe ? 0 : since_keyframe + 1;
+    }
+
+    size_t RewindBuffer::find_space(size_t size) const
+    {
+	if (entries.empty())
+	    return size <= ring.size() ? 0 : npos;
+
+	const size_t start = entries.front().offset;
+	if (write_pos > start) {
+	    if (write_pos + size <= ring.size())
+		return write_pos;
+	    // Records are contiguous, wrap around
+	    return size <= start ? 0 : npos;
+	}
+	return write_pos + size <= start ? write_pos : npos;
+    }
+
+    void RewindBuffer::drop_oldest_group()
+    {
+	do {
+	    entries.pop_front();
+	} while (!entries.empty() && !entries.front().keyframe);
+
+	if (entries.empty()) {
+	    write_pos = 0;
+	    since_keyframe = 0;
+	}
+    }
+
+    bool RewindBuffer::rewind(MachineState& state)
+    {
+	if (entries.size() < 2)
+	    return false;
+
+	const auto last = entries.back();
+	entries.pop_back();
+	write_pos = last.offset;
+
+	if (last.keyframe) {
+	    rebuild_head();
+	} else {
+	    // The delta to the previous frame works both ways
+	    apply_delta(ring.data() + last.offset, last.size, bytes(head), sizeof(MachineState));
+	    since_keyframe--;
+	}
+
+	state = head;
+	return true;
+    }
+
+    void RewindBuffer::rebuild_head()
+    {
+	size_t first = entries.size() - 1;
+	while (!entries[first].keyframe)
+	    --first;
+
+	head = blank_state;
+	for (size_t i=first; i<entries.size(); ++i)
+	    apply_delta(ring.data() + entries[i].offset, entries[i].size, bytes(head), sizeof(MachineState));
+	since_keyframe = entries.size() - 1 - first;
+    }
+
+    void RewindBuffer::clear()
+    {
+	entries.clear();
+	write_pos = 0;
+	since_keyframe = 0;
+    }
+
+    size_t RewindBuffer::bytes_used() const
+    {
+	size_t total = 0;
+	for (const auto& entry : entries)
+	    total += entry.size;
+	return total;
+    }
+
+}
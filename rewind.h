@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "machine.h"
+
+namespace Chip8 {
+
+    // Recent frames for running a machine backwards, in a fixed amount of
+    // memory. Every keyframe_interval frames the whole state is stored,
+    // the frames in between as the xor delta to the frame before. When the
+    // buffer is full the oldest keyframe and its deltas are dropped.
+    class RewindBuffer {
+	public:
+	    explicit RewindBuffer(size_t capacity=4<<20, size_t keyframe_interval=120);
+
+	    void push(const MachineState& state);
+	    // Steps state back to the frame before the last pushed one. False
+	    // if there is nothing older left.
+	    bool rewind(MachineState& state);
+	    void clear();
+
+	    size_t frames() const { return entries.size(); }
+	    size_t bytes_used() const;
+	    size_t capacity() const { return ring.size(); }
+
+	private:
+	    struct Entry {
+		size_t offset;
+		uint32_t size;
+		bool keyframe;
+	    };
+
+	    void store(bool keyframe);
+	    size_t find_space(size_t size) const;
+	    void drop_oldest_group();
+	    // The state at the last entry, from its keyframe onwards
+	    void rebuild_head();
+
+	    std::vector<uint8_t> ring;
+	    size_t write_pos = 0;
+	    std::deque<Entry> entries;
+
+	    size_t keyframe_interval;
+	    size_t since_keyframe = 0;
+	    // State of the last entry
+	    MachineState head;
+	    std::vector<uint8_t> scratch;
+    };
+
+}
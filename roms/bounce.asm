@@ -0,0 +1,27 @@
+# A ball bouncing off the edges of the screen.
+# Public domain.
+    LD V0, 10
+    LD V1, 5
+    LD V2, 1
+    LD V3, 1
+    LD I, :BALL:
+    DRW V0, V1, 8
+:LOOP:
+    CALL :MOVE:
+    DRW V0, V1, 8
+    JP :LOOP:
+:MOVE:
+    DRW V0, V1, 8
+    ADD V0, V2
+    ADD V1, V3
+    SNE V0, 0
+    LD V2, 1
+    SNE V0, 56
+    LD V2, 255
+    SNE V1, 0
+    LD V3, 1
+    SNE V1, 24
+    LD V3, 255
+    RET
+:BALL:
+    DB 60, 126, 255, 255, 255, 255, 126, 60
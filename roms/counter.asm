@@ -0,0 +1,28 @@
+# Counts from 0 to 255 in decimal, using BCD and the font.
+# Public domain.
+    LD V3, 0
+:LOOP:
+    CLS
+    LD I, :DIGITS:
+    LD B, V3
+    LD V2, [I]
+    LD V4, 20
+    LD V5, 12
+    LD F, V0
+    DRW V4, V5, 5
+    ADD V4, 6
+    LD F, V1
+    DRW V4, V5, 5
+    ADD V4, 6
+    LD F, V2
+    DRW V4, V5, 5
+    ADD V3, 1
+    LD V6, 2
+    LD DT, V6
+:WAIT:
+    LD V6, DT
+    SE V6, 0
+    JP :WAIT:
+    JP :LOOP:
+:DIGITS:
+    DB 0, 0, 0
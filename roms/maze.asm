@@ -0,0 +1,24 @@
+# Random maze, one diagonal per 4x4 cell. Redraws forever.
+# Public domain.
+    LD V0, 0
+    LD V1, 0
+:LOOP:
+    RND V2, 1
+    LD I, :LEFT:
+    SE V2, 0
+    LD I, :RIGHT:
+    DRW V0, V1, 4
+    ADD V0, 4
+    SE V0, 64
+    JP :LOOP:
+    LD V0, 0
+    ADD V1, 4
+    SE V1, 32
+    JP :LOOP:
+    CLS
+    LD V1, 0
+    JP :LOOP:
+:LEFT:
+    DB 128, 64, 32, 16
+:RIGHT:
+    DB 16, 32, 64, 128
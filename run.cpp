@@ -1,16 +1,117 @@
 #include <string>
+#include <iostream>
+#include <memory>
 
 #include <ncurses.h>
 
-#include "chip8.h"
+#include "runner.h"
+#include "trace.h"
 
 using namespace Chip8;
 
 int main(int argc, char* argv[])
 {
+    if (argc < 2) {
+	std::cerr << "Usage: " << argv[0] << " <rom> [--symbols file.sym] [--profile report.txt] [--stacks profile.folded] [--record movie.c8m] [--video out.gif|out.y4m|out.pbm] [--trace file] [--trace-capacity records] [--run-ahead frames] [--netplay local_port host:port]\n";
+	return 1;
+    }
+
+    std::string rom;
+    std::string symbols;
+    std::string profile;
+    std::string stacks;
+    std::string movie;
+    std::string video;
+    std::string trace;
+    size_t trace_capacity = 1<<20;
+    size_t run_ahead = 0;
+    std::string netplay_port;
+    std::string netplay_peer;
+    for (int i=1; i<argc; ++i) {
+	const std::string arg = argv[i];
+	if (arg == "--symbols" && i+1 < argc)
+	    symbols = argv[++i];
+	else if (arg == "--profile" && i+1 < argc)
+	    profile = argv[++i];
+	else if (arg == "--stacks" && i+1 < argc)
+	    stacks = argv[++i];
+	else if (arg == "--record" && i+1 < argc)
+	    movie = argv[++i];
+	else if (arg == "--video" && i+1 < argc)
+	    video = argv[++i];
+	else if (arg == "--trace" && i+1 < argc)
+	    trace = argv[++i];
+	else if (arg == "--trace-capacity" && i+1 < argc)
+	    trace_capacity = std::stoull(argv[++i]);
+	else if (arg == "--run-ahead" && i+1 < argc)
+	    run_ahead = std::stoul(argv[++i]);
+	else if (arg == "--netplay" && i+2 < argc) {
+	    netplay_port = argv[++i];
+	    netplay_peer = argv[++i];
+	}
+	else
+	    rom = arg;
+    }
+
+    if (!netplay_peer.empty() && !movie.empty()) {
+	std::cerr << "A netplay session can not be recorded, the movie would hold only the local keys\n";
+	return 1;
+    }
+    if (!netplay_peer.empty() && (!trace.empty() || !profile.empty() || !stacks.empty())) {
+	std::cerr << "A netplay session can not be traced or profiled, rollbacks run frames again\n";
+	return 1;
+    }
+
+#ifndef CHIP8_TRACE
+    if (!profile.empty() || !stacks.empty()) {
+	std::cerr << "Profiling needs a build with CHIP8_TRACE\n";
+	return 1;
+    }
+#endif
+
+    std::vector<uint8_t> bytes;
+    try {
+	bytes = read_rom(rom);
+    } catch (const std::exception& e) {
+	std::cerr << e.what() << '\n';
+	return 1;
+    }
+
+    std::unique_ptr<Tracer> tracer;
+    try {
+	if (!trace.empty())
+	    tracer = std::make_unique<Tracer>(trace, trace_capacity);
+    } catch (const std::exception& e) {
+	std::cerr << e.what() << '\n';
+	return 1;
+    }
+
     Chip8Runner runner;
-    runner.load_file(std::string(argv[1]));
-    runner.run();
+    runner.load_rom(bytes);
+    runner.set_observer(tracer.get());
+    if (!movie.empty())
+	runner.set_movie_output(movie, bytes);
+    runner.set_profile_output(profile, stacks);
+    runner.set_run_ahead(run_ahead);
+    // The runner owns the terminal now, destroy() has to run on any error
+    try {
+	if (!symbols.empty())
+	    runner.load_symbols(symbols);
+	if (!video.empty())
+	    runner.set_video_output(video);
+	if (!netplay_peer.empty()) {
+	    const auto colon = netplay_peer.rfind(':');
+	    if (colon == std::string::npos)
+		throw std::runtime_error("--netplay needs host:port, got " + netplay_peer);
+	    runner.start_netplay(std::stoul(netplay_port), netplay_peer.substr(0, colon),
+		    std::stoul(netplay_peer.substr(colon+1)), bytes);
+	}
+	runner.run();
+    } catch (const std::exception& e) {
+	runner.destroy();
+	std::cerr << e.what() << '\n';
+	return 1;
+    }
     runner.destroy();
 
     return 0;
@@ -0,0 +1,388 @@
+#include "runner.h"
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#include "savestate.h"
+
+namespace Chip8 {
+    // Keypad layout on the left of a qwerty keyboard
+    static constexpr std::array<std::pair<int,uint8_t>,16> scan_map = {{
+        {SDL_SCANCODE_1, 0x1},
+        {SDL_SCANCODE_2, 0x2},
+        {SDL_SCANCODE_3, 0x3},
+        {SDL_SCANCODE_4, 0xC},
+        {SDL_SCANCODE_Q, 0x4},
+        {SDL_SCANCODE_W, 0x5},
+        {SDL_SCANCODE_E, 0x6},
+        {SDL_SCANCODE_R, 0xD},
+        {SDL_SCANCODE_A, 0x7},
+        {SDL_SCANCODE_S, 0x8},
+        {SDL_SCANCODE_D, 0x9},
+        {SDL_SCANCODE_F, 0xE},
+        {SDL_SCANCODE_Z, 0xA},
+        {SDL_SCANCODE_X, 0x0},
+        {SDL_SCANCODE_C, 0xB},
+        {SDL_SCANCODE_V, 0xF}
+    }};
+
+    // -1 if the scancode is not on the keypad
+    static int key_from_scancode(int scancode)
+    {
+	for (const auto& [code, key] : scan_map)
+	    if (code == scancode)
+		return key;
+	return -1;
+    }
+
+
+    void Chip8Runner::print_registers()
+    {
+	constexpr size_t padding = 6;
+	size_t curr_y = 1;
+	static constexpr size_t start_x = 5;
+
+	{
+	    // I registers
+	    wmove(window_, curr_y, start_x);
+	    waddstr(window_, "I:");
+	    std::stringstream ss;
+	    ss << std::setfill('0') << std::setw(4) << std::hex << static_cast<int>(get_I_register());
+	    waddstr(window_, ss.str().c_str());
+	}
+
+	curr_y += 2;
+
+	{
+	    wmove(window_, curr_y, start_x);
+	    waddstr(window_, "PC:");
+	    std::stringstream ss;
+	    ss << std::setfill('0') << std::setw(4) << std::hex << static_cast<int>(get_program_counter());
+	    waddstr(window_, ss.str().c_str());
+	}
+
+	curr_y += 2;
+
+	for (size_t i=0; i<=0xF; ++i) {
+	    std::stringstream ss;
+	    ss << "V" << std::hex << i;
+
+	    wmove(window_, curr_y, start_x+i*padding);
+	    waddstr(window_, ss.str().c_str());
+	}
+
+	curr_y += 1;
+
+	for (size_t i=0; i<=0xF; ++i) {
+	    std::stringstream ss;
+	    ss << std::setfill('0') << std::setw(4) <<  std::hex << static_cast<int>(get_register(i));
+
+	    wmove(window_, curr_y, start_x+i*padding);
+	    waddstr(window_, ss.str().c_str());
+	}
+
+	curr_y += 2;
+
+	for (size_t i=0; i<=0xF; ++i) {
+	    std::stringstream ss;
+	    ss << std::setfill(' ') << std::setw(2) << std::hex << std::uppercase << static_cast<int>(i);
+	    wmove(window_, curr_y, start_x+i*padding);
+	    waddstr(window_, ss.str().c_str());
+	}
+
+	curr_y += 1;
+
+	for (size_t i=0; i<=0xF; ++i) {
+	    std::stringstream ss;
+	    ss << std::setfill(' ') << std::setw(2) << is_pressed(i);
+	    wmove(window_, curr_y, start_x+i*padding);
+	    waddstr(window_, ss.str().c_str());
+	}
+	
+
+	curr_y += 2;
+
+	const size_t y_mem_start = curr_y;
+
+	const size_t mem_start = 0x200; 
+	const size_t mem_padding = 0x4; 
+
+	const size_t per_row = 32;
+
+	size_t curr_mem = mem_start;
+	for (size_t num_row=0; num_row<10; ++num_row) {
+	    std::stringstream ss;
+	    ss << std::hex << std::setfill('0') << std::setw(3) << static_cast<int>(curr_mem) << "  ";
+	    for (size_t i=curr_mem; i<curr_mem+per_row; ++i) {
+		ss << std::setfill('0') << std::setw(2) << std::hex << static_cast<int>(get_memory(i)) << ' ';
+	    }
+	    wmove(window_, curr_y, start_x);
+	    waddstr(window_, ss.str().c_str());
+
+	    curr_y++;
+	    curr_mem += per_row;
+	}
+
+	wrefresh(window_);
+    }
+
+    Chip8Runner::Chip8Runner() : Chip8State::Chip8State()
+			       , window_{initscr()}
+    {
+	// Headless machines are reproducible, games should not be
+	movie.seed = std::random_device{}();
+	seed(movie.seed);
+	set_undo_log(&undo_log);
+
+        if (SDL_Init(SDL_INIT_VIDEO) < 0)
+            return;
+
+        SDL_CreateWindowAndRenderer(window_real_width, window_real_height, 0, &window, &renderer);
+        SDL_RenderSetLogicalSize(renderer, window_width, window_height);
+
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 100);
+        SDL_RenderClear(renderer);
+        SDL_SetRenderDrawColor(renderer, 255,255, 255, 255);
+
+        SDL_RenderPresent(renderer);
+    }
+
+    void Chip8Runner::run()
+    {
+        bool closed = false;
+
+        while (!closed) {
+            SDL_Event event;
+
+            while (SDL_PollEvent(&event)) {
+                switch (event.type) {
+                    case SDL_QUIT:
+                        closed = true;
+                        break;
+
+			// Handle keypresses
+		    case SDL_KEYDOWN:
+			{
+			    /* std::cerr << "Button pressed or released\n"; */
+			    if (event.key.keysym.scancode == SDL_SCANCODE_BACKSPACE && !netplay)
+				rewinding = true;
+			    if (event.key.keysym.scancode == SDL_SCANCODE_P && movie_output.empty() && !netplay)
+				paused = !paused;
+			    else if (paused && event.key.keysym.scancode == SDL_SCANCODE_LEFT)
+				undo_log.step_back(*this);
+			    else if (paused && event.key.keysym.scancode == SDL_SCANCODE_RIGHT)
+				step();
+			    const auto key = key_from_scancode(event.key.keysym.scancode);
+			    if (key >= 0)
+				keys |= 1 << key;
+			    break;
+			}
+		    case SDL_KEYUP:
+			{
+			    if (event.key.keysym.scancode == SDL_SCANCODE_BACKSPACE)
+				rewinding = false;
+			    const auto key = key_from_scancode(event.key.keysym.scancode);
+			    if (key >= 0)
+				keys &= ~(1 << key);
+			    break;
+			}
+		}
+	    }
+
+	    const float freq = 60.0f;
+	    const int period = static_cast<int>(1.0f / freq * 1000);
+
+	    if (rewinding) {
+		MachineState state;
+		if (history.rewind(state)) {
+		    // The snapshot's keys stay, the next frame's set_keyboard
+		    // applies the held ones the way a replay of the movie does
+		    restore(state);
+		    if (!movie_output.empty()) {
+			movie.keys.pop_back();
+			movie.display_hashes.pop_back();
+		    }
+		}
+		render_display();
+		if (video)
+		    video->push(display);
+		std::this_thread::sleep_for(std::chrono::milliseconds(period));
+		continue;
+	    }
+
+	    if (paused) {
+		print_registers();
+		render_display();
+		if (video)
+		    video->push(display);
+		std::this_thread::sleep_for(std::chrono::milliseconds(period));
+		continue;
+	    }
+
+	    if (netplay) {
+		while (auto packet = link->receive())
+		    netplay->receive(*packet, netplay_rom_hash);
+		// Wait for the other side rather than run too far ahead
+		if (netplay->can_advance())
+		    netplay->advance(keys);
+		link->send(netplay->packet(netplay_rom_hash));
+	    } else {
+		// Everything a frame depends on goes through set_keyboard and
+		// run_frame, so a movie of the keys replays it exactly
+		set_keyboard(keys);
+		run_frame(movie.instructions_per_frame);
+	    }
+	    print_registers();
+
+	    if (run_ahead_frames > 0)
+		run_ahead(run_ahead_frames, movie.instructions_per_frame, [&] { render_display(); });
+	    else
+		render_display();
+
+	    if (!movie_output.empty()) {
+		movie.keys.push_back(keys);
+		movie.display_hashes.push_back(display_hash());
+	    }
+	    if (!netplay)
+		history.push(snapshot());
+	    if (video)
+		video->push(display);
+
+	    std::this_thread::sleep_for(std::chrono::milliseconds(period));
+        }
+    }
+
+
+    void Chip8Runner::destroy()
+    {
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+
+	endwin();
+
+	if (!profile_output.empty()) {
+	    std::ofstream out(profile_output);
+	    profiler.write_report(out, symbols);
+	}
+	if (!stacks_output.empty()) {
+	    std::ofstream out(stacks_output);
+	    profiler.write_stacks(out, symbols);
+	}
+
+	if (!movie_output.empty()) {
+	    std::ofstream out(movie_output, std::ios::binary);
+	    movie.write(out);
+	}
+
+	if (video) {
+	    try {
+		video->finish();
+		if (video->dropped() > 0)
+		    std::cerr << video->dropped() << " of " << video->frames() << " video frames dropped, the encoder fell behind\n";
+	    } catch (const std::exception& e) {
+		std::cerr << "Could not record video: " << e.what() << '\n';
+	    }
+	    video.reset();
+	}
+    }
+
+    void Chip8Runner::set_movie_output(std::string filename, const std::vector<uint8_t>& rom)
+    {
+	movie_output = std::move(filename);
+	movie.rom_hash = Chip8::rom_hash(rom);
+    }
+
+    void Chip8Runner::set_video_output(const std::string& filename)
+    {
+	video = std::make_unique<VideoRecorder>(make_video_encoder(filename));
+    }
+
+    void Chip8Runner::set_profile_output(std::string report, std::string stacks)
+    {
+	profile_output = std::move(report);
+	stacks_output = std::move(stacks);
+	if (profile_output.empty() && stacks_output.empty())
+	    return;
+	// Sees every instruction ahead of whatever else observes the machine
+	profiler.set_next(get_observer());
+	set_observer(&profiler);
+    }
+
+    void Chip8Runner::start_netplay(uint16_t local_port, const std::string& host, uint16_t remote_port, const std::vector<uint8_t>& rom)
+    {
+	// Both sides need the same random numbers
+	netplay_rom_hash = rom_hash(rom);
+	movie.seed = netplay_rom_hash;
+	seed(movie.seed);
+	link = std::make_unique<NetplayLink>(local_port, host, remote_port);
+	netplay.emplace(*this, movie.instructions_per_frame);
+    }
+
+    void Chip8Runner::load_symbols(const std::string& filename)
+    {
+	std::ifstream in(filename);
+	if (!in)
+	    throw std::runtime_error("Could not open symbol file " + filename);
+	symbols = SymbolTable::read(in);
+    }
+
+
+    void Chip8Runner::render_display()
+    {
+	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+	SDL_RenderClear(renderer);
+        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+
+	// TODO: Don't hardcode width and height
+	for (int row=0; row<32; ++row) {
+	    for (int col=0; col<64; ++col) {
+		if (get_display(col, row)) {
+		    SDL_RenderDrawPoint(renderer, col, row);
+		}
+	    }
+	}
+        SDL_RenderPresent(renderer);
+    }
+
+
+    void Chip8Runner::render_symbol(uint8_t symbol) {
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+        SDL_RenderClear(renderer);
+
+        const std::unordered_map<char,std::array<uint8_t,5>> sprites = {
+            { 0x0, { 0xF0, 0x90, 0x90, 0x90, 0xF0 }},
+            { 0x1, { 0x20, 0x60, 0x20, 0x20, 0x70 }},
+            { 0x2, { 0xF0, 0x10, 0xF0, 0x80, 0xF0 }},
+            { 0x3, { 0xF0, 0x10, 0xF0, 0x10, 0xF0 }},
+            { 0x4, { 0x90, 0x90, 0xF0, 0x10, 0x10 }},
+            { 0x5, { 0xF0, 0x80, 0xF0, 0x10, 0xF0 }},
+            { 0x6, { 0xF0, 0x80, 0xF0, 0x90, 0xF0 }},
+            { 0x7, { 0xF0, 0x10, 0x20, 0x40, 0x40 }},
+            { 0x8, { 0xF0, 0x90, 0xF0, 0x90, 0xF0 }},
+            { 0x9, { 0xF0, 0x90, 0xF0, 0x10, 0xF0 }},
+            { 0xA, { 0xF0, 0x90, 0xF0, 0x90, 0x90 }},
+            { 0xB, { 0xE0, 0x90, 0xE0, 0x90, 0xE0 }},
+            { 0xC, { 0xF0, 0x80, 0x80, 0x80, 0xF0 }},
+            { 0xD, { 0xE0, 0x90, 0x90, 0x90, 0xE0 }},
+            { 0xE, { 0xF0, 0x80, 0xF0, 0x80, 0xF0 }},
+            { 0xF, { 0xF0, 0x80, 0xF0, 0x80, 0x80 }}};
+
+        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+	auto sprite = sprites.at(symbol);
+        for (int row=0; row<sprite.size(); ++row) {
+            auto cursor = 0x80;
+            const auto x = sprite[row];
+            for (int col=0; col<8; ++col) {
+                if ((cursor & x) == cursor)
+                    SDL_RenderDrawPoint(renderer, col, row);
+                cursor >>= 1;
+            }
+        }
+        SDL_RenderPresent(renderer);
+    }
+}
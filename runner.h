@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <SDL2/SDL.h>
+#include <ncurses.h>
+
+#include "chip8.h"
+#include "movie.h"
+#include "netplay.h"
+#include "profiler.h"
+#include "rewind.h"
+#include "symbols.h"
+#include "undo.h"
+#include "video.h"
+
+namespace Chip8 {
+
+    class Chip8Runner : public Chip8State {
+
+        public:
+            Chip8Runner();
+            void run();
+            void destroy();
+
+	    // Guest code profiling, the report and the collapsed call stacks
+	    // are written by destroy()
+	    void load_symbols(const std::string& filename);
+	    void set_profile_output(std::string report, std::string stacks="");
+	    // Records the session for Chip8Replay, written by destroy()
+	    void set_movie_output(std::string filename, const std::vector<uint8_t>& rom);
+	    // Records what the window shows on a background thread, finished
+	    // by destroy(). See make_video_encoder() for the formats.
+	    void set_video_output(const std::string& filename);
+	    void set_run_ahead(size_t frames) { run_ahead_frames = frames; }
+	    // Two players on two machines, over UDP. Rewinding and pausing are
+	    // off, they would desynchronize the machines.
+	    void start_netplay(uint16_t local_port, const std::string& host, uint16_t remote_port, const std::vector<uint8_t>& rom);
+
+
+        private:
+            SDL_Window* window = nullptr;
+            SDL_Renderer* renderer = nullptr;
+
+
+            const unsigned int window_width = 64;
+            const unsigned int window_height = 32;
+            const unsigned int window_scale = 16;
+            const unsigned int window_real_width = window_width * window_scale;
+            const unsigned int window_real_height = window_height * window_scale;
+
+            void render_symbol(uint8_t symbol);
+            void render_display();
+
+	    void print_registers();
+	    WINDOW* window_ = nullptr;
+
+	    SymbolTable symbols;
+	    Profiler profiler;
+	    std::string profile_output;
+	    std::string stacks_output;
+
+	    // Backspace runs the machine backwards while held
+	    RewindBuffer history;
+	    bool rewinding = false;
+
+	    // P pauses, then the arrow keys step single instructions back
+	    // and forth. Not while recording, the movie has whole frames only.
+	    UndoLog undo_log;
+	    bool paused = false;
+
+	    // Frames shown ahead of the machine, hides input lag built into games
+	    size_t run_ahead_frames = 0;
+
+	    std::unique_ptr<NetplayLink> link;
+	    std::optional<RollbackSession> netplay;
+	    uint32_t netplay_rom_hash = 0;
+
+	    uint16_t keys = 0;
+	    Movie movie;
+	    std::string movie_output;
+	    std::unique_ptr<VideoRecorder> video;
+    };
+
+}
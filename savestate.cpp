@@ -0,0 +1,168 @@
+#include "savestate.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "binary.h"
+
+namespace Chip8 {
+
+    uint32_t rom_hash(const std::vector<uint8_t>& rom)
+    {
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (const auto byte : rom)
+	    hash = (hash ^ byte) * 16777619u;
+	return hash;
+    }
+
+    namespace {
+	constexpr char magic[4] = {'C', '8', 'S', 'T'};
+	constexpr uint8_t version = 1;
+	constexpr uint8_t memory_is_delta = 0x01;
+
+	// Memory of a machine that just loaded rom
+	std::array<uint8_t,Chip8State::memory_size> initial_memory(const std::vector<uint8_t>& rom)
+	{
+	    Chip8State m;
+	    m.load_rom(rom);
+	    return m.snapshot().memory;
+	}
+
+	std::vector<uint8_t> save(const MachineState& state, const std::vector<uint8_t>* rom)
+	{
+	    std::vector<uint8_t> out(std::begin(magic), std::end(magic));
+	    out.reserve(512);
+	    out.push_back(version);
+	    out.push_back(rom ? memory_is_delta : 0);
+	    put<uint32_t>(out, rom ? rom_hash(*rom) : 0);
+
+	    put<uint16_t>(out, state.program_counter);
+	    put<uint16_t>(out, state.I_register);
+	    put<uint8_t>(out, state.stack_pointer);
+	    put<uint8_t>(out, state.delay_register);
+	    put<uint8_t>(out, state.sound_register);
+	    put<uint8_t>(out, state.waiting);
+	    uint16_t keys = 0;
+	    for (size_t i=0; i<state.keyboard.size(); ++i)
+		keys |= state.keyboard[i] << i;
+	    put<uint16_t>(out, keys);
+	    put<uint64_t>(out, state.rng.state);
+	    out.insert(out.end(), state.registers.begin(), state.registers.end());
+	    for (const auto addr : state.stack)
+		put<uint16_t>(out, addr);
+
+	    uint8_t rows[sizeof(state.display)];
+	    for (size_t row=0; row<state.display.size(); ++row) {
+		for (size_t i=0; i<8; ++i)
+		    rows[row*8 + i] = state.display[row] >> (56 - 8*i);
+	    }
+	    const uint8_t blank[sizeof(rows)] = {0};
+	    encode_delta(out, rows, blank, sizeof(rows));
+
+	    if (rom) {
+		const auto base = initial_memory(*rom);
+		encode_delta(out, state.memory.data(), base.data(), base.size());
+	    } else {
+		out.insert(out.end(), state.memory.begin(), state.memory.end());
+	    }
+	    return out;
+	}
+    }
+
+    std::vector<uint8_t> save_state(const MachineState& state)
+    {
+	return save(state, nullptr);
+    }
+
+    std::vector<uint8_t> save_state(const MachineState& state, const std::vector<uint8_t>& rom)
+    {
+	return save(state, &rom);
+    }
+
+    MachineState load_state(const std::vector<uint8_t>& data, const std::vector<uint8_t>& rom)
+    {
+	Reader in(data.data(), data.size(), "save state");
+	if (std::memcmp(in.take(sizeof(magic)), magic, sizeof(magic)) != 0)
+	    throw std::runtime_error("Not a save state");
+	if (in.get<uint8_t>() != version)
+	    throw std::runtime_error("Unsupported save state version");
+	const auto flags = in.get<uint8_t>();
+	const auto hash = in.get<uint32_t>();
+	if ((flags & memory_is_delta) && hash != rom_hash(rom))
+	    throw std::runtime_error("Save state belongs to a different rom");
+
+	MachineState state;
+	state.program_counter = in.get<uint16_t>();
+	state.I_register = in.get<uint16_t>();
+	state.stack_pointer = in.get<uint8_t>();
+	state.delay_register = in.get<uint8_t>();
+	state.sound_register = in.get<uint8_t>();
+	state.waiting = in.get<uint8_t>();
+	const auto keys = in.get<uint16_t>();
+	for (size_t i=0; i<state.keyboard.size(); ++i)
+	    state.keyboard[i] = (keys >> i) & 1;
+	state.rng.state = in.get<uint64_t>();
+	std::copy_n(in.take(state.registers.size()), state.registers.size(), state.registers.begin());
+	for (auto& addr : state.stack)
+	    addr = in.get<uint16_t>();
+
+	uint8_t rows[sizeof(state.display)] = {0};
+	in.skip(apply_delta(in.rest(), in.remaining(), rows, sizeof(rows)));
+	for (size_t row=0; row<state.display.size(); ++row) {
+	    state.display[row] = 0;
+	    for (size_t i=0; i<8; ++i)
+		state.display[row] |= static_cast<uint64_t>(rows[row*8 + i]) << (56 - 8*i);
+	}
+
+	if (flags & memory_is_delta) {
+	    state.memory = initial_memory(rom);
+	    in.skip(apply_delta(in.rest(), in.remaining(), state.memory.data(), state.memory.size()));
+	} else {
+	    std::copy_n(in.take(state.memory.size()), state.memory.size(), state.memory.begin());
+	}
+	state.rehash();
+	return state;
+    }
+
+
+    void encode_delta(std::vector<uint8_t>& out, const uint8_t* data, const uint8_t* base, size_t size)
+    {
+	size_t i = 0;
+	while (i < size) {
+	    const size_t equal_start = i;
+	    // Mostly equal, skip a word at a time
+	    while (i+8 <= size && std::memcmp(data+i, base+i, 8) == 0)
+		i += 8;
+	    while (i < size && data[i] == base[i])
+		++i;
+	    const size_t changed_start = i;
+	    while (i < size && data[i] != base[i])
+		++i;
+
+	    put_varint(out, changed_start - equal_start);
+	    put_varint(out, i - changed_start);
+	    for (size_t j=changed_start; j<i; ++j)
+		out.push_back(data[j] ^ base[j]);
+	}
+    }
+
+    size_t apply_delta(const uint8_t* in, size_t in_size, uint8_t* data, size_t size)
+    {
+	Reader reader(in, in_size, "delta");
+	size_t i = 0;
+	while (i < size) {
+	    const auto equal = reader.get_varint();
+	    const auto changed = reader.get_varint();
+	    if (equal > size - i || changed > size - i - equal)
+		throw std::runtime_error("Delta does not fit the data");
+	    i += equal;
+	    const auto* bytes = reader.take(changed);
+	    for (size_t j=0; j<changed; ++j)
+		data[i++] ^= bytes[j];
+	}
+	return in_size - reader.remaining();
+    }
+
+}
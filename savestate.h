@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "chip8.h"
+
+namespace Chip8 {
+
+    // Identifies the rom a save state or movie belongs to
+    uint32_t rom_hash(const std::vector<uint8_t>& rom);
+
+    // Versioned, little endian save states. Memory is stored as is, or,
+    // given the rom the machine was started with, as the difference to
+    // the freshly loaded rom, which is usually a few dozen bytes.
+    std::vector<uint8_t> save_state(const MachineState& state);
+    std::vector<uint8_t> save_state(const MachineState& state, const std::vector<uint8_t>& rom);
+    // Throws if data is not a save state, or was saved against another rom
+    MachineState load_state(const std::vector<uint8_t>& data, const std::vector<uint8_t>& rom={});
+
+    // Run length encoded data ^ base: varint counts of equal and changed
+    // bytes, each run of changed bytes followed by its xor.
+    void encode_delta(std::vector<uint8_t>& out, const uint8_t* data, const uint8_t* base, size_t size);
+    // Xors an encoded delta into data, returns the number of bytes read.
+    // Applying the same delta twice gives the original back.
+    size_t apply_delta(const uint8_t* in, size_t in_size, uint8_t* data, size_t size);
+
+}
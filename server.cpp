@@ -0,0 +1,527 @@
+#include "server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "binary.h"
+#include "chip8.h"
+
+namespace Chip8 {
+
+    namespace {
+	// A rom and its seed is the largest message a client sends
+	constexpr size_t max_payload = 8 + Chip8State::memory_size;
+
+	void pack_bits(std::vector<uint8_t>& out, const uint8_t* data, size_t size)
+	{
+	    size_t i = 0;
+	    while (i < size) {
+		size_t run = 1;
+		while (i + run < size && run < 128 && data[i + run] == data[i])
+		    run++;
+		if (run > 1) {
+		    out.push_back(257 - run);
+		    out.push_back(data[i]);
+		    i += run;
+		    continue;
+		}
+		// Literals up to the next run
+		const size_t start = i;
+		while (i < size && i - start < 128 && !(i + 1 < size && data[i] == data[i + 1]))
+		    i++;
+		out.push_back(i - start - 1);
+		out.insert(out.end(), data + start, data + i);
+	    }
+	}
+
+	void unpack_bits(Reader& reader, uint8_t* out, size_t size)
+	{
+	    size_t i = 0;
+	    while (i < size) {
+		const auto header = reader.get<uint8_t>();
+		if (header < 128) {
+		    const size_t n = header + 1;
+		    if (n > size - i)
+			throw std::runtime_error("Delta overruns the display");
+		    std::memcpy(out + i, reader.take(n), n);
+		    i += n;
+		} else if (header > 128) {
+		    const size_t n = 257 - header;
+		    if (n > size - i)
+			throw std::runtime_error("Delta overruns the display");
+		    std::memset(out + i, reader.get<uint8_t>(), n);
+		    i += n;
+		}
+	    }
+	}
+
+	// Size of the complete message at the front of data, 0 if some of
+	// it has not arrived yet
+	size_t message_size(const uint8_t* data, size_t size)
+	{
+	    uint64_t payload = 0;
+	    for (size_t i=1; i<size && i<6; ++i) {
+		payload |= static_cast<uint64_t>(data[i] & 0x7F) << (7*(i-1));
+		if (!(data[i] & 0x80)) {
+		    if (payload > max_payload)
+			throw std::runtime_error("Message too large");
+		    return size - i - 1 >= payload ? i + 1 + payload : 0;
+		}
+	    }
+	    if (size >= 6)
+		throw std::runtime_error("Malformed message size");
+	    return 0;
+	}
+
+	size_t payload_offset(const uint8_t* data)
+	{
+	    size_t i = 1;
+	    while (data[i] & 0x80)
+		i++;
+	    return i + 1;
+	}
+
+	std::vector<uint8_t> message(SessionMessage kind, const uint8_t* payload, size_t size)
+	{
+	    std::vector<uint8_t> out{static_cast<uint8_t>(kind)};
+	    put_varint(out, size);
+	    out.insert(out.end(), payload, payload + size);
+	    return out;
+	}
+
+	sockaddr_un socket_address(const std::string& path)
+	{
+	    sockaddr_un address{};
+	    address.sun_family = AF_UNIX;
+	    if (path.size() >= sizeof(address.sun_path))
+		throw std::runtime_error("Socket path too long: " + path);
+	    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+	    return address;
+	}
+
+	std::runtime_error system_error(const std::string& what)
+	{
+	    return std::runtime_error(what + ": " + std::strerror(errno));
+	}
+    }
+
+    std::vector<uint8_t> encode_delta(const Display& before, const Display& after)
+    {
+	uint32_t changed = 0;
+	uint64_t rows[32];
+	size_t count = 0;
+	for (size_t row=0; row<after.size(); ++row) {
+	    if (before[row] != after[row]) {
+		changed |= 1u << row;
+		rows[count++] = before[row] ^ after[row];
+	    }
+	}
+
+	std::vector<uint8_t> out;
+	put<uint32_t>(out, changed);
+	uint8_t bytes[sizeof(rows)];
+	for (size_t i=0; i<count*8; ++i)
+	    bytes[i] = rows[i / 8] >> (8 * (i % 8));
+	pack_bits(out, bytes, count*8);
+	return out;
+    }
+
+    void apply_delta(Display& display, const uint8_t* data, size_t size)
+    {
+	Reader reader(data, size, "display delta");
+	const auto changed = reader.get<uint32_t>();
+	const size_t count = __builtin_popcount(changed);
+	uint8_t bytes[32*8];
+	unpack_bits(reader, bytes, count*8);
+	if (reader.remaining() != 0)
+	    throw std::runtime_error("Trailing bytes after display delta");
+
+	size_t i = 0;
+	for (size_t row=0; row<display.size(); ++row) {
+	    if (!((changed >> row) & 1))
+		continue;
+	    uint64_t value = 0;
+	    for (size_t b=0; b<8; ++b)
+		value |= static_cast<uint64_t>(bytes[i*8 + b]) << (8*b);
+	    display[row] ^= value;
+	    i++;
+	}
+    }
+
+
+    struct SessionServer::Session {
+	int fd = -1;
+	Chip8State machine;
+	bool running = false;
+	bool closed = false;
+	uint32_t frame = 0;
+	// What the client was last sent
+	Display screen{0};
+	std::vector<uint8_t> inbox;
+	std::vector<uint8_t> outbox;
+	size_t outbox_start = 0;
+	bool want_write = false;
+
+	size_t queued() const { return outbox.size() - outbox_start; }
+    };
+
+    SessionServer::SessionServer(const std::string& path, ServerOptions options)
+	: path{path}, options{options}
+    {
+	const auto address = socket_address(path);
+	listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listener < 0)
+	    throw system_error("Could not create socket");
+	unlink(path.c_str());
+	if (bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+	    || listen(listener, SOMAXCONN) != 0) {
+	    const auto error = system_error("Could not listen on " + path);
+	    ::close(listener);
+	    throw error;
+	}
+
+	epoll = epoll_create1(EPOLL_CLOEXEC);
+	epoll_event event{};
+	event.events = EPOLLIN;
+	event.data.ptr = nullptr;
+	if (epoll < 0 || epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &event) != 0) {
+	    const auto error = system_error("Could not create epoll instance");
+	    ::close(listener);
+	    if (epoll >= 0)
+		::close(epoll);
+	    unlink(path.c_str());
+	    throw error;
+	}
+    }
+
+    SessionServer::~SessionServer()
+    {
+	for (auto& session : clients)
+	    if (!session->closed)
+		::close(session->fd);
+	::close(epoll);
+	::close(listener);
+	unlink(path.c_str());
+    }
+
+    void SessionServer::poll(int timeout_ms)
+    {
+	epoll_event events[256];
+	const int count = epoll_wait(epoll, events, 256, timeout_ms);
+	for (int i=0; i<count; ++i) {
+	    auto* session = static_cast<Session*>(events[i].data.ptr);
+	    if (!session) {
+		accept_clients();
+		continue;
+	    }
+	    if (session->closed)
+		continue;
+	    if (events[i].events & EPOLLOUT)
+		flush(*session);
+	    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		read(*session);
+	}
+	remove_closed();
+    }
+
+    void SessionServer::accept_clients()
+    {
+	while (true) {
+	    const int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	    if (fd < 0)
+		return;
+	    if (clients.size() >= options.max_sessions) {
+		const auto full = message(SessionMessage::error, reinterpret_cast<const uint8_t*>("Server full"), 11);
+		::send(fd, full.data(), full.size(), MSG_NOSIGNAL);
+		::close(fd);
+		continue;
+	    }
+
+	    std::unique_ptr<Session> session;
+	    if (pool.empty()) {
+		session = std::make_unique<Session>();
+	    } else {
+		session = std::move(pool.back());
+		pool.pop_back();
+		// Reused sessions start over from power on
+		static const MachineState power_on = Chip8State().snapshot();
+		session->machine.restore(power_on);
+		session->running = session->closed = session->want_write = false;
+		session->frame = 0;
+		session->screen = Display{0};
+		session->inbox.clear();
+		session->outbox.clear();
+		session->outbox_start = 0;
+	    }
+	    session->fd = fd;
+
+	    epoll_event event{};
+	    event.events = EPOLLIN;
+	    event.data.ptr = session.get();
+	    epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event);
+	    clients.push_back(std::move(session));
+	}
+    }
+
+    void SessionServer::read(Session& session)
+    {
+	// A bounded amount per wakeup, so a flood from one client does not
+	// hold up the others
+	uint8_t buffer[16 << 10];
+	const auto size = recv(session.fd, buffer, sizeof(buffer), 0);
+	if (size == 0 || (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+	    close(session);
+	    return;
+	}
+	if (size < 0)
+	    return;
+
+	session.inbox.insert(session.inbox.end(), buffer, buffer + size);
+	size_t pos = 0;
+	try {
+	    while (!session.closed) {
+		const auto* data = session.inbox.data() + pos;
+		const auto total = message_size(data, session.inbox.size() - pos);
+		if (total == 0)
+		    break;
+		const auto offset = payload_offset(data);
+		handle(session, static_cast<SessionMessage>(data[0]), data + offset, total - offset);
+		pos += total;
+	    }
+	} catch (const std::exception& e) {
+	    fail(session, e.what());
+	    return;
+	}
+	session.inbox.erase(session.inbox.begin(), session.inbox.begin() + pos);
+    }
+
+    void SessionServer::handle(Session& session, SessionMessage kind, const uint8_t* payload, size_t size)
+    {
+	Reader reader(payload, size, "message");
+	switch (kind) {
+	    case SessionMessage::rom: {
+		if (session.running)
+		    throw std::runtime_error("Session already has a rom");
+		const auto seed = reader.get<uint64_t>();
+		session.machine.seed(seed);
+		session.machine.load_rom(std::vector<uint8_t>(reader.rest(), reader.rest() + reader.remaining()));
+		session.running = true;
+		break;
+	    }
+	    case SessionMessage::keys:
+		session.machine.set_keyboard(reader.get<uint16_t>());
+		break;
+	    default:
+		throw std::runtime_error("Unexpected message from client");
+	}
+    }
+
+    void SessionServer::tick()
+    {
+	std::vector<uint8_t> payload;
+	for (auto& client : clients) {
+	    auto& session = *client;
+	    if (!session.running || session.closed)
+		continue;
+
+	    session.machine.run_frame(options.instructions_per_frame);
+	    session.frame++;
+
+	    const auto& screen = session.machine.snapshot().display;
+	    if (screen == session.screen || session.queued() > options.max_queued_bytes)
+		continue;
+	    payload.clear();
+	    put_varint(payload, session.frame);
+	    const auto delta = encode_delta(session.screen, screen);
+	    payload.insert(payload.end(), delta.begin(), delta.end());
+	    session.screen = screen;
+	    send(session, SessionMessage::frame, payload.data(), payload.size());
+	    frames++;
+	}
+	remove_closed();
+    }
+
+    void SessionServer::send(Session& session, SessionMessage kind, const uint8_t* payload, size_t size)
+    {
+	const auto bytes = message(kind, payload, size);
+	session.outbox.insert(session.outbox.end(), bytes.begin(), bytes.end());
+	sent += bytes.size();
+	if (!session.want_write)
+	    flush(session);
+    }
+
+    void SessionServer::flush(Session& session)
+    {
+	while (session.queued() > 0) {
+	    const auto size = ::send(session.fd, session.outbox.data() + session.outbox_start, session.queued(), MSG_NOSIGNAL);
+	    if (size < 0) {
+		if (errno == EINTR)
+		    continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+		    close(session);
+		break;
+	    }
+	    session.outbox_start += size;
+	}
+	if (session.closed)
+	    return;
+
+	const bool want_write = session.queued() > 0;
+	if (!want_write) {
+	    session.outbox.clear();
+	    session.outbox_start = 0;
+	}
+	if (want_write != session.want_write) {
+	    epoll_event event{};
+	    event.events = EPOLLIN | (want_write ? uint32_t(EPOLLOUT) : 0u);
+	    event.data.ptr = &session;
+	    epoll_ctl(epoll, EPOLL_CTL_MOD, session.fd, &event);
+	    session.want_write = want_write;
+	}
+    }
+
+    void SessionServer::fail(Session& session, const std::string& error)
+    {
+	const auto bytes = message(SessionMessage::error, reinterpret_cast<const uint8_t*>(error.data()), error.size());
+	::send(session.fd, bytes.data(), bytes.size(), MSG_NOSIGNAL);
+	close(session);
+    }
+
+    void SessionServer::close(Session& session)
+    {
+	if (session.closed)
+	    return;
+	session.closed = true;
+	have_closed = true;
+	epoll_ctl(epoll, EPOLL_CTL_DEL, session.fd, nullptr);
+	::close(session.fd);
+    }
+
+    void SessionServer::remove_closed()
+    {
+	if (!have_closed)
+	    return;
+	have_closed = false;
+	const auto open = std::partition(clients.begin(), clients.end(), [](const auto& session) { return !session->closed; });
+	std::move(open, clients.end(), std::back_inserter(pool));
+	clients.erase(open, clients.end());
+    }
+
+
+    SessionClient::SessionClient(const std::string& path)
+    {
+	const auto address = socket_address(path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	    throw system_error("Could not create socket");
+	if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+	    const auto error = system_error("Could not connect to " + path);
+	    ::close(fd);
+	    throw error;
+	}
+    }
+
+    SessionClient::~SessionClient()
+    {
+	::close(fd);
+    }
+
+    namespace {
+	void send_all(int fd, const std::vector<uint8_t>& bytes)
+	{
+	    size_t done = 0;
+	    while (done < bytes.size()) {
+		const auto size = ::send(fd, bytes.data() + done, bytes.size() - done, MSG_NOSIGNAL);
+		if (size < 0 && errno == EINTR)
+		    continue;
+		if (size < 0)
+		    throw system_error("Could not send to server");
+		done += size;
+	    }
+	}
+    }
+
+    void SessionClient::send_rom(const std::vector<uint8_t>& rom, uint64_t seed)
+    {
+	std::vector<uint8_t> payload;
+	put<uint64_t>(payload, seed);
+	payload.insert(payload.end(), rom.begin(), rom.end());
+	send_all(fd, message(SessionMessage::rom, payload.data(), payload.size()));
+    }
+
+    void SessionClient::send_keys(uint16_t keys)
+    {
+	std::vector<uint8_t> payload;
+	put<uint16_t>(payload, keys);
+	send_all(fd, message(SessionMessage::keys, payload.data(), payload.size()));
+    }
+
+    size_t SessionClient::apply_messages()
+    {
+	size_t pos = 0;
+	size_t count = 0;
+	while (true) {
+	    const auto* data = inbox.data() + pos;
+	    const auto total = message_size(data, inbox.size() - pos);
+	    if (total == 0)
+		break;
+	    const auto offset = payload_offset(data);
+	    const auto* payload = data + offset;
+	    const auto size = total - offset;
+	    if (static_cast<SessionMessage>(data[0]) == SessionMessage::error)
+		throw std::runtime_error("Server: " + std::string(payload, payload + size));
+	    if (static_cast<SessionMessage>(data[0]) != SessionMessage::frame)
+		throw std::runtime_error("Unexpected message from server");
+
+	    Reader reader(payload, size, "frame");
+	    last_frame = reader.get_varint();
+	    apply_delta(screen, reader.rest(), reader.remaining());
+	    pos += total;
+	    count++;
+	}
+	inbox.erase(inbox.begin(), inbox.begin() + pos);
+	return count;
+    }
+
+    size_t SessionClient::receive()
+    {
+	uint8_t buffer[16 << 10];
+	while (true) {
+	    const auto size = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+	    if (size == 0)
+		throw std::runtime_error("Server hung up");
+	    if (size < 0) {
+		if (errno == EINTR)
+		    continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		    break;
+		throw system_error("Could not read from server");
+	    }
+	    inbox.insert(inbox.end(), buffer, buffer + size);
+	}
+	return apply_messages();
+    }
+
+    void SessionClient::wait_frame()
+    {
+	uint8_t buffer[16 << 10];
+	while (apply_messages() == 0) {
+	    const auto size = recv(fd, buffer, sizeof(buffer), 0);
+	    if (size == 0)
+		throw std::runtime_error("Server hung up");
+	    if (size < 0 && errno != EINTR)
+		throw system_error("Could not read from server");
+	    if (size > 0)
+		inbox.insert(inbox.end(), buffer, buffer + size);
+	}
+    }
+
+}
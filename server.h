@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "machine.h"
+
+namespace Chip8 {
+
+    class Chip8State;
+
+    // How the display changed since the last frame a client got: a mask of
+    // the changed rows, then the XOR of each changed row with its old
+    // value, PackBits compressed. XORed rows are mostly zero bytes.
+    std::vector<uint8_t> encode_delta(const Display& before, const Display& after);
+    // Throws on malformed deltas
+    void apply_delta(Display& display, const uint8_t* data, size_t size);
+
+    // Every message is a kind byte, the payload size as a varint and the
+    // payload. Clients send a rom (seed as 8 bytes, then the rom) and
+    // then their keys (2 bytes) whenever they change. The server sends a
+    // frame (frame number as a varint, then a delta) only when the display
+    // changed, and an error (text) before it hangs up.
+    enum class SessionMessage : uint8_t { rom = 'R', keys = 'K', frame = 'F', error = 'E' };
+
+    struct ServerOptions {
+	uint32_t instructions_per_frame = 10;
+	size_t max_sessions = 4096;
+	// Output a client has not read yet. Past this its frames are held
+	// back, the next delta covers them all.
+	size_t max_queued_bytes = 16 << 10;
+    };
+
+    // Many sessions on one thread, over a Unix socket. Every session runs
+    // the same number of instructions per tick, however busy its client.
+    class SessionServer {
+	public:
+	    // Replaces a stale socket at path
+	    SessionServer(const std::string& path, ServerOptions options={});
+	    ~SessionServer();
+	    SessionServer(const SessionServer&) = delete;
+	    SessionServer& operator=(const SessionServer&) = delete;
+
+	    // Accepts clients, reads their messages and writes queued output,
+	    // waiting at most timeout_ms for something to happen
+	    void poll(int timeout_ms);
+	    // Runs one frame of every session that has a rom and sends the
+	    // changed displays
+	    void tick();
+
+	    size_t sessions() const { return clients.size(); }
+	    uint64_t bytes_sent() const { return sent; }
+	    uint64_t frames_sent() const { return frames; }
+
+	private:
+	    struct Session;
+
+	    void accept_clients();
+	    void read(Session& session);
+	    void handle(Session& session, SessionMessage kind, const uint8_t* payload, size_t size);
+	    void send(Session& session, SessionMessage kind, const uint8_t* payload, size_t size);
+	    void flush(Session& session);
+	    void close(Session& session);
+	    void fail(Session& session, const std::string& error);
+	    void remove_closed();
+
+	    std::string path;
+	    ServerOptions options;
+	    int listener = -1;
+	    int epoll = -1;
+	    // Closed sessions stay here until the end of a poll or tick, a
+	    // batch of events may still point at them
+	    std::vector<std::unique_ptr<Session>> clients;
+	    // Closed sessions, kept so their machines can be reused
+	    std::vector<std::unique_ptr<Session>> pool;
+	    bool have_closed = false;
+	    uint64_t sent = 0;
+	    uint64_t frames = 0;
+    };
+
+    // Blocking client side of a session, for tests and load generators
+    class SessionClient {
+	public:
+	    explicit SessionClient(const std::string& path);
+	    ~SessionClient();
+	    SessionClient(const SessionClient&) = delete;
+	    SessionClient& operator=(const SessionClient&) = delete;
+
+	    void send_rom(const std::vector<uint8_t>& rom, uint64_t seed=0);
+	    void send_keys(uint16_t keys);
+
+	    // Applies every frame that arrived, without waiting. Returns the
+	    // number of frames. Throws if the server sent an error or hung up.
+	    size_t receive();
+	    // Waits for the next frame and applies it
+	    void wait_frame();
+
+	    const Display& display() const { return screen; }
+	    // Number of the frame the display is from, 0 before the first
+	    uint32_t frame() const { return last_frame; }
+
+	private:
+	    // Applies the complete messages in inbox, returns the frames among them
+	    size_t apply_messages();
+
+	    int fd = -1;
+	    std::vector<uint8_t> inbox;
+	    Display screen{0};
+	    uint32_t last_frame = 0;
+    };
+
+}
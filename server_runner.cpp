@@ -0,0 +1,90 @@
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <string>
+
+#include "server.h"
+
+using namespace Chip8;
+
+namespace {
+    volatile std::sig_atomic_t stop = 0;
+
+    void request_stop(int)
+    {
+	stop = 1;
+    }
+}
+
+// Hosts sessions for clients on a Unix socket until interrupted. Every
+// session runs one frame per tick, at hz ticks per second.
+int main(int argc, char** argv)
+{
+    ServerOptions options;
+    double hz = 60;
+    double report_every = 10;
+    bool usage = argc < 2;
+    try {
+	for (int i=2; i<argc && !usage; ++i) {
+	    const std::string arg = argv[i];
+	    if (i+1 >= argc)
+		usage = true;
+	    else if (arg == "--ipf")
+		options.instructions_per_frame = std::stoul(argv[++i]);
+	    else if (arg == "--hz")
+		hz = std::stod(argv[++i]);
+	    else if (arg == "--max-sessions")
+		options.max_sessions = std::stoul(argv[++i]);
+	    else if (arg == "--report")
+		report_every = std::stod(argv[++i]);
+	    else
+		usage = true;
+	}
+    } catch (const std::exception& e) {
+	std::cerr << "Bad argument: " << e.what() << '\n';
+	return 1;
+    }
+    if (usage || hz <= 0) {
+	std::cerr << "Usage: " << argv[0] << " <socket> [--ipf n] [--hz n] [--max-sessions n] [--report seconds]\n";
+	return 1;
+    }
+
+    try {
+	SessionServer server(argv[1], options);
+	std::signal(SIGINT, request_stop);
+	std::signal(SIGTERM, request_stop);
+
+	using clock = std::chrono::steady_clock;
+	const auto period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1 / hz));
+	auto next_tick = clock::now() + period;
+	auto next_report = clock::now();
+	uint64_t ticks = 0;
+	std::chrono::duration<double> busy{0};
+	while (!stop) {
+	    const auto now = clock::now();
+	    if (now < next_tick) {
+		const auto wait = std::chrono::ceil<std::chrono::milliseconds>(next_tick - now);
+		server.poll(wait.count());
+		continue;
+	    }
+
+	    server.tick();
+	    ticks++;
+	    busy += clock::now() - now;
+	    // Never more than one tick to catch up, a slow box runs slow
+	    next_tick = std::max(next_tick + period, now);
+
+	    if (report_every > 0 && now >= next_report) {
+		std::cerr << server.sessions() << " sessions, " << ticks << " ticks, "
+			  << server.frames_sent() << " frames and " << server.bytes_sent() << " bytes sent, "
+			  << (ticks ? busy.count() / ticks * 1e6 : 0) << "us per tick\n";
+		next_report = now + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(report_every));
+	    }
+	}
+    } catch (const std::exception& e) {
+	std::cerr << e.what() << '\n';
+	return 1;
+    }
+    return 0;
+}
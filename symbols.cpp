@@ -0,0 +1,201 @@
+#include "symbols.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+#include "decode.h"
+
+namespace Chip8 {
+
+    static constexpr const char* symbols_magic = "chip8-symbols";
+    static constexpr int symbols_version = 1;
+
+    void SymbolTable::add_line(uint16_t addr, uint32_t line)
+    {
+	if (!lines.empty() && lines.back().addr >= addr)
+	    throw std::runtime_error("Symbol lines must be added in address order");
+	lines.push_back({addr, line});
+    }
+
+    void SymbolTable::add_label(std::string name, uint16_t start, uint16_t end)
+    {
+	labels.push_back({std::move(name), start, end});
+    }
+
+    uint32_t SymbolTable::line_at(uint16_t addr) const
+    {
+	auto it = std::upper_bound(lines.begin(), lines.end(), addr,
+		[](uint16_t a, const Line& l) { return a < l.addr; });
+	if (it == lines.begin())
+	    return 0;
+	--it;
+	// Both bytes of an instruction belong to its line
+	return (addr - it->addr < 2) ? it->line : 0;
+    }
+
+    const SymbolTable::Label* SymbolTable::label_at(uint16_t addr) const
+    {
+	// Innermost (latest starting) label wins if they overlap
+	const Label* result = nullptr;
+	for (const auto& label : labels) {
+	    if (addr >= label.start && addr < label.end)
+		if (!result || label.start >= result->start)
+		    result = &label;
+	}
+	return result;
+    }
+
+    void SymbolTable::write(std::ostream& out) const
+    {
+	out << symbols_magic << ' ' << symbols_version << '\n';
+	if (!source.empty())
+	    out << "file " << source << '\n';
+
+	// Runs of consecutive instructions on consecutive lines are
+	// written as one entry: lines <addr> <line> <count>
+	out << std::hex;
+	size_t i = 0;
+	while (i < lines.size()) {
+	    size_t count = 1;
+	    while (i+count < lines.size()
+		    && lines[i+count].addr == lines[i].addr + 2*count
+		    && lines[i+count].line == lines[i].line + count)
+		++count;
+	    out << "lines " << lines[i].addr << ' ' << std::dec << lines[i].line << ' ' << count << std::hex << '\n';
+	    i += count;
+	}
+
+	for (const auto& label : labels)
+	    out << "label " << label.name << ' ' << label.start << ' ' << label.end << '\n';
+	out << std::dec;
+    }
+
+    SymbolTable SymbolTable::read(std::istream& in)
+    {
+	SymbolTable table;
+
+	std::string magic;
+	int version = 0;
+	in >> magic >> version;
+	if (magic != symbols_magic || version != symbols_version)
+	    throw std::runtime_error("Not a symbol file");
+
+	std::string line;
+	while (std::getline(in, line)) {
+	    std::istringstream ss(line);
+	    std::string kind;
+	    if (!(ss >> kind))
+		continue;
+
+	    if (kind == "file") {
+		ss >> std::ws;
+		std::getline(ss, table.source);
+	    } else if (kind == "lines") {
+		unsigned int addr, first, count;
+		if (!(ss >> std::hex >> addr >> std::dec >> first >> count))
+		    throw std::runtime_error("Malformed symbol line entry");
+		for (unsigned int n=0; n<count; ++n)
+		    table.add_line(addr + 2*n, first + n);
+	    } else if (kind == "label") {
+		std::string name;
+		unsigned int start, end;
+		if (!(ss >> name >> std::hex >> start >> end))
+		    throw std::runtime_error("Malformed symbol label entry");
+		table.add_label(name, start, end);
+	    } else {
+		throw std::runtime_error("Unknown symbol entry " + kind);
+	    }
+	}
+
+	return table;
+    }
+
+
+    unsigned int instruction_cycles(uint16_t instruction)
+    {
+	const uint8_t x = (instruction & 0x0F00) >> 8;
+
+	switch (decode(instruction)) {
+	    case Opcode::CLS:
+		return 32;
+	    case Opcode::DRW:
+		return 1 + (instruction & 0x000F);
+	    case Opcode::LDBVx:
+		return 3;
+	    case Opcode::LDIVx:
+	    case Opcode::LDVxI:
+		return 1 + x + 1;
+	    default:
+		return 1;
+	}
+    }
+
+    void ExecutionCounts::add(uint16_t addr, uint16_t instruction)
+    {
+	addr &= 0xFFF;
+	instructions[addr]++;
+	cycles[addr] += instruction_cycles(instruction);
+    }
+
+
+    namespace {
+	struct Totals {
+	    uint64_t instructions = 0;
+	    uint64_t cycles = 0;
+	};
+
+	template<typename Key>
+	void write_sorted(std::ostream& out, const std::map<Key,Totals>& totals, const std::string& prefix)
+	{
+	    std::vector<std::pair<Key,Totals>> sorted(totals.begin(), totals.end());
+	    std::stable_sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+		return a.second.cycles > b.second.cycles;
+	    });
+
+	    for (const auto& [key, total] : sorted)
+		out << std::setw(12) << total.instructions << ' ' << std::setw(12) << total.cycles << "  " << prefix << key << '\n';
+	}
+    }
+
+    void write_profile(std::ostream& out, const ExecutionCounts& counts, const SymbolTable& symbols)
+    {
+	std::map<uint32_t,Totals> by_line;
+	std::map<std::string,Totals> by_label;
+	std::map<std::string,Totals> unmapped;
+
+	for (size_t addr=0; addr<counts.instructions.size(); ++addr) {
+	    if (counts.instructions[addr] == 0)
+		continue;
+	    const Totals here{counts.instructions[addr], counts.cycles[addr]};
+
+	    if (const auto line = symbols.line_at(addr); line != 0) {
+		by_line[line].instructions += here.instructions;
+		by_line[line].cycles += here.cycles;
+	    } else {
+		std::stringstream ss;
+		ss << "0x" << std::hex << std::setfill('0') << std::setw(3) << addr;
+		unmapped[ss.str()] = here;
+	    }
+
+	    if (const auto* label = symbols.label_at(addr)) {
+		by_label[label->name].instructions += here.instructions;
+		by_label[label->name].cycles += here.cycles;
+	    }
+	}
+
+	const auto source = symbols.get_source().empty() ? std::string("line ") : symbols.get_source() + ":";
+
+	out << "# instructions cycles source line\n";
+	write_sorted(out, by_line, source);
+	out << "# instructions cycles label\n";
+	write_sorted(out, by_label, "");
+	if (!unmapped.empty()) {
+	    out << "# instructions cycles address (no symbols)\n";
+	    write_sorted(out, unmapped, "");
+	}
+    }
+}
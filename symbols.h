@@ -0,0 +1,68 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace Chip8 {
+
+    // Mapping from program addresses back to the assembly source, written
+    // next to the rom by Chip8Assembler (-g) and read by the emulator.
+    class SymbolTable {
+	public:
+	    struct Line {
+		uint16_t addr;
+		uint32_t line;
+	    };
+
+	    // [start, end) of the code following a label
+	    struct Label {
+		std::string name;
+		uint16_t start;
+		uint16_t end;
+	    };
+
+	    void set_source(std::string filename) { source = std::move(filename); }
+	    const std::string& get_source() const { return source; }
+
+	    // Must be added in increasing address order
+	    void add_line(uint16_t addr, uint32_t line);
+	    void add_label(std::string name, uint16_t start, uint16_t end);
+
+	    // 0 if the address does not belong to any source line
+	    uint32_t line_at(uint16_t addr) const;
+	    // nullptr if no label covers the address
+	    const Label* label_at(uint16_t addr) const;
+
+	    const std::vector<Line>& get_lines() const { return lines; }
+	    const std::vector<Label>& get_labels() const { return labels; }
+
+	    void write(std::ostream& out) const;
+	    static SymbolTable read(std::istream& in);
+
+	private:
+	    std::string source;
+	    std::vector<Line> lines;
+	    std::vector<Label> labels;
+    };
+
+
+    // Per address execution counts, collected by the run loop
+    struct ExecutionCounts {
+	std::array<uint64_t,0x1000> instructions{0};
+	std::array<uint64_t,0x1000> cycles{0};
+
+	void add(uint16_t addr, uint16_t instruction);
+    };
+
+    // Rough relative cost of an instruction. Everything costs one, except
+    // the instructions that loop over memory or the display.
+    unsigned int instruction_cycles(uint16_t instruction);
+
+    // Writes counts aggregated per source line and per label, hottest first.
+    // Addresses without symbols are reported raw.
+    void write_profile(std::ostream& out, const ExecutionCounts& counts, const SymbolTable& symbols);
+
+}
@@ -1,11 +1,32 @@
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iomanip>
 #include <ios>
 #include <iostream>
+#include <memory>
 #include <random>
 
 #include <catch2/catch.hpp>
 
 #include "chip8.h"
+#include "corpus.h"
+#include "coverage.h"
+#include "disassembly.h"
+#include "env.h"
+#include "explorer.h"
+#include "golden.h"
+#include "lockstep.h"
+#include "netplay.h"
+#include "movie.h"
+#include "parallel.h"
+#include "profiler.h"
+#include "rewind.h"
+#include "savestate.h"
+#include "server.h"
+#include "trace.h"
+#include "traceindex.h"
+#include "video.h"
 
 using namespace Chip8;
 
@@ -1270,3 +1291,2003 @@ TEST_CASE ("Missing test")
 
 
 
+
+SCENARIO("Assembling a program with symbols")
+{
+    GIVEN ("A source with labels, comments and blank lines")
+    {
+	std::istringstream source(
+		"# Counts forever\n"
+		"\n"
+		"LD V0, 0\n"
+		":LOOP:\n"
+		"ADD V0, 1\n"
+		"JP :LOOP:\n"
+		":END: # never reached\n"
+		"CLS\n");
+	const auto program = assemble_program(source, "count.asm");
+
+	THEN ("The rom is big endian, starting at 0x200")
+	{
+	    CHECK( program.bytes == std::vector<uint8_t>{0x60, 0x00, 0x70, 0x01, 0x12, 0x02, 0x00, 0xE0} );
+	}
+
+	THEN ("Each instruction maps back to its source line")
+	{
+	    CHECK( program.symbols.line_at(0x200) == 3 );
+	    CHECK( program.symbols.line_at(0x201) == 3 );
+	    CHECK( program.symbols.line_at(0x202) == 5 );
+	    CHECK( program.symbols.line_at(0x204) == 6 );
+	    CHECK( program.symbols.line_at(0x206) == 8 );
+	    CHECK( program.symbols.line_at(0x208) == 0 );
+	}
+
+	THEN ("Labels cover the code up to the next label")
+	{
+	    REQUIRE( program.symbols.label_at(0x204) != nullptr );
+	    CHECK( program.symbols.label_at(0x204)->name == "LOOP" );
+	    CHECK( program.symbols.label_at(0x204)->end == 0x206 );
+	    CHECK( program.symbols.label_at(0x206)->name == "END" );
+	    CHECK( program.symbols.label_at(0x200) == nullptr );
+	}
+
+	AND_WHEN ("The symbols are written and read back")
+	{
+	    std::stringstream file;
+	    program.symbols.write(file);
+	    const auto symbols = SymbolTable::read(file);
+
+	    THEN ("Nothing is lost")
+	    {
+		CHECK( symbols.get_source() == "count.asm" );
+		CHECK( symbols.get_lines().size() == 4 );
+		CHECK( symbols.line_at(0x204) == 6 );
+		CHECK( symbols.get_labels().size() == 2 );
+		CHECK( symbols.label_at(0x202)->name == "LOOP" );
+	    }
+
+	    THEN ("Execution counts aggregate per line and label")
+	    {
+		ExecutionCounts counts;
+		counts.add(0x202, 0x7001);
+		counts.add(0x204, 0x1202);
+		counts.add(0x202, 0x7001);
+
+		std::stringstream report;
+		write_profile(report, counts, symbols);
+		CHECK( report.str().find("count.asm:5") != std::string::npos );
+		CHECK( report.str().find("           3            3  LOOP") != std::string::npos );
+	    }
+	}
+    }
+}
+
+SCENARIO("Recursive disassembly")
+{
+    GIVEN ("A rom with a subroutine, a skip and an odd sized sprite after the code")
+    {
+	std::istringstream source(
+		"LD I, :SPRITE:\n"
+		"CALL :DRAW:\n"
+		":WAIT:\n"
+		"SE V0, 1\n"
+		"JP :WAIT:\n"
+		"CLS\n"
+		":DRAW:\n"
+		"DRW V0, V1, 3\n"
+		"RET\n"
+		":SPRITE:\n"
+		"DB 24, 60, 126\n"
+		"DB 1, 2\n");
+	const auto rom = assemble_program(source).bytes;
+	REQUIRE( rom.size() == 19 );
+
+	const auto disassembly = analyse(rom);
+
+	THEN ("Everything reachable is code, and the sprite drawn from I is data")
+	{
+	    CHECK( disassembly.is_code(0x200) );
+	    CHECK( disassembly.kind_at(0x201) == ByteKind::Operand );
+	    CHECK( disassembly.is_code(0x20A) );
+	    CHECK( disassembly.is_code(0x20C) );
+	    CHECK( disassembly.kind_at(0x20E) == ByteKind::Sprite );
+	    CHECK( disassembly.kind_at(0x210) == ByteKind::Sprite );
+	    CHECK( disassembly.kind_at(0x211) == ByteKind::Data );
+	    CHECK( disassembly.code_bytes() == 14 );
+	}
+
+	THEN ("Jump, call and LD I targets are labelled")
+	{
+	    CHECK( disassembly.has_label(0x204) );
+	    CHECK( disassembly.has_label(0x20A) );
+	    CHECK( disassembly.has_label(0x20E) );
+	    CHECK( !disassembly.has_label(0x206) );
+	}
+
+	THEN ("The generated source assembles back to the same rom")
+	{
+	    std::stringstream generated;
+	    write_source(generated, rom, disassembly);
+	    CHECK( assemble_program(generated).bytes == rom );
+	}
+    }
+
+    GIVEN ("Words that do not assemble back to themselves")
+    {
+	THEN ("They are not canonical")
+	{
+	    CHECK( is_canonical(0x5120) );
+	    CHECK( !is_canonical(0x5121) );
+	    CHECK( !is_canonical(0x800F) );
+	    CHECK( !is_canonical(0xE000) );
+	    CHECK( !is_canonical(0xF0FF) );
+	    CHECK( is_canonical(0xF065) );
+	}
+    }
+}
+
+TEST_CASE ("Decode table", "[decode]")
+{
+    SECTION ("Every word either decodes, or disassembles to nothing") {
+	char buffer[32];
+	size_t valid = 0;
+	for (uint32_t i=0; i<0x10000; ++i) {
+	    const auto instruction = static_cast<Instruction>(i);
+	    const auto length = disassemble(instruction, buffer, sizeof(buffer));
+	    if (decode(instruction) == Opcode::Invalid) {
+		CHECK( length == 0 );
+		continue;
+	    }
+	    ++valid;
+	    REQUIRE( length > 0 );
+	    CHECK( assemble(std::string_view(buffer, length)) == instruction );
+	}
+	CHECK( valid == 48048 );
+    }
+
+    SECTION ("A buffer that is too small gives nothing") {
+	char buffer[4];
+	CHECK( disassemble(0xD34A, buffer, sizeof(buffer)) == 0 );
+	CHECK( disassemble(0x00E0, buffer, sizeof(buffer)) == 3 );
+    }
+
+    SECTION ("Names are found by their unique name") {
+	CHECK( find_opcode("LDVxI") == Opcode::LDVxI );
+	CHECK( find_opcode("LD") == Opcode::Invalid );
+    }
+}
+
+SCENARIO("Corpus statistics")
+{
+    GIVEN ("A rom with a SYS call and trailing data")
+    {
+	const std::vector<uint8_t> rom = {0x01, 0x23, 0x00, 0xE0, 0x12, 0x02, 0xAA, 0xBB, 0xCC};
+	const auto stats = collect_stats("test.ch8", rom);
+
+	THEN ("Only reachable instructions are counted")
+	{
+	    CHECK( stats.size == 9 );
+	    CHECK( stats.code_bytes == 6 );
+	    CHECK( stats.data_bytes == 3 );
+	    CHECK( stats.sys_calls == 1 );
+	    CHECK( stats.schip_instructions == 0 );
+	    CHECK( stats.opcodes[static_cast<size_t>(Opcode::CLS)] == 1 );
+	    CHECK( stats.opcodes[static_cast<size_t>(Opcode::JPaddr)] == 1 );
+	    CHECK( stats.opcodes[static_cast<size_t>(Opcode::Invalid)] == 0 );
+	}
+
+	THEN ("Totals add up over roms")
+	{
+	    CorpusStats a, b;
+	    a.add(stats);
+	    b.add(stats);
+	    b.add(collect_stats("schip.ch8", {0x00, 0xFF, 0x00, 0xEE}));
+	    a.merge(b);
+	    CHECK( a.roms == 3 );
+	    CHECK( a.min_size == 4 );
+	    CHECK( a.max_size == 9 );
+	    CHECK( a.roms_with_sys == 2 );
+	    CHECK( a.roms_with_schip == 1 );
+	    CHECK( a.size_histogram[0] == 3 );
+	}
+    }
+
+    GIVEN ("A tar archive")
+    {
+	std::string archive(512*4, '\0');
+	const std::string name = "roms/pong.ch8";
+	std::copy(name.begin(), name.end(), archive.begin());
+	const std::string size = "00000000003";
+	std::copy(size.begin(), size.end(), archive.begin() + 124);
+	archive[156] = '0';
+	archive[512] = 'a';
+	archive[513] = 'b';
+	archive[514] = 'c';
+
+	std::istringstream in(archive);
+	const auto entries = read_tar(in);
+
+	THEN ("Every regular file is a rom")
+	{
+	    REQUIRE( entries.size() == 1 );
+	    CHECK( entries[0].name == name );
+	    CHECK( entries[0].load() == std::vector<uint8_t>{'a', 'b', 'c'} );
+	}
+    }
+}
+
+TEST_CASE ("Parallel for visits every index once", "[parallel]")
+{
+    std::vector<int> visited(1000, 0);
+    parallel_for(visited.size(), [&](size_t i) { visited[i]++; }, 4);
+    CHECK( std::count(visited.begin(), visited.end(), 1) == 1000 );
+}
+
+SCENARIO("Running a rom without IO")
+{
+    GIVEN ("A loaded rom")
+    {
+	Chip8State m;
+	// LD V0, 5; ADD V0, 1; JP 0x202
+	m.load_rom({0x60, 0x05, 0x70, 0x01, 0x12, 0x02});
+	m.set_delay_register(3);
+
+	WHEN ("One frame of 5 instructions is run")
+	{
+	    m.run_frame(5);
+
+	    THEN ("The instructions are executed and the timers tick once")
+	    {
+		CHECK( m.get_register(0) == 7 );
+		CHECK( m.get_program_counter() == 0x202 );
+		CHECK( m.get_delay_register() == 2 );
+	    }
+	}
+    }
+
+    GIVEN ("A rom that is too large")
+    {
+	Chip8State m;
+	CHECK_THROWS( m.load_rom(std::vector<uint8_t>(Chip8State::memory_size - Chip8State::program_start + 1)) );
+    }
+
+    GIVEN ("A rom file that fills memory exactly")
+    {
+	const auto filename = (std::filesystem::temp_directory_path() / "chip8_test_full.rom").string();
+	{
+	    std::ofstream out(filename, std::ios::binary);
+	    out << std::string(Chip8State::memory_size - Chip8State::program_start, '\xAB');
+	}
+	Chip8State m;
+	m.load_file(filename);
+
+	THEN ("It is loaded without touching anything past memory")
+	{
+	    CHECK( m.get_memory(0xFFF) == 0xAB );
+	    CHECK( m.get_display_row(0) == 0 );
+	    CHECK_THROWS_AS( m.load_file(filename + ".missing"), std::runtime_error );
+	}
+	std::filesystem::remove(filename);
+    }
+}
+
+SCENARIO("Save states")
+{
+    GIVEN ("A machine that ran for a while")
+    {
+	const std::vector<uint8_t> rom = {
+	    0x60, 0x05, // LD V0, 5
+	    0xC1, 0xFF, // RND V1, 0xFF
+	    0xA0, 0x00, // LD I, 0x000
+	    0xD0, 0x15, // DRW V0, V1, 5
+	    0xF2, 0x33, // LD B, V2
+	    0x12, 0x02  // JP 0x202
+	};
+	Chip8State m;
+	m.seed(7);
+	m.load_rom(rom);
+	m.set_key(0x3, true);
+	m.set_I_register(0x400);
+	m.run_frame(13);
+
+	const auto same = [](const MachineState& a, const MachineState& b) {
+	    return std::memcmp(&a, &b, sizeof(MachineState)) == 0;
+	};
+
+	THEN ("A snapshot restores the exact machine")
+	{
+	    const auto snapshot = m.snapshot();
+	    Chip8State other;
+	    other.restore(snapshot);
+	    m.run_frame(10);
+	    other.run_frame(10);
+	    CHECK( same(m.snapshot(), other.snapshot()) );
+	}
+
+	THEN ("Both formats load back to the same machine")
+	{
+	    const auto plain = save_state(m.snapshot());
+	    const auto delta = save_state(m.snapshot(), rom);
+	    CHECK( same(load_state(plain), m.snapshot()) );
+	    CHECK( same(load_state(delta, rom), m.snapshot()) );
+	    CHECK( delta.size() < 200 );
+	}
+
+	THEN ("Broken or mismatched states are rejected")
+	{
+	    auto delta = save_state(m.snapshot(), rom);
+	    CHECK_THROWS( load_state(delta, {0x12, 0x00}) );
+	    delta.resize(delta.size() - 1);
+	    CHECK_THROWS( load_state(delta, rom) );
+	    CHECK_THROWS( load_state({'n', 'o', 'p', 'e'}) );
+	}
+    }
+}
+
+SCENARIO("Rewinding")
+{
+    GIVEN ("A machine that records every frame")
+    {
+	// Draws a random sprite at a moving position, forever
+	const std::vector<uint8_t> rom = {
+	    0xC2, 0xFF, // RND V2, 0xFF
+	    0xA3, 0x00, // LD I, 0x300
+	    0xF2, 0x33, // LD B, V2
+	    0x70, 0x03, // ADD V0, 3
+	    0x71, 0x01, // ADD V1, 1
+	    0xD0, 0x13, // DRW V0, V1, 3
+	    0x12, 0x00  // JP 0x200
+	};
+	Chip8State m;
+	m.seed(3);
+	m.load_rom(rom);
+
+	const auto same = [](const MachineState& a, const MachineState& b) {
+	    return std::memcmp(&a, &b, sizeof(MachineState)) == 0;
+	};
+
+	AND_GIVEN ("Room for every frame")
+	{
+	    RewindBuffer history(1<<20, 16);
+	    std::vector<MachineState> frames;
+	    for (int i=0; i<100; ++i) {
+		m.run_frame(7);
+		frames.push_back(m.snapshot());
+		history.push(m.snapshot());
+	    }
+
+	    THEN ("Every frame comes back in reverse order")
+	    {
+		MachineState state;
+		for (int i=98; i>=0; --i) {
+		    REQUIRE( history.rewind(state) );
+		    CHECK( same(state, frames[i]) );
+		}
+		CHECK_FALSE( history.rewind(state) );
+	    }
+
+	    THEN ("Recording continues from a rewound frame")
+	    {
+		MachineState state;
+		for (int i=0; i<20; ++i)
+		    history.rewind(state);
+		m.restore(state);
+		m.run_frame(7);
+		history.push(m.snapshot());
+		REQUIRE( history.rewind(state) );
+		CHECK( same(state, frames[79]) );
+	    }
+	}
+
+	AND_GIVEN ("A buffer too small for the whole run")
+	{
+	    RewindBuffer history(4*sizeof(MachineState), 8);
+	    std::vector<MachineState> frames;
+	    for (int i=0; i<2000; ++i) {
+		m.run_frame(7);
+		frames.push_back(m.snapshot());
+		history.push(m.snapshot());
+	    }
+
+	    THEN ("The oldest frames are dropped and the rest stay exact")
+	    {
+		CHECK( history.bytes_used() <= history.capacity() );
+		const auto kept = history.frames();
+		CHECK( kept < frames.size() );
+		CHECK( kept > 8 );
+
+		MachineState state;
+		for (size_t i=1; i<kept; ++i) {
+		    REQUIRE( history.rewind(state) );
+		    CHECK( same(state, frames[frames.size()-1-i]) );
+		}
+	    }
+	}
+    }
+}
+
+SCENARIO("Recording and replaying input")
+{
+    GIVEN ("A session where the keys move a sprite")
+    {
+	const std::vector<uint8_t> rom = {
+	    0x6A, 0x05, // LD VA, 5
+	    0xEA, 0xA1, // SKNP VA
+	    0x70, 0x01, // ADD V0, 1
+	    0xC1, 0x07, // RND V1, 7
+	    0xA0, 0x00, // LD I, 0x000
+	    0xD0, 0x15, // DRW V0, V1, 5
+	    0x12, 0x02  // JP 0x202
+	};
+
+	Movie movie;
+	movie.seed = 11;
+	movie.instructions_per_frame = 4;
+	movie.rom_hash = rom_hash(rom);
+
+	// What Chip8Runner does every frame
+	Chip8State m;
+	m.seed(movie.seed);
+	m.load_rom(rom);
+	std::mt19937 mt(5);
+	for (int frame=0; frame<600; ++frame) {
+	    const uint16_t keys = (mt() % 4 == 0) ? 1 << 5 : 0;
+	    m.set_keyboard(keys);
+	    m.run_frame(movie.instructions_per_frame);
+	    movie.keys.push_back(keys);
+	    movie.display_hashes.push_back(m.display_hash());
+	}
+
+	std::stringstream file;
+	movie.write(file);
+	const auto loaded = Movie::read(file);
+
+	THEN ("The movie survives a round trip")
+	{
+	    CHECK( loaded.seed == movie.seed );
+	    CHECK( loaded.instructions_per_frame == movie.instructions_per_frame );
+	    CHECK( loaded.keys == movie.keys );
+	    CHECK( loaded.display_hashes == movie.display_hashes );
+	}
+
+	THEN ("Replaying it gives the same displays")
+	{
+	    Chip8State other;
+	    other.seed(99);
+	    const auto result = replay(loaded, rom, other);
+	    CHECK( result.frames == 600 );
+	    CHECK_FALSE( result.mismatch );
+	    CHECK( other.display_hash() == m.display_hash() );
+	}
+
+	THEN ("A different input is caught")
+	{
+	    auto changed = loaded;
+	    changed.keys[300] ^= 1 << 5;
+	    Chip8State other;
+	    const auto result = replay(changed, rom, other);
+	    REQUIRE( result.mismatch );
+	    CHECK( *result.mismatch >= 300 );
+	}
+
+	THEN ("It does not replay on another rom")
+	{
+	    Chip8State other;
+	    CHECK_THROWS( replay(loaded, {0x12, 0x00}, other) );
+	}
+    }
+}
+
+#ifdef CHIP8_TRACE
+SCENARIO("Tracing execution")
+{
+    GIVEN ("A traced machine")
+    {
+	const std::vector<uint8_t> rom = {
+	    0x60, 0x05, // LD V0, 5
+	    0x80, 0x04, // ADD V0, V0
+	    0xA3, 0x00, // LD I, 0x300
+	    0xF0, 0x33, // LD B, V0
+	    0x12, 0x02  // JP 0x202
+	};
+	const auto filename = (std::filesystem::temp_directory_path() / "chip8_test.trace").string();
+
+	Chip8State m;
+	m.load_rom(rom);
+
+	WHEN ("Fewer instructions run than the ring holds")
+	{
+	    {
+		Tracer tracer(filename, 64);
+		m.set_observer(&tracer);
+		m.run_frame(5);
+		m.set_observer(nullptr);
+	    }
+	    const TraceFile trace(filename);
+
+	    THEN ("Every instruction is in the trace with its effects")
+	    {
+		REQUIRE( trace.first() == 0 );
+		REQUIRE( trace.end() == 5 );
+		CHECK( trace.at(0).pc == 0x200 );
+		CHECK( trace.at(1).instruction == 0x8004 );
+		CHECK( trace.at(1).reg == 0 );
+		CHECK( trace.at(1).value == 10 );
+		CHECK( trace.at(2).I == 0x300 );
+		CHECK( trace.at(3).write_addr == 0x300 );
+		CHECK( trace.at(3).write_count == 3 );
+		CHECK( trace.at(3).written[1] == 1 );
+		CHECK( trace.at(3).written[2] == 0 );
+		CHECK( format_record(trace.at(1)) == "1 0x202 8004 ADD V0, V0       V0=0A VF=00 I=0x000" );
+	    }
+	}
+
+	WHEN ("More instructions run than the ring holds")
+	{
+	    {
+		Tracer tracer(filename, 8);
+		m.set_observer(&tracer);
+		m.run_frame(21);
+		m.set_observer(nullptr);
+	    }
+	    const TraceFile trace(filename);
+
+	    THEN ("The newest ones are kept")
+	    {
+		CHECK( trace.first() == 13 );
+		CHECK( trace.end() == 21 );
+		CHECK( trace.at(20).cycle == 20 );
+	    }
+	}
+
+	THEN ("A ring larger than the header can describe is refused")
+	{
+	    CHECK_THROWS_AS( Tracer(filename, size_t{UINT32_MAX} + 1), std::runtime_error );
+	}
+
+	WHEN ("The trace is indexed")
+	{
+	    {
+		Tracer tracer(filename, 64);
+		m.set_observer(&tracer);
+		m.run_frame(13);
+		m.set_observer(nullptr);
+	    }
+	    const TraceFile trace(filename);
+	    build_index(trace, filename + ".idx");
+	    const TraceIndex index(filename + ".idx");
+
+	    THEN ("Changes can be looked up per register and address")
+	    {
+		CHECK( index.first() == 0 );
+		CHECK( index.end() == 13 );
+		// V0 is written by cycles 0, 1, 5, 9
+		CHECK( index.change_count(TraceKey::reg(0)) == 4 );
+		CHECK( index.last_change_before(TraceKey::reg(0), 9) == 5u );
+		CHECK( index.last_change_before(TraceKey::reg(0), 10) == 9u );
+		CHECK_FALSE( index.last_change_before(TraceKey::reg(0), 0) );
+		CHECK( index.first_change_from(TraceKey::reg(0), 2) == 5u );
+		CHECK( index.change_count(TraceKey::reg(1)) == 0 );
+		CHECK( index.change_count(TraceKey::I) == 1 );
+		// LD B, V0 at cycles 3, 7, 11
+		CHECK( index.change_count(TraceKey::address(0x302)) == 3 );
+		CHECK( index.last_change_before(TraceKey::address(0x301), 12) == 11u );
+	    }
+	    std::filesystem::remove(filename + ".idx");
+	}
+
+	std::filesystem::remove(filename);
+    }
+}
+#endif
+
+#ifdef CHIP8_TRACE
+SCENARIO("Profiling guest code")
+{
+    GIVEN ("A profiled program with a subroutine and a loop")
+    {
+	std::istringstream source(
+		"CALL :SUB:\n"
+		":LOOP:\n"
+		"ADD V0, 1\n"
+		"SE V0, 3\n"
+		"JP :LOOP:\n"
+		":END:\n"
+		"JP :END:\n"
+		":SUB:\n"
+		"LD V1, 5\n"
+		"RET\n");
+	const auto program = assemble_program(source);
+
+	Chip8State m;
+	m.load_rom(program.bytes);
+	Profiler profiler;
+	m.set_observer(&profiler);
+	m.run_frame(15);
+
+	THEN ("Every instruction is counted per address and opcode")
+	{
+	    CHECK( profiler.get_counts().instructions[0x202] == 3 );
+	    CHECK( profiler.get_counts().instructions[0x208] == 4 );
+	    CHECK( profiler.executions(Opcode::ADDVxbyte) == 3 );
+	    CHECK( profiler.executions(Opcode::JPaddr) == 6 );
+	    CHECK( profiler.executions(Opcode::CALL) == 1 );
+	}
+
+	THEN ("Backward jumps are reported as loops, most taken first")
+	{
+	    const auto loops = profiler.hot_loops();
+	    REQUIRE( loops.size() == 2 );
+	    CHECK( loops[0].from == 0x208 );
+	    CHECK( loops[0].to == 0x208 );
+	    CHECK( loops[0].count == 4 );
+	    CHECK( loops[1].from == 0x206 );
+	    CHECK( loops[1].to == 0x202 );
+	    CHECK( loops[1].count == 2 );
+	}
+
+	THEN ("Call stacks are collapsed per subroutine")
+	{
+	    std::stringstream stacks;
+	    profiler.write_stacks(stacks, program.symbols);
+	    CHECK( stacks.str() == "0x200 13\n0x200;SUB 2\n" );
+
+	    std::stringstream report;
+	    profiler.write_report(report, program.symbols);
+	    CHECK( report.str().find("           6  JPaddr") != std::string::npos );
+	    CHECK( report.str().find("           2  0x206 -> 0x202  LOOP") != std::string::npos );
+	}
+    }
+
+    GIVEN ("A subroutine that calls itself forever")
+    {
+	std::istringstream source(
+		":SELF:\n"
+		"CALL :SELF:\n");
+	const auto program = assemble_program(source);
+
+	Chip8State m;
+	m.load_rom(program.bytes);
+	Profiler profiler;
+	m.set_observer(&profiler);
+	m.run_frame(1000);
+
+	THEN ("The call tree stops at the depth of the machine's stack")
+	{
+	    std::stringstream stacks;
+	    profiler.write_stacks(stacks, program.symbols);
+	    std::string line, deepest;
+	    size_t lines = 0;
+	    while (std::getline(stacks, line)) {
+		lines++;
+		deepest = line;
+	    }
+	    CHECK( lines == 17 );
+	    CHECK( std::count(deepest.begin(), deepest.end(), ';') == 16 );
+	    CHECK( deepest.substr(deepest.rfind(' ')) == " " + std::to_string(984 * instruction_cycles(0x2200)) );
+	}
+    }
+}
+#endif
+
+#ifdef CHIP8_TRACE
+SCENARIO("Coverage")
+{
+    GIVEN ("A rom that jumps through V0 past its sprite")
+    {
+	const std::vector<uint8_t> rom = {
+	    0x60, 0x02, // LD V0, 2
+	    0xA2, 0x0C, // LD I, 0x20C
+	    0xD0, 0x12, // DRW V0, V1, 2
+	    0xF0, 0x55, // LD [I], V0
+	    0xB2, 0x0C, // JP V0, 0x20C
+	    0xFF, 0xFF,
+	    0xF0, 0x90, // sprite
+	    0x12, 0x0E  // JP 0x20E
+	};
+
+	Chip8State m;
+	m.load_rom(rom);
+	CoverageRecorder recorder;
+	m.set_observer(&recorder);
+	m.run_frame(7);
+	const auto& coverage = recorder.coverage;
+
+	THEN ("Fetched, read and written bytes are recorded")
+	{
+	    CHECK( coverage.executed.count() == 6 );
+	    CHECK( coverage.fetched(0x209) );
+	    CHECK_FALSE( coverage.fetched(0x20A) );
+	    CHECK( coverage.fetched(0x20F) );
+	    CHECK( coverage.drawn.test(0x20C) );
+	    CHECK( coverage.drawn.test(0x20D) );
+	    CHECK( coverage.read.count() == 2 );
+	    CHECK( coverage.written.count() == 1 );
+	    CHECK( coverage.written.test(0x20C) );
+	}
+
+	THEN ("Runs merge and survive a round trip through a file")
+	{
+	    Coverage other;
+	    other.executed.set(0x20A);
+	    other.merge(coverage);
+	    CHECK( other.executed.count() == 7 );
+	    CHECK( other.written == coverage.written );
+
+	    std::stringstream file;
+	    other.write(file);
+	    const auto copy = Coverage::read_from(file);
+	    CHECK( copy.executed == other.executed );
+	    CHECK( copy.read == other.read );
+	    CHECK( copy.drawn == other.drawn );
+	    CHECK( copy.written == other.written );
+	}
+
+	THEN ("Code only reached at runtime is disassembled as code")
+	{
+	    CHECK( analyse(rom).kind_at(0x20E) == ByteKind::Data );
+
+	    const auto disassembly = analyse(rom, Chip8State::program_start, &coverage);
+	    CHECK( disassembly.is_code(0x20E) );
+	    CHECK( disassembly.kind_at(0x20C) == ByteKind::Sprite );
+	    CHECK( disassembly.kind_at(0x20A) == ByteKind::Data );
+
+	    const auto summary = summarise(coverage, disassembly);
+	    CHECK( summary.code_bytes == 12 );
+	    CHECK( summary.executed_code_bytes == 12 );
+	    CHECK( summary.rom_bytes == 16 );
+	    CHECK( summary.touched_bytes == 14 );
+
+	    std::stringstream source;
+	    write_source(source, rom, disassembly, &coverage);
+	    CHECK( source.str().find("# 20E 120E x--") != std::string::npos );
+	    CHECK( source.str().find("# ####.... -rw") != std::string::npos );
+	    CHECK( source.str().find("DB 255, 255  # ---") != std::string::npos );
+	}
+    }
+
+    GIVEN ("A sprite drawn across the bottom edge")
+    {
+	const std::vector<uint8_t> rom = {
+	    0x61, 0x1E, // LD V1, 30
+	    0xA2, 0x06, // LD I, 0x206
+	    0xD0, 0x14, // DRW V0, V1, 4
+	    0xFF, 0xFF, 0xFF, 0xFF
+	};
+
+	Chip8State m;
+	m.load_rom(rom);
+	CoverageRecorder recorder;
+	m.set_observer(&recorder);
+	m.run_frame(3);
+
+	THEN ("Only the rows left on screen are read")
+	{
+	    CHECK( recorder.coverage.drawn.count() == 2 );
+	    CHECK( recorder.coverage.read.test(0x207) );
+	    CHECK_FALSE( recorder.coverage.read.test(0x208) );
+	}
+    }
+}
+#endif
+
+SCENARIO("Stepping backwards")
+{
+    GIVEN ("A program touching registers, memory, the stack, timers and the display")
+    {
+	std::istringstream source(
+		":START:\n"
+		"LD V0, 200\n"
+		"LD V1, 100\n"
+		"ADD V0, V1\n"
+		"RND V2, 255\n"
+		"LD I, :SPRITE:\n"
+		"DRW V0, V1, 3\n"
+		"CALL :SUB:\n"
+		"LD DT, V2\n"
+		"LD ST, V1\n"
+		"LD F, V2\n"
+		"ADD I, V1\n"
+		"LD B, V0\n"
+		"LD I, :BUF:\n"
+		"LD [I], V3\n"
+		"ADD V3, 7\n"
+		"LD V3, [I]\n"
+		"SHR V0, V0\n"
+		"SHL V1, V1\n"
+		"SUB V0, V1\n"
+		"SUBN V2, V0\n"
+		"CLS\n"
+		"JP :START:\n"
+		":SUB:\n"
+		"DRW V1, V0, 3\n"
+		"RET\n"
+		":SPRITE:\n"
+		"DB 255, 129, 255\n"
+		":BUF:\n"
+		"DB 0, 0, 0, 0\n");
+	const auto rom = assemble_program(source).bytes;
+
+	Chip8State m;
+	m.seed(5);
+	m.load_rom(rom);
+
+	const auto same = [](const MachineState& a, const MachineState& b) {
+	    return std::memcmp(&a, &b, sizeof(MachineState)) == 0;
+	};
+
+	// The state before every instruction, while keys change every frame
+	const auto run = [&](size_t frames) {
+	    std::vector<MachineState> before;
+	    for (size_t frame=0; frame<frames; ++frame) {
+		m.set_keyboard(frame / 3 % 2 ? 0x0021 : 0);
+		for (int i=0; i<7; ++i) {
+		    before.push_back(m.snapshot());
+		    m.step();
+		}
+		m.tick_timers();
+	    }
+	    return before;
+	};
+
+	WHEN ("Every instruction is logged")
+	{
+	    UndoLog log;
+	    m.set_undo_log(&log);
+	    const auto before = run(40);
+
+	    THEN ("Stepping back retraces every instruction exactly")
+	    {
+		for (size_t i=before.size(); i-- > 0;) {
+		    REQUIRE( log.step_back(m) );
+		    REQUIRE( same(m.snapshot(), before[i]) );
+		}
+		CHECK_FALSE( log.step_back(m) );
+		CHECK( log.records() == 0 );
+	    }
+
+	    THEN ("Restoring a snapshot empties the log")
+	    {
+		m.restore(before.front());
+		CHECK( log.records() == 0 );
+	    }
+	}
+
+	WHEN ("The log has a small budget")
+	{
+	    UndoLog log(1024);
+	    m.set_undo_log(&log);
+	    const auto before = run(200);
+
+	    THEN ("Only the newest instructions can be undone")
+	    {
+		CHECK( log.bytes_used() <= 1024 );
+		size_t steps = 0;
+		while (log.step_back(m)) {
+		    ++steps;
+		    REQUIRE( same(m.snapshot(), before[before.size() - steps]) );
+		}
+		CHECK( steps > 20 );
+		CHECK( steps < before.size() );
+	    }
+	}
+    }
+}
+
+SCENARIO("Running ahead")
+{
+    GIVEN ("A machine drawing a random sprite every frame, with an undo log")
+    {
+	const std::vector<uint8_t> rom = {
+	    0xC2, 0xFF, // RND V2, 0xFF
+	    0xA3, 0x00, // LD I, 0x300
+	    0xF2, 0x33, // LD B, V2
+	    0x70, 0x03, // ADD V0, 3
+	    0x71, 0x01, // ADD V1, 1
+	    0xD0, 0x13, // DRW V0, V1, 3
+	    0x12, 0x00  // JP 0x200
+	};
+	Chip8State m;
+	m.seed(9);
+	m.load_rom(rom);
+	UndoLog log;
+	m.set_undo_log(&log);
+	m.set_keyboard(0x0004);
+	m.run_frame(7);
+
+	WHEN ("Two frames are run ahead")
+	{
+	    const MachineState before = m.snapshot();
+	    const auto records = log.records();
+
+	    uint64_t shown = 0;
+	    m.run_ahead(2, 7, [&] { shown = m.display_hash(); });
+
+	    THEN ("The display shown is the one two frames later")
+	    {
+		Chip8State other;
+		other.restore(before);
+		other.run_frame(7);
+		other.run_frame(7);
+		CHECK( shown == other.display_hash() );
+		CHECK( shown != m.display_hash() );
+	    }
+
+	    THEN ("The machine and its undo log are left as they were")
+	    {
+		CHECK( std::memcmp(&before, &m.snapshot(), sizeof(MachineState)) == 0 );
+		CHECK( log.records() == records );
+	    }
+	}
+    }
+}
+
+SCENARIO("Rollback netplay")
+{
+    GIVEN ("A rom counting presses of key 5 and key C, and two players")
+    {
+	const std::vector<uint8_t> rom = {
+	    0x60, 0x05, // LD V0, 5
+	    0xE0, 0xA1, // SKNP V0
+	    0x71, 0x01, // ADD V1, 1
+	    0x62, 0x0C, // LD V2, 12
+	    0xE2, 0xA1, // SKNP V2
+	    0x73, 0x01, // ADD V3, 1
+	    0xC4, 0xFF, // RND V4, 0xFF
+	    0x81, 0x44, // ADD V1, V4
+	    0x12, 0x00  // JP 0x200
+	};
+	constexpr size_t frames = 300;
+	const auto keys_a = [](size_t frame) -> uint16_t { return frame / 7 % 3 == 0 ? 1 << 0x5 : 0; };
+	const auto keys_b = [](size_t frame) -> uint16_t { return frame / 11 % 2 == 0 ? 1 << 0xC : 0; };
+
+	Chip8State expected;
+	expected.seed(1);
+	expected.load_rom(rom);
+	for (size_t frame=0; frame<frames; ++frame) {
+	    expected.set_keyboard(keys_a(frame) | keys_b(frame));
+	    expected.run_frame(9);
+	}
+
+	Chip8State a, b;
+	for (auto* m : {&a, &b}) {
+	    m->seed(1);
+	    m->load_rom(rom);
+	}
+	RollbackSession session_a(a, 9), session_b(b, 9);
+
+	const auto same = [](const MachineState& x, const MachineState& y) {
+	    return std::memcmp(&x, &y, sizeof(MachineState)) == 0;
+	};
+
+	WHEN ("Packets take three frames and every fifth one is lost")
+	{
+	    struct InFlight {
+		size_t arrival;
+		bool to_a;
+		std::vector<uint8_t> data;
+	    };
+	    std::vector<InFlight> network;
+	    size_t sent = 0;
+
+	    for (size_t tick=0; session_a.frame() < frames || session_b.frame() < frames
+		    || session_a.confirmed() < frames || session_b.confirmed() < frames; ++tick) {
+		REQUIRE( tick < 10*frames );
+
+		for (auto it=network.begin(); it!=network.end();) {
+		    if (it->arrival > tick) {
+			++it;
+			continue;
+		    }
+		    const auto packet = NetplayPacket::decode(it->data.data(), it->data.size());
+		    (it->to_a ? session_a : session_b).receive(packet, 42);
+		    it = network.erase(it);
+		}
+
+		for (auto* session : {&session_a, &session_b}) {
+		    const bool is_a = session == &session_a;
+		    if (session->frame() < frames && session->can_advance())
+			session->advance(is_a ? keys_a(session->frame()) : keys_b(session->frame()));
+		    if (++sent % 5 != 0)
+			network.push_back({tick + 3, !is_a, session->packet(42).encode()});
+		}
+	    }
+
+	    THEN ("Both machines end up exactly where one shared keyboard would")
+	    {
+		CHECK( session_a.rollbacks() > 0 );
+		CHECK( session_b.rollbacks() > 0 );
+		CHECK( same(a.snapshot(), expected.snapshot()) );
+		CHECK( same(b.snapshot(), expected.snapshot()) );
+	    }
+	}
+
+	WHEN ("The remote side falls behind")
+	{
+	    for (size_t frame=0; frame<8; ++frame)
+		session_a.advance(keys_a(frame));
+
+	    THEN ("The local side has to wait after eight frames")
+	    {
+		CHECK_FALSE( session_a.can_advance() );
+		CHECK_THROWS( session_a.advance(0) );
+		session_a.receive_remote(0, keys_b(0));
+		CHECK( session_a.can_advance() );
+	    }
+	}
+
+	WHEN ("The two sides talk over UDP on localhost")
+	{
+	    NetplayLink link_a(0, "localhost", 0);
+	    NetplayLink link_b(0, "127.0.0.1", link_a.local_port());
+	    link_a.set_peer("localhost", link_b.local_port());
+
+	    for (size_t tick=0; session_a.frame() < frames || session_b.frame() < frames
+		    || session_a.confirmed() < frames || session_b.confirmed() < frames; ++tick) {
+		REQUIRE( tick < 100*frames );
+		while (auto packet = link_a.receive())
+		    session_a.receive(*packet, 42);
+		while (auto packet = link_b.receive())
+		    session_b.receive(*packet, 42);
+
+		if (session_a.frame() < frames && session_a.can_advance())
+		    session_a.advance(keys_a(session_a.frame()));
+		if (session_b.frame() < frames && session_b.can_advance())
+		    session_b.advance(keys_b(session_b.frame()));
+		link_a.send(session_a.packet(42));
+		link_b.send(session_b.packet(42));
+	    }
+
+	    THEN ("They agree with each other")
+	    {
+		CHECK( same(a.snapshot(), expected.snapshot()) );
+		CHECK( same(b.snapshot(), expected.snapshot()) );
+	    }
+	}
+    }
+
+    GIVEN ("A packet")
+    {
+	NetplayPacket packet;
+	packet.rom_hash = 0x12345678;
+	packet.ack = 300;
+	packet.first_frame = 297;
+	packet.keys = {0x0020, 0x0020, 0x8001};
+	const auto data = packet.encode();
+
+	THEN ("It decodes to the same packet")
+	{
+	    const auto copy = NetplayPacket::decode(data.data(), data.size());
+	    CHECK( copy.rom_hash == packet.rom_hash );
+	    CHECK( copy.ack == packet.ack );
+	    CHECK( copy.first_frame == packet.first_frame );
+	    CHECK( copy.keys == packet.keys );
+	}
+
+	THEN ("Truncated or foreign data is rejected")
+	{
+	    CHECK_THROWS( NetplayPacket::decode(data.data(), data.size() - 1) );
+	    const std::vector<uint8_t> garbage(16, 0x55);
+	    CHECK_THROWS( NetplayPacket::decode(garbage.data(), garbage.size()) );
+	}
+    }
+}
+
+SCENARIO("Forking a machine")
+{
+    GIVEN ("A machine part way through a program using RND")
+    {
+	const std::vector<uint8_t> rom = {
+	    0xC2, 0xFF, // RND V2, 0xFF
+	    0xA3, 0x00, // LD I, 0x300
+	    0xF2, 0x33, // LD B, V2
+	    0x70, 0x03, // ADD V0, 3
+	    0xD0, 0x13, // DRW V0, V1, 3
+	    0x12, 0x00  // JP 0x200
+	};
+	Chip8State m;
+	m.seed(4);
+	m.load_rom(rom);
+	UndoLog log;
+	m.set_undo_log(&log);
+	m.run_frame(50);
+
+	WHEN ("It is forked and both run on")
+	{
+	    auto copy = m.fork();
+	    const auto records = log.records();
+	    copy.run_frame(50);
+	    copy.set_memory(0x300, 0xAA);
+
+	    THEN ("The fork does not write the original's undo log")
+	    {
+		CHECK( log.records() == records );
+	    }
+
+	    THEN ("Both produce the same random numbers and displays")
+	    {
+		m.set_undo_log(nullptr);
+		m.run_frame(50);
+		CHECK( m.display_hash() == copy.display_hash() );
+		CHECK( m.get_register(2) == copy.get_register(2) );
+		CHECK( m.get_memory(0x300) != 0xAA );
+	    }
+	}
+    }
+}
+
+SCENARIO("Exploring states")
+{
+    GIVEN ("A program that needs key 5 and then key 7 to get through")
+    {
+	const std::vector<uint8_t> rom = {
+	    0x60, 0x05, // LD V0, 5
+	    0xE0, 0x9E, // SKP V0
+	    0x12, 0x00, // JP 0x200
+	    0x60, 0x07, // LD V0, 7
+	    0xE0, 0x9E, // SKP V0
+	    0x12, 0x00, // JP 0x200
+	    0x12, 0x0C  // JP 0x20C
+	};
+	Chip8State m;
+	m.load_rom(rom);
+	ExploreOptions options;
+	options.instructions_per_frame = 3;
+	options.max_depth = 10;
+	options.threads = 4;
+
+	WHEN ("The explorer searches for the end")
+	{
+	    options.goal = [](const Chip8State& s) { return s.get_program_counter() == 0x20C; };
+	    const auto result = explore(m, options);
+
+	    THEN ("It finds keys that lead there")
+	    {
+		REQUIRE( result.path );
+		CHECK( result.path->size() <= 3 );
+		auto replay = m.fork();
+		for (const auto keys : *result.path) {
+		    replay.set_keyboard(keys);
+		    replay.run_frame(options.instructions_per_frame);
+		}
+		CHECK( replay.get_program_counter() == 0x20C );
+	    }
+	}
+
+	WHEN ("It searches without a goal")
+	{
+	    const auto result = explore(m, options);
+
+	    THEN ("It stops once no new states turn up and counts each state once")
+	    {
+		CHECK( !result.path );
+		CHECK( result.depth < options.max_depth );
+		CHECK( result.states > 1 );
+		CHECK( result.states <= 1 + result.expanded * 17 );
+	    }
+
+	    THEN ("A beam keeps the frontier small")
+	    {
+		options.beam_width = 2;
+		const auto beam = explore(m, options);
+		CHECK( beam.expanded <= 1 + 2 * (options.max_depth - 1) );
+		CHECK( beam.states <= result.states );
+	    }
+
+	    THEN ("The state budget stops a level part way through")
+	    {
+		options.max_states = 3;
+		const auto capped = explore(m, options);
+		CHECK( capped.depth == 1 );
+		CHECK( capped.states < options.max_states + options.threads );
+	    }
+	}
+    }
+
+    GIVEN ("A set shared by threads")
+    {
+	ShardedSet set;
+	parallel_for(1000, [&](size_t i) { set.insert(i % 100 * 0x9E3779B97F4A7C15); }, 4);
+
+	THEN ("Each key is in it once")
+	{
+	    CHECK( set.size() == 100 );
+	    CHECK( !set.insert(0) );
+	    CHECK( set.insert(1) );
+	}
+    }
+}
+
+SCENARIO("Fingerprinting states")
+{
+    GIVEN ("A machine drawing, clearing and writing memory")
+    {
+	const std::vector<uint8_t> rom = {
+	    0xC2, 0xFF, // RND V2, 0xFF
+	    0xA3, 0x00, // LD I, 0x300
+	    0xF2, 0x33, // LD B, V2
+	    0xD0, 0x13, // DRW V0, V1, 3
+	    0x70, 0x05, // ADD V0, 5
+	    0x30, 0x3C, // SE V0, 60
+	    0x12, 0x00, // JP 0x200
+	    0x00, 0xE0, // CLS
+	    0x60, 0x00, // LD V0, 0
+	    0x12, 0x00  // JP 0x200
+	};
+	Chip8State m;
+	m.seed(9);
+	m.load_rom(rom);
+	UndoLog log;
+	m.set_undo_log(&log);
+
+	THEN ("The incremental hash always matches hashing from scratch")
+	{
+	    for (size_t i=0; i<300; ++i) {
+		m.step();
+		MachineState full = m.snapshot();
+		full.rehash();
+		REQUIRE( full.content_hash == m.snapshot().content_hash );
+	    }
+	}
+
+	WHEN ("It runs, steps back and runs again")
+	{
+	    m.run_frame(100);
+	    const auto fingerprint = m.fingerprint();
+	    m.run_frame(1);
+	    CHECK( m.fingerprint() != fingerprint );
+	    log.step_back(m);
+
+	    THEN ("It has the same fingerprint as before")
+	    {
+		CHECK( m.fingerprint() == fingerprint );
+	    }
+	}
+
+	WHEN ("Copies differ in one byte of memory, one pixel or one register")
+	{
+	    m.run_frame(100);
+	    auto memory = m.fork();
+	    memory.set_memory(0x800, 1);
+	    auto pixel = m.fork();
+	    pixel.set_display(63, 31, !m.get_display(63, 31));
+	    auto reg = m.fork();
+	    reg.set_register(7, m.get_register(7) + 1);
+
+	    THEN ("Their fingerprints differ")
+	    {
+		CHECK( memory.fingerprint() != m.fingerprint() );
+		CHECK( pixel.fingerprint() != m.fingerprint() );
+		CHECK( reg.fingerprint() != m.fingerprint() );
+		memory.set_memory(0x800, 0);
+		CHECK( memory.fingerprint() == m.fingerprint() );
+	    }
+	}
+
+	WHEN ("It is saved and loaded")
+	{
+	    m.run_frame(100);
+	    const auto loaded = load_state(save_state(m.snapshot(), rom), rom);
+
+	    THEN ("The loaded state has the same fingerprint")
+	    {
+		CHECK( loaded.fingerprint() == m.fingerprint() );
+	    }
+	}
+    }
+}
+
+SCENARIO("Operands out of range")
+{
+    GIVEN ("A machine")
+    {
+	Chip8State m;
+
+	WHEN ("I points near the end of memory")
+	{
+	    m.set_I_register(0xFFE);
+	    m.set_register(0, 0xAB);
+	    m.set_register(1, 0xCD);
+	    m.set_register(2, 0xEF);
+	    m.interpret(0xF255); // LD [I], V2
+
+	    THEN ("Reads and writes wrap to the start of memory")
+	    {
+		CHECK( m.get_memory(0xFFE) == 0xAB );
+		CHECK( m.get_memory(0xFFF) == 0xCD );
+		CHECK( m.get_memory(0x000) == 0xEF );
+		m.set_I_register(0xFFFF);
+		m.interpret(0xD012); // DRW V0, V1, 2
+		CHECK( m.get_display_row(m.get_register(1) % 32) != 0 );
+	    }
+	}
+
+	WHEN ("Subroutines nest deeper than the stack")
+	{
+	    for (uint16_t i=0; i<17; ++i) {
+		m.set_program_counter(0x300 + 2*i);
+		m.interpret(0x2400); // CALL 0x400
+	    }
+
+	    THEN ("The stack wraps around")
+	    {
+		CHECK( m.get_stack_pointer() == 1 );
+		m.interpret(0x00EE); // RET
+		CHECK( m.get_program_counter() == 0x320 );
+		CHECK( m.get_stack_pointer() == 0 );
+		m.interpret(0x00EE);
+		m.interpret(0x00EE);
+		CHECK( m.get_stack_pointer() == 14 );
+	    }
+	}
+
+	WHEN ("Vx is above 0xF in SKP")
+	{
+	    m.set_register(3, 0x15);
+	    m.set_keyboard(1 << 5);
+	    const auto pc = m.get_program_counter();
+	    m.interpret(0xE39E); // SKP V3
+
+	    THEN ("Its low nibble names the key")
+	    {
+		CHECK( m.get_program_counter() == pc + 2 );
+	    }
+	}
+    }
+
+    GIVEN ("Malformed assembly")
+    {
+	THEN ("Unknown labels throw runtime errors")
+	{
+	    std::istringstream source("JP :nowhere:\n");
+	    CHECK_THROWS_AS( assemble_program(source), std::runtime_error );
+	}
+
+	THEN ("Lines of only separators are skipped")
+	{
+	    std::istringstream source(" , ,\nCLS\n");
+	    CHECK( assemble_program(source).bytes == std::vector<uint8_t>{0x00, 0xE0} );
+	}
+    }
+}
+
+namespace {
+    // Sets V3 wrong after a given number of instructions
+    class BrokenEngine : public Engine {
+	public:
+	    explicit BrokenEngine(size_t at) : at{at} {}
+	    void load(const std::vector<uint8_t>& rom, uint64_t seed) override { m.seed(seed); m.load_rom(rom); }
+	    void set_keyboard(uint16_t keys) override { m.set_keyboard(keys); }
+	    void step() override
+	    {
+		m.step();
+		if (++steps == at)
+		    m.set_register(3, m.get_register(3) ^ 0x40);
+	    }
+	    void tick_timers() override { m.tick_timers(); }
+	    const MachineState& state() const override { return m.snapshot(); }
+
+	private:
+	    Chip8State m;
+	    size_t at;
+	    size_t steps = 0;
+    };
+}
+
+SCENARIO("Lockstep execution")
+{
+    GIVEN ("A program using the stack, timers, memory, keys and the display")
+    {
+	std::istringstream source(
+	    ":loop:\n"
+	    "RND V3, 255\n"
+	    "CALL :draw:\n"
+	    "LD DT, V3\n"
+	    "SKP V4\n"
+	    "ADD V4, 1\n"
+	    "LD I, 1024\n"
+	    "LD B, V3\n"
+	    "LD V2, [I]\n"
+	    "JP :loop:\n"
+	    ":draw:\n"
+	    "LD F, V3\n"
+	    "DRW V3, V4, 5\n"
+	    "RET\n");
+	const auto program = assemble_program(source);
+	LockstepOptions options;
+	options.frames = 120;
+	options.seed = 3;
+	for (uint16_t frame=0; frame<60; ++frame)
+	    options.keys.push_back(frame % 7 == 0 ? 0 : 1 << (frame % 16));
+
+	THEN ("Every engine matches the reference")
+	{
+	    for (const auto name : engine_names()) {
+		auto reference = make_engine("reference");
+		auto engine = make_engine(name);
+		const auto result = run_lockstep(*reference, *engine, program.bytes, options);
+		CHECK( !result.divergence );
+		CHECK( result.frames == options.frames );
+		CHECK( result.instructions == options.frames * options.instructions_per_frame );
+	    }
+	    CHECK_THROWS_AS( make_engine("jit"), std::runtime_error );
+	}
+
+	WHEN ("An engine gets a register wrong")
+	{
+	    auto reference = make_engine("reference");
+	    BrokenEngine broken(25);
+	    const auto result = run_lockstep(*reference, broken, program.bytes, options);
+
+	    THEN ("The run stops right after that instruction")
+	    {
+		REQUIRE( result.divergence );
+		CHECK( result.divergence->frame == 2 );
+		CHECK( result.divergence->step == 5 );
+		CHECK( result.instructions == 25 );
+
+		std::ostringstream dump;
+		write_divergence(dump, *result.divergence);
+		CHECK( dump.str().find("Frame 2, instruction 5") == 0 );
+		CHECK( dump.str().find("V3: ") != std::string::npos );
+		CHECK( dump.str().find("PC: ") == std::string::npos );
+	    }
+
+	    THEN ("Comparing frames finds it at the end of the frame")
+	    {
+		options.per_frame = true;
+		BrokenEngine again(25);
+		auto other = make_engine("reference");
+		const auto frames = run_lockstep(*other, again, program.bytes, options);
+		REQUIRE( frames.divergence );
+		CHECK( frames.divergence->frame == 2 );
+		CHECK( frames.divergence->step == options.instructions_per_frame );
+	    }
+	}
+    }
+}
+
+SCENARIO("Golden frames")
+{
+    GIVEN ("A program drawing a sprite that follows the keys")
+    {
+	std::istringstream source(
+	    ":loop:\n"
+	    "LD V0, 0\n"
+	    ":scan:\n"
+	    "SKNP V0\n"
+	    "LD V1, V0\n"
+	    "ADD V0, 1\n"
+	    "SE V0, 16\n"
+	    "JP :scan:\n"
+	    "CLS\n"
+	    "LD F, V1\n"
+	    "DRW V1, V1, 5\n"
+	    "LD V2, 1\n"
+	    "LD DT, V2\n"
+	    ":wait:\n"
+	    "LD V2, DT\n"
+	    "SE V2, 0\n"
+	    "JP :wait:\n"
+	    "JP :loop:\n");
+	const auto program = assemble_program(source);
+	const std::vector<uint16_t> keys = {0, 1 << 3, 1 << 3, 1 << 9};
+	const std::vector<uint32_t> frames = {1, 2, 4, 8};
+	const auto golden = capture(program.bytes, keys, frames, 100, 7);
+
+	THEN ("It holds the display at every frame asked for")
+	{
+	    REQUIRE( golden.displays.size() == frames.size() );
+	    CHECK( golden.displays[0] != golden.displays[1] );
+	    CHECK( golden.displays[1] != golden.displays[3] );
+
+	    Chip8State m;
+	    m.load_rom(program.bytes);
+	    for (const auto mask : keys) {
+		m.set_keyboard(mask);
+		m.run_frame(100);
+	    }
+	    for (size_t row=0; row<32; ++row)
+		CHECK( golden.displays[3][row] == m.get_display_row(row) );
+	    CHECK( display_hash(golden.displays[3]) == m.display_hash() );
+	}
+
+	THEN ("It survives a round trip and matches the same run")
+	{
+	    std::stringstream file;
+	    golden.write(file);
+	    const auto loaded = Golden::read(file);
+	    CHECK( loaded.frames == golden.frames );
+	    CHECK( loaded.displays == golden.displays );
+	    CHECK( loaded.instructions_per_frame == 100 );
+	    CHECK( loaded.seed == 7 );
+	    CHECK( verify(loaded, program.bytes, keys).empty() );
+	}
+
+	WHEN ("The run gets other keys")
+	{
+	    const auto mismatches = verify(golden, program.bytes, {0, 1 << 3, 1 << 5});
+
+	    THEN ("The frames after the change differ")
+	    {
+		REQUIRE( mismatches.size() == 2 );
+		CHECK( mismatches[0].frame == 4 );
+		CHECK( mismatches[1].frame == 8 );
+
+		std::ostringstream pbm;
+		write_pbm(pbm, mismatches[0]);
+		std::istringstream in(pbm.str());
+		std::string magic, comment;
+		size_t width, height;
+		in >> magic;
+		std::getline(in >> std::ws, comment);
+		in >> width >> height;
+		CHECK( magic == "P1" );
+		CHECK( width == 3*64 + 2 );
+		CHECK( height == 32 );
+		size_t pixels = 0, set = 0;
+		int pixel;
+		while (in >> pixel) {
+		    pixels++;
+		    set += pixel;
+		}
+		CHECK( pixels == width * height );
+		CHECK( set > 0 );
+	    }
+	}
+
+	WHEN ("A golden file is damaged")
+	{
+	    std::stringstream file;
+	    golden.write(file);
+	    auto text = file.str();
+	    text[text.rfind(' ') + 1] ^= 1;
+	    std::istringstream damaged(text);
+
+	    THEN ("Reading it throws")
+	    {
+		CHECK_THROWS_AS( Golden::read(damaged), std::runtime_error );
+	    }
+	}
+    }
+}
+
+SCENARIO("Display deltas")
+{
+    GIVEN ("Two displays")
+    {
+	std::mt19937_64 rng(5);
+	Display before{0}, after{0};
+	for (auto& row : before)
+	    row = rng();
+	after = before;
+
+	THEN ("An unchanged display costs only the row mask")
+	{
+	    const auto delta = encode_delta(before, after);
+	    CHECK( delta.size() == 4 );
+	    apply_delta(after, delta.data(), delta.size());
+	    CHECK( after == before );
+	}
+
+	WHEN ("A few pixels change")
+	{
+	    after[3] ^= 0x00F0000000000000;
+	    after[20] ^= 0x1;
+	    const auto delta = encode_delta(before, after);
+
+	    THEN ("The delta is small and turns one into the other")
+	    {
+		CHECK( delta.size() < 16 );
+		Display display = before;
+		apply_delta(display, delta.data(), delta.size());
+		CHECK( display == after );
+	    }
+
+	    THEN ("Truncated deltas throw")
+	    {
+		Display display = before;
+		CHECK_THROWS_AS( apply_delta(display, delta.data(), delta.size() - 1), std::runtime_error );
+	    }
+	}
+
+	WHEN ("Everything changes")
+	{
+	    for (auto& row : after)
+		row = rng();
+	    const auto delta = encode_delta(before, after);
+
+	    THEN ("It still round trips")
+	    {
+		CHECK( delta.size() <= 4 + 32*8 + 3 );
+		apply_delta(before, delta.data(), delta.size());
+		CHECK( before == after );
+	    }
+	}
+    }
+}
+
+SCENARIO("Session server")
+{
+    GIVEN ("A server and a program drawing a sprite that follows the keys")
+    {
+	std::istringstream source(
+	    ":loop:\n"
+	    "LD V0, 0\n"
+	    ":scan:\n"
+	    "SKNP V0\n"
+	    "LD V1, V0\n"
+	    "ADD V0, 1\n"
+	    "SE V0, 16\n"
+	    "JP :scan:\n"
+	    "CLS\n"
+	    "LD F, V1\n"
+	    "DRW V1, V1, 5\n"
+	    "LD V2, 1\n"
+	    "LD DT, V2\n"
+	    ":wait:\n"
+	    "LD V2, DT\n"
+	    "SE V2, 0\n"
+	    "JP :wait:\n"
+	    "JP :loop:\n");
+	const auto program = assemble_program(source);
+	const auto path = (std::filesystem::temp_directory_path() / "chip8_session_test.sock").string();
+	ServerOptions options;
+	options.instructions_per_frame = 100;
+	SessionServer server(path, options);
+	auto settle = [&] {
+	    for (int i=0; i<4; ++i)
+		server.poll(10);
+	};
+
+	SessionClient a(path);
+	auto b = std::make_unique<SessionClient>(path);
+	a.send_rom(program.bytes, 1);
+	b->send_rom(program.bytes, 1);
+	b->send_keys(1 << 5);
+	settle();
+
+	Chip8State expected_a, expected_b;
+	expected_a.load_rom(program.bytes);
+	expected_b.load_rom(program.bytes);
+	expected_b.set_keyboard(1 << 5);
+	for (int frame=0; frame<10; ++frame) {
+	    server.tick();
+	    expected_a.run_frame(100);
+	    expected_b.run_frame(100);
+	}
+
+	THEN ("Each client sees its own session, once per change")
+	{
+	    CHECK( server.sessions() == 2 );
+	    CHECK( a.receive() == 1 );
+	    CHECK( a.frame() == 1 );
+	    CHECK( a.display() == expected_a.snapshot().display );
+	    b->wait_frame();
+	    CHECK( b->display() == expected_b.snapshot().display );
+	    CHECK( a.display() != b->display() );
+	    CHECK( server.frames_sent() == 2 );
+	}
+
+	WHEN ("A client presses a key")
+	{
+	    a.receive();
+	    a.send_keys(1 << 3);
+	    settle();
+	    expected_a.set_keyboard(1 << 3);
+	    server.tick();
+	    expected_a.run_frame(100);
+
+	    THEN ("Its next frame shows it")
+	    {
+		CHECK( a.receive() == 1 );
+		CHECK( a.frame() == 11 );
+		CHECK( a.display() == expected_a.snapshot().display );
+	    }
+	}
+
+	WHEN ("A client leaves and another breaks the protocol")
+	{
+	    b.reset();
+	    SessionClient c(path);
+	    c.send_rom(program.bytes);
+	    c.send_rom(program.bytes);
+	    settle();
+
+	    THEN ("Both sessions are gone and the others run on")
+	    {
+		CHECK( server.sessions() == 1 );
+		CHECK_THROWS_AS( c.receive(), std::runtime_error );
+		server.tick();
+		expected_a.run_frame(100);
+		a.receive();
+		CHECK( a.display() == expected_a.snapshot().display );
+	    }
+	}
+    }
+}
+
+namespace {
+    // Just enough of a GIF reader for the files VideoRecorder writes:
+    // the delay and the pixels of every image
+    struct GifImage {
+	uint16_t delay;
+	std::vector<uint8_t> pixels;
+    };
+
+    std::vector<uint8_t> lzw_decode(const std::vector<uint8_t>& data, unsigned int min_code_size)
+    {
+	const uint16_t clear = 1 << min_code_size;
+	std::vector<std::vector<uint8_t>> table;
+	unsigned int code_size = 0;
+	auto reset = [&] {
+	    table.clear();
+	    for (uint16_t i=0; i<clear+2; ++i)
+		table.push_back({static_cast<uint8_t>(i)});
+	    code_size = min_code_size + 1;
+	};
+	reset();
+
+	std::vector<uint8_t> out, previous;
+	size_t bit = 0;
+	while (bit + code_size <= data.size() * 8) {
+	    uint16_t code = 0;
+	    for (unsigned int i=0; i<code_size; ++i, ++bit)
+		code |= ((data[bit/8] >> (bit%8)) & 1) << i;
+	    if (code == clear) {
+		reset();
+		previous.clear();
+		continue;
+	    }
+	    if (code == clear + 1)
+		break;
+
+	    std::vector<uint8_t> entry;
+	    if (code < table.size())
+		entry = table[code];
+	    else if (code == table.size() && !previous.empty())
+		entry = previous, entry.push_back(previous[0]);
+	    else
+		throw std::runtime_error("Bad LZW code");
+	    out.insert(out.end(), entry.begin(), entry.end());
+	    if (!previous.empty()) {
+		previous.push_back(entry[0]);
+		table.push_back(previous);
+		if (table.size() == 1u << code_size && code_size < 12)
+		    code_size++;
+	    }
+	    previous = entry;
+	}
+	return out;
+    }
+
+    std::vector<GifImage> read_gif(const std::string& filename)
+    {
+	std::ifstream in(filename, std::ios::binary);
+	std::vector<uint8_t> file((std::istreambuf_iterator<char>(in)), {});
+	size_t pos = 6 + 7 + 6;
+	auto get16 = [&](size_t at) { return file[at] | file[at+1] << 8; };
+	auto blocks = [&] {
+	    std::vector<uint8_t> data;
+	    while (file.at(pos) != 0) {
+		const size_t n = file[pos++];
+		data.insert(data.end(), &file[pos], &file[pos] + n);
+		pos += n;
+	    }
+	    pos++;
+	    return data;
+	};
+
+	std::vector<GifImage> images;
+	uint16_t delay = 0;
+	while (file.at(pos) != 0x3B) {
+	    if (file[pos] == 0x21) {
+		if (file[pos+1] == 0xF9)
+		    delay = get16(pos + 4);
+		pos += 2;
+		blocks();
+	    } else if (file[pos] == 0x2C) {
+		pos += 10;
+		const unsigned int min_code_size = file[pos++];
+		images.push_back({delay, lzw_decode(blocks(), min_code_size)});
+	    } else {
+		throw std::runtime_error("Bad GIF block");
+	    }
+	}
+	return images;
+    }
+}
+
+SCENARIO("Recording video")
+{
+    GIVEN ("Displays that change every few frames")
+    {
+	// Noise, so the LZW table fills and starts over
+	std::mt19937_64 rng(9);
+	std::vector<Display> displays(3);
+	for (auto& display : displays)
+	    for (auto& row : display)
+		row = rng() & rng();
+	const std::vector<uint32_t> durations = {1, 4, 31};
+	auto record = [&](const std::string& filename, unsigned int scale) {
+	    VideoRecorder recorder(make_video_encoder(filename, scale), true);
+	    for (size_t i=0; i<displays.size(); ++i)
+		for (uint32_t f=0; f<durations[i]; ++f)
+		    recorder.push(displays[i]);
+	    recorder.finish();
+	    CHECK( recorder.frames() == 36 );
+	    CHECK( recorder.dropped() == 0 );
+	};
+	const auto dir = std::filesystem::temp_directory_path() / "chip8_video_test";
+	std::filesystem::remove_all(dir);
+	std::filesystem::create_directories(dir);
+
+	THEN ("A GIF holds each display once, for as long as it was shown")
+	{
+	    const auto filename = (dir / "out.gif").string();
+	    record(filename, 3);
+	    const auto images = read_gif(filename);
+	    REQUIRE( images.size() == 3 );
+	    CHECK( images[0].delay + images[1].delay + images[2].delay == 60 );
+	    CHECK( images[2].delay == 52 );
+	    for (size_t i=0; i<images.size(); ++i) {
+		REQUIRE( images[i].pixels.size() == 64*3 * 32*3 );
+		size_t wrong = 0;
+		for (size_t y=0; y<32*3; ++y)
+		    for (size_t x=0; x<64*3; ++x)
+			wrong += images[i].pixels[y*64*3 + x] != ((displays[i][y/3] >> (63 - x/3)) & 1);
+		CHECK( wrong == 0 );
+	    }
+	}
+
+	THEN ("Y4M repeats displays to keep its frame rate")
+	{
+	    const auto filename = (dir / "out.y4m").string();
+	    record(filename, 1);
+	    std::ifstream in(filename, std::ios::binary);
+	    std::string header;
+	    std::getline(in, header);
+	    CHECK( header == "YUV4MPEG2 W64 H32 F60:1 Ip A1:1 C420jpeg" );
+	    const size_t frame_size = 6 + 64*32 + 2*32*16;
+	    CHECK( std::filesystem::file_size(filename) == header.size() + 1 + 36*frame_size );
+
+	    in.seekg(header.size() + 1 + 35*frame_size + 6);
+	    std::vector<char> luma(64*32);
+	    in.read(luma.data(), luma.size());
+	    CHECK( static_cast<uint8_t>(luma[5]) == ((displays[2][0] >> 58) & 1 ? 235 : 16) );
+	}
+
+	THEN ("PBM images are named after their first frame")
+	{
+	    record((dir / "out.pbm").string(), 1);
+	    CHECK( std::filesystem::exists(dir / "out_000000.pbm") );
+	    CHECK( std::filesystem::exists(dir / "out_000001.pbm") );
+	    CHECK( std::filesystem::exists(dir / "out_000005.pbm") );
+	    CHECK( std::filesystem::file_size(dir / "out_000005.pbm") == std::string("P4\n# frames 31\n64 32\n").size() + 8*32 );
+	}
+
+	THEN ("Unknown formats throw")
+	{
+	    CHECK_THROWS_AS( make_video_encoder((dir / "out.avi").string()), std::runtime_error );
+	}
+
+	std::filesystem::remove_all(dir);
+    }
+}
+
+SCENARIO("Vectorized environments")
+{
+    GIVEN ("A game scoring a point every frame key 5 is held, over at three")
+    {
+	std::istringstream source(
+	    ":loop:\n"
+	    "LD V2, 1\n"
+	    "LD DT, V2\n"
+	    ":wait:\n"
+	    "LD V2, DT\n"
+	    "SE V2, 0\n"
+	    "JP :wait:\n"
+	    "LD V3, 5\n"
+	    "SKNP V3\n"
+	    "ADD V0, 1\n"
+	    "LD V1, 0\n"
+	    "SE V0, 3\n"
+	    "JP :store:\n"
+	    "LD V1, 1\n"
+	    ":store:\n"
+	    "LD I, 768\n"
+	    "LD [I], V1\n"
+	    "DRW V0, V0, 1\n"
+	    "JP :loop:\n");
+	const auto program = assemble_program(source);
+	EnvOptions options;
+	options.instructions_per_frame = 100;
+	options.rewards.push_back({0x300, 1, 0.5f});
+	options.done_address = 0x301;
+	options.done_value = 1;
+	options.max_frames = 20;
+	options.threads = 2;
+	VectorEnv envs(program.bytes, 130, options);
+	std::vector<uint8_t> observations(envs.size() * envs.observation_size());
+	std::vector<uint16_t> actions(envs.size());
+	std::vector<float> rewards(envs.size());
+	std::vector<uint8_t> dones(envs.size());
+	for (size_t i=0; i<envs.size(); ++i)
+	    actions[i] = i % 2 ? 0 : 1 << 5;
+	envs.reset(observations.data());
+	const auto first = observations;
+
+	WHEN ("Every env steps until the first episodes end")
+	{
+	    std::vector<float> total(envs.size());
+	    for (int step=0; step<4; ++step) {
+		envs.step(actions.data(), rewards.data(), dones.data(), observations.data());
+		for (size_t i=0; i<envs.size(); ++i)
+		    total[i] += rewards[i];
+		if (step < 3)
+		    CHECK( std::count(dones.begin(), dones.end(), 1) == 0 );
+	    }
+
+	    THEN ("Scoring envs are rewarded, finish and start over")
+	    {
+		for (size_t i=0; i<envs.size(); ++i) {
+		    CHECK( dones[i] == (i % 2 ? 0 : 1) );
+		    CHECK( total[i] == (i % 2 ? 0.0f : 1.5f) );
+		}
+		CHECK( envs.episodes() == envs.size() + envs.size() / 2 );
+		CHECK( envs.env(0).get_memory(0x300) == 0 );
+		CHECK( std::equal(observations.begin(), observations.begin() + envs.observation_size(), first.begin()) );
+	    }
+
+	    THEN ("Observations are the displays")
+	    {
+		for (size_t i : {1, 129}) {
+		    Display display;
+		    std::memcpy(display.data(), &observations[i * envs.observation_size()], sizeof(display));
+		    CHECK( display == envs.env(i).snapshot().display );
+		}
+	    }
+	}
+
+	WHEN ("Nobody scores")
+	{
+	    std::fill(actions.begin(), actions.end(), 0);
+	    size_t finished = 0;
+	    for (int step=0; step<20; ++step) {
+		envs.step(actions.data(), rewards.data(), dones.data(), observations.data());
+		finished += std::count(dones.begin(), dones.end(), 1);
+	    }
+
+	    THEN ("Episodes end after max_frames")
+	    {
+		CHECK( finished == envs.size() );
+		CHECK( dones[0] == 1 );
+	    }
+	}
+
+	WHEN ("Observations are bytes")
+	{
+	    options.format = ObservationFormat::bytes;
+	    options.threads = 1;
+	    VectorEnv byte_envs(program.bytes, 3, options);
+	    std::vector<uint8_t> pixels(byte_envs.size() * byte_envs.observation_size());
+	    byte_envs.reset(pixels.data());
+	    byte_envs.step(actions.data(), rewards.data(), dones.data(), pixels.data());
+	    byte_envs.step(actions.data(), rewards.data(), dones.data(), pixels.data());
+
+	    THEN ("There is one per pixel")
+	    {
+		REQUIRE( byte_envs.observation_size() == 64*32 );
+		const auto& m = byte_envs.env(2);
+		size_t wrong = 0, lit = 0;
+		for (size_t y=0; y<32; ++y)
+		    for (size_t x=0; x<64; ++x) {
+			wrong += pixels[2*64*32 + y*64 + x] != m.get_display(x, y);
+			lit += m.get_display(x, y);
+		    }
+		CHECK( wrong == 0 );
+		CHECK( lit > 0 );
+	    }
+	}
+    }
+}
@@ -0,0 +1,179 @@
+#include "trace.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Chip8 {
+
+    namespace {
+	constexpr char magic[4] = {'C', '8', 'T', 'R'};
+	constexpr uint32_t version = 1;
+
+	// Records start on a cache line
+	constexpr size_t records_offset = 64;
+	static_assert(sizeof(TraceHeader) <= records_offset);
+
+	void* map_file(int fd, size_t size, int protection)
+	{
+	    void* data = mmap(nullptr, size, protection, MAP_SHARED, fd, 0);
+	    if (data == MAP_FAILED)
+		throw std::runtime_error(std::string("Could not map trace: ") + std::strerror(errno));
+	    return data;
+	}
+    }
+
+    Tracer::Tracer(const std::string& filename, size_t capacity)
+    {
+	if (capacity == 0)
+	    throw std::runtime_error("Trace needs room for at least one record");
+	// The header holds the capacity in 32 bits
+	if (capacity > UINT32_MAX)
+	    throw std::runtime_error("Trace capacity is limited to " + std::to_string(UINT32_MAX) + " records");
+
+	fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	    throw std::runtime_error("Could not create trace " + filename + ": " + std::strerror(errno));
+
+	mapped_size = records_offset + capacity * sizeof(TraceRecord);
+	if (ftruncate(fd, mapped_size) != 0) {
+	    close(fd);
+	    throw std::runtime_error("Could not size trace " + filename + ": " + std::strerror(errno));
+	}
+
+	auto* data = static_cast<uint8_t*>(map_file(fd, mapped_size, PROT_READ | PROT_WRITE));
+	header = reinterpret_cast<TraceHeader*>(data);
+	records = reinterpret_cast<TraceRecord*>(data + records_offset);
+
+	std::memcpy(header->magic, magic, sizeof(magic));
+	header->version = version;
+	header->record_size = sizeof(TraceRecord);
+	header->capacity = capacity;
+	header->next = 0;
+    }
+
+    Tracer::~Tracer()
+    {
+	munmap(header, mapped_size);
+	close(fd);
+    }
+
+    void Tracer::executed(const Chip8State& m, uint16_t pc, Instruction instruction)
+    {
+	const uint64_t cycle = header->next;
+	TraceRecord& record = records[cycle % header->capacity];
+
+	record.cycle = cycle;
+	record.pc = pc;
+	record.instruction = instruction;
+	record.I = m.get_I_register();
+	record.reg = TraceRecord::no_register;
+	record.value = 0;
+	record.vf = m.get_register(0xF);
+	record.write_addr = 0;
+	record.write_count = 0;
+
+	const uint8_t x = (instruction & 0x0F00) >> 8;
+	switch (decode(instruction)) {
+	    case Opcode::LDVxbyte: case Opcode::ADDVxbyte: case Opcode::LDVxVy:
+	    case Opcode::OR: case Opcode::AND: case Opcode::XOR: case Opcode::ADDVxVy:
+	    case Opcode::SUB: case Opcode::SHR: case Opcode::SUBN: case Opcode::SHL:
+	    case Opcode::RND: case Opcode::LDVxDT: case Opcode::LDVxI:
+		record.reg = x;
+		record.value = m.get_register(x);
+		break;
+	    case Opcode::LDBVx:
+		record.write_addr = m.get_I_register();
+		record.write_count = 3;
+		break;
+	    case Opcode::LDIVx:
+		record.write_addr = m.get_I_register();
+		record.write_count = x + 1;
+		break;
+	    default:
+		break;
+	}
+	for (size_t i=0; i<record.write_count; ++i)
+	    record.written[i] = m.get_memory((record.write_addr + i) & 0xFFF);
+
+	// Publish only after the record is complete
+	__atomic_store_n(&header->next, cycle + 1, __ATOMIC_RELEASE);
+    }
+
+
+    TraceFile::TraceFile(const std::string& filename)
+    {
+	const int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+	    throw std::runtime_error("Could not open trace " + filename + ": " + std::strerror(errno));
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < records_offset) {
+	    close(fd);
+	    throw std::runtime_error("Not a trace: " + filename);
+	}
+	mapped_size = info.st_size;
+	const auto* data = static_cast<const uint8_t*>(map_file(fd, mapped_size, PROT_READ));
+	close(fd);
+
+	header = reinterpret_cast<const TraceHeader*>(data);
+	records = reinterpret_cast<const TraceRecord*>(data + records_offset);
+
+	if (std::memcmp(header->magic, magic, sizeof(magic)) != 0 || header->version != version
+		|| header->record_size != sizeof(TraceRecord) || header->capacity == 0
+		|| mapped_size < records_offset + header->capacity * sizeof(TraceRecord)) {
+	    munmap(const_cast<uint8_t*>(data), mapped_size);
+	    throw std::runtime_error("Not a trace: " + filename);
+	}
+    }
+
+    TraceFile::~TraceFile()
+    {
+	munmap(const_cast<TraceHeader*>(header), mapped_size);
+    }
+
+    uint64_t TraceFile::first() const
+    {
+	const uint64_t next = end();
+	return next > header->capacity ? next - header->capacity : 0;
+    }
+
+
+    std::string format_record(const TraceRecord& record)
+    {
+	char line[256];
+	char text[32];
+	const size_t length = disassemble(record.instruction, text, sizeof(text)-1);
+	if (length == 0)
+	    std::snprintf(text, sizeof(text), "DB 0x%02X, 0x%02X", record.instruction >> 8, record.instruction & 0xFF);
+	else
+	    text[length] = '\0';
+
+	int n = std::snprintf(line, sizeof(line), "%llu 0x%03X %04X %-16s",
+		static_cast<unsigned long long>(record.cycle), record.pc, record.instruction, text);
+
+	if (record.reg != TraceRecord::no_register) {
+	    if (decode(record.instruction) == Opcode::LDVxI && record.reg > 0)
+		n += std::snprintf(line+n, sizeof(line)-n, " V0-V%X=[I]", record.reg);
+	    else
+		n += std::snprintf(line+n, sizeof(line)-n, " V%X=%02X", record.reg, record.value);
+	}
+
+	n += std::snprintf(line+n, sizeof(line)-n, " VF=%02X I=0x%03X", record.vf, record.I);
+
+	if (record.write_count > 0) {
+	    n += std::snprintf(line+n, sizeof(line)-n, " [0x%03X]=", record.write_addr);
+	    for (size_t i=0; i<record.write_count && i<record.written.size(); ++i)
+		n += std::snprintf(line+n, sizeof(line)-n, "%02X", record.written[i]);
+	}
+	return line;
+    }
+
+}
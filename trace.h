@@ -0,0 +1,86 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "chip8.h"
+
+namespace Chip8 {
+
+    // One executed instruction, as stored in a trace file
+    struct TraceRecord {
+	uint64_t cycle;
+	uint16_t pc;
+	uint16_t instruction;
+	// After the instruction
+	uint16_t I;
+	uint16_t write_addr;
+	// Vx the instruction wrote, no_register if none. For LD Vx, [I]
+	// every register up to Vx.
+	uint8_t reg;
+	uint8_t value;
+	uint8_t vf;
+	uint8_t write_count;
+	std::array<uint8_t,16> written;
+	uint8_t reserved[4];
+
+	static constexpr uint8_t no_register = 0xFF;
+    };
+    static_assert(sizeof(TraceRecord) == 40);
+
+    // Header of a trace file, followed by capacity records. Record i of
+    // the run is at slot i % capacity, next is the number written so far.
+    struct TraceHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t capacity;
+	uint64_t next;
+    };
+
+    // Writes every instruction executed through step() into a memory
+    // mapped ring buffer file. The kernel owns the pages, so the trace up
+    // to the last instruction survives a crash of the emulator.
+    class Tracer : public ExecutionObserver {
+	public:
+	    Tracer(const std::string& filename, size_t capacity=1<<20);
+	    ~Tracer();
+	    Tracer(const Tracer&) = delete;
+	    Tracer& operator=(const Tracer&) = delete;
+
+	    void executed(const Chip8State& m, uint16_t pc, Instruction instruction) override;
+
+	    uint64_t count() const { return header->next; }
+
+	private:
+	    TraceHeader* header = nullptr;
+	    TraceRecord* records = nullptr;
+	    size_t mapped_size = 0;
+	    int fd = -1;
+    };
+
+    // Read only view of a trace file, possibly of a running emulator
+    class TraceFile {
+	public:
+	    explicit TraceFile(const std::string& filename);
+	    ~TraceFile();
+	    TraceFile(const TraceFile&) = delete;
+	    TraceFile& operator=(const TraceFile&) = delete;
+
+	    // Cycles of the records still in the ring, [first, end)
+	    uint64_t first() const;
+	    uint64_t end() const { return header->next; }
+	    const TraceRecord& at(uint64_t cycle) const { return records[cycle % header->capacity]; }
+
+	private:
+	    const TraceHeader* header = nullptr;
+	    const TraceRecord* records = nullptr;
+	    size_t mapped_size = 0;
+    };
+
+    // One line of text, like "120 0x204 7001 ADD V0, 1  V0=05 VF=00 I=0x300"
+    std::string format_record(const TraceRecord& record);
+
+}
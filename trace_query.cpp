@@ -0,0 +1,88 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+#include "trace.h"
+#include "traceindex.h"
+
+using namespace Chip8;
+
+// Answers questions about a trace from Chip8App --trace through an index
+// kept next to it, which is rebuilt when the trace has moved on.
+
+static size_t parse_key(const std::string& text)
+{
+    if (text == "I")
+	return TraceKey::I;
+    if (text.size() == 2 && (text[0] == 'V' || text[0] == 'v'))
+	return TraceKey::reg(std::stoul(text.substr(1), nullptr, 16));
+    return TraceKey::address(std::stoul(text, nullptr, 0));
+}
+
+static void print_cycle(const TraceFile& trace, uint64_t cycle)
+{
+    if (cycle >= trace.first() && cycle < trace.end())
+	std::cout << format_record(trace.at(cycle)) << '\n';
+    else
+	std::cout << cycle << " (no longer in the trace)\n";
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+	std::cerr << "Usage: " << argv[0] << " <trace> index\n"
+		  << "       " << argv[0] << " <trace> last <V0-VF|I|address> <cycle>\n"
+		  << "       " << argv[0] << " <trace> changes <V0-VF|I|address> [from cycle] [limit]\n";
+	return 1;
+    }
+
+    const std::string trace_file = argv[1];
+    const std::string index_file = trace_file + ".idx";
+    const std::string command = argv[2];
+
+    try {
+	const TraceFile trace(trace_file);
+
+	bool rebuild = command == "index" || !std::filesystem::exists(index_file);
+	if (!rebuild) {
+	    const TraceIndex index(index_file);
+	    rebuild = index.end() != trace.end() || index.first() != trace.first();
+	}
+	if (rebuild) {
+	    const auto start = std::chrono::steady_clock::now();
+	    build_index(trace, index_file);
+	    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	    std::cerr << "Indexed " << trace.end() - trace.first() << " records in " << elapsed.count() << "s\n";
+	}
+	if (command == "index")
+	    return 0;
+
+	const TraceIndex index(index_file);
+	if (command == "last" && argc > 4) {
+	    const auto cycle = index.last_change_before(parse_key(argv[3]), std::stoull(argv[4]));
+	    if (!cycle) {
+		std::cout << "No change before cycle " << argv[4] << '\n';
+		return 1;
+	    }
+	    print_cycle(trace, *cycle);
+	} else if (command == "changes" && argc > 3) {
+	    const size_t key = parse_key(argv[3]);
+	    const uint64_t from = argc > 4 ? std::stoull(argv[4]) : 0;
+	    const uint64_t limit = argc > 5 ? std::stoull(argv[5]) : UINT64_MAX;
+
+	    const auto* it = std::lower_bound(index.begin_changes(key), index.end_changes(key), from);
+	    for (uint64_t n=0; it != index.end_changes(key) && n < limit; ++it, ++n)
+		print_cycle(trace, *it);
+	} else {
+	    std::cerr << "Unknown command " << command << '\n';
+	    return 1;
+	}
+    } catch (const std::exception& e) {
+	std::cerr << e.what() << '\n';
+	return 1;
+    }
+
+    return 0;
+}
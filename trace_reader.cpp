@@ -0,0 +1,34 @@
+#include <iostream>
+#include <string>
+
+#include "trace.h"
+
+using namespace Chip8;
+
+// Prints a trace written by Chip8App --trace as text, oldest first
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+	std::cerr << "Usage: " << argv[0] << " <trace> [--last count]\n";
+	return 1;
+    }
+
+    uint64_t last = UINT64_MAX;
+    if (argc > 3 && std::string(argv[2]) == "--last")
+	last = std::stoull(argv[3]);
+
+    try {
+	const TraceFile trace(argv[1]);
+	uint64_t first = trace.first();
+	if (trace.end() - first > last)
+	    first = trace.end() - last;
+
+	for (uint64_t cycle=first; cycle<trace.end(); ++cycle)
+	    std::cout << format_record(trace.at(cycle)) << '\n';
+    } catch (const std::exception& e) {
+	std::cerr << e.what() << '\n';
+	return 1;
+    }
+
+    return 0;
+}
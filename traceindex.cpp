@@ -0,0 +1,159 @@
+#include "traceindex.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Chip8 {
+
+    // File layout, all uint64: magic, version, first, end, then
+    // TraceKey::count+1 offsets into the cycles that follow.
+    namespace {
+	constexpr uint64_t magic = 0x31584449'38504843; // "CHP8IDX1"
+	constexpr uint64_t version = 1;
+	constexpr size_t header_words = 4;
+
+	// Calls fn(key, cycle) for every change in [first, end), in cycle order
+	template<typename Fn>
+	void for_each_change(const TraceFile& trace, uint64_t first, uint64_t end, Fn&& fn)
+	{
+	    std::optional<uint8_t> vf;
+	    std::optional<uint16_t> I;
+
+	    for (uint64_t cycle=first; cycle<end; ++cycle) {
+		const auto& record = trace.at(cycle);
+
+		if (record.reg != TraceRecord::no_register) {
+		    // LD Vx, [I] loads every register up to Vx
+		    const uint8_t low = decode(record.instruction) == Opcode::LDVxI ? 0 : record.reg;
+		    for (uint8_t x=low; x<=record.reg && x<0xF; ++x)
+			fn(TraceKey::reg(x), cycle);
+		}
+		if ((vf && *vf != record.vf) || record.reg == 0xF)
+		    fn(TraceKey::reg(0xF), cycle);
+		if (I && *I != record.I)
+		    fn(TraceKey::I, cycle);
+		for (size_t i=0; i<record.write_count; ++i)
+		    fn(TraceKey::address(record.write_addr + i), cycle);
+
+		vf = record.vf;
+		I = record.I;
+	    }
+	}
+    }
+
+    void build_index(const TraceFile& trace, const std::string& filename)
+    {
+	// The trace may still be growing, both passes must see the same records
+	const uint64_t first = trace.first();
+	const uint64_t end = trace.end();
+
+	std::vector<uint64_t> offsets(TraceKey::count + 1, 0);
+	for_each_change(trace, first, end, [&](size_t key, uint64_t) { offsets[key+1]++; });
+	for (size_t key=0; key<TraceKey::count; ++key)
+	    offsets[key+1] += offsets[key];
+
+	const size_t words = header_words + offsets.size() + offsets.back();
+	const size_t size = words * sizeof(uint64_t);
+
+	const int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	    throw std::runtime_error("Could not create index " + filename + ": " + std::strerror(errno));
+	if (ftruncate(fd, size) != 0) {
+	    close(fd);
+	    throw std::runtime_error("Could not size index " + filename + ": " + std::strerror(errno));
+	}
+	void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	    throw std::runtime_error("Could not map index " + filename + ": " + std::strerror(errno));
+
+	auto* out = static_cast<uint64_t*>(data);
+	std::copy(offsets.begin(), offsets.end(), out + header_words);
+	uint64_t* cycles = out + header_words + offsets.size();
+
+	// Reuse the offsets as the next free slot of every key
+	for_each_change(trace, first, end, [&](size_t key, uint64_t cycle) { cycles[offsets[key]++] = cycle; });
+
+	out[1] = version;
+	out[2] = first;
+	out[3] = end;
+	// Last, so a partially written index is never valid
+	out[0] = magic;
+	munmap(data, size);
+    }
+
+
+    TraceIndex::TraceIndex(const std::string& filename)
+    {
+	const int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+	    throw std::runtime_error("Could not open index " + filename + ": " + std::strerror(errno));
+
+	struct stat info;
+	const size_t minimum = (header_words + TraceKey::count + 1) * sizeof(uint64_t);
+	if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < minimum) {
+	    close(fd);
+	    throw std::runtime_error("Not a trace index: " + filename);
+	}
+	mapped_size = info.st_size;
+	void* data = mmap(nullptr, mapped_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	    throw std::runtime_error("Could not map index " + filename + ": " + std::strerror(errno));
+
+	header = static_cast<const uint64_t*>(data);
+	offsets = header + header_words;
+	cycles = offsets + TraceKey::count + 1;
+
+	const size_t available = mapped_size / sizeof(uint64_t) - (header_words + TraceKey::count + 1);
+	if (header[0] != magic || header[1] != version || offsets[TraceKey::count] > available) {
+	    munmap(data, mapped_size);
+	    throw std::runtime_error("Not a trace index: " + filename);
+	}
+    }
+
+    TraceIndex::~TraceIndex()
+    {
+	munmap(const_cast<uint64_t*>(header), mapped_size);
+    }
+
+    uint64_t TraceIndex::first() const { return header[2]; }
+    uint64_t TraceIndex::end() const { return header[3]; }
+
+    const uint64_t* TraceIndex::begin_changes(size_t key) const
+    {
+	return cycles + offsets[std::min(key, TraceKey::count)];
+    }
+
+    const uint64_t* TraceIndex::end_changes(size_t key) const
+    {
+	return cycles + offsets[std::min(key + 1, TraceKey::count)];
+    }
+
+    std::optional<uint64_t> TraceIndex::last_change_before(size_t key, uint64_t cycle) const
+    {
+	const auto* begin = begin_changes(key);
+	const auto* it = std::lower_bound(begin, end_changes(key), cycle);
+	if (it == begin)
+	    return std::nullopt;
+	return *(it - 1);
+    }
+
+    std::optional<uint64_t> TraceIndex::first_change_from(size_t key, uint64_t cycle) const
+    {
+	const auto* end = end_changes(key);
+	const auto* it = std::lower_bound(begin_changes(key), end, cycle);
+	if (it == end)
+	    return std::nullopt;
+	return *it;
+    }
+
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include "trace.h"
+
+namespace Chip8 {
+
+    // What an index entry is about: V0-VF, I, or a memory address
+    struct TraceKey {
+	static constexpr size_t I = 16;
+	static constexpr size_t memory = 17;
+	static constexpr size_t count = memory + 0x1000;
+
+	static size_t reg(uint8_t x) { return x; }
+	static size_t address(uint16_t addr) { return memory + (addr & 0xFFF); }
+    };
+
+    // Writes an index of every cycle that changed each key, grouped by key
+    // and sorted, so queries are a binary search in a memory mapped file.
+    // Registers count as changed when written, VF and I when their value
+    // differs from the previous record.
+    void build_index(const TraceFile& trace, const std::string& filename);
+
+    class TraceIndex {
+	public:
+	    explicit TraceIndex(const std::string& filename);
+	    ~TraceIndex();
+	    TraceIndex(const TraceIndex&) = delete;
+	    TraceIndex& operator=(const TraceIndex&) = delete;
+
+	    // Cycles of the trace the index was built from, [first, end)
+	    uint64_t first() const;
+	    uint64_t end() const;
+
+	    // The cycles that changed key, ascending
+	    const uint64_t* begin_changes(size_t key) const;
+	    const uint64_t* end_changes(size_t key) const;
+	    size_t change_count(size_t key) const { return end_changes(key) - begin_changes(key); }
+
+	    // Last change to key strictly before cycle
+	    std::optional<uint64_t> last_change_before(size_t key, uint64_t cycle) const;
+	    // First change to key at or after cycle
+	    std::optional<uint64_t> first_change_from(size_t key, uint64_t cycle) const;
+
+	private:
+	    const uint64_t* header = nullptr;
+	    const uint64_t* offsets = nullptr;
+	    const uint64_t* cycles = nullptr;
+	    size_t mapped_size = 0;
+    };
+
+}
@@ -0,0 +1,299 @@
+#include "undo.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "chip8.h"
+
+namespace Chip8 {
+
+    // Record layout: size (2), kind (1), payload, size (2). The size at
+    // both ends lets the ring be walked from the oldest and the newest.
+    namespace {
+	enum Kind : uint8_t { instruction_record, timers_record, keyboard_record };
+
+	// Payload of CLS, the largest record: kind, instruction, pc, row mask, rows
+	constexpr size_t max_record = 1 + 2 + 2 + 4 + 32*8;
+    }
+
+    UndoLog::UndoLog(size_t budget)
+    {
+	size_t capacity = 1024;
+	while (capacity < budget)
+	    capacity *= 2;
+	buffer.resize(capacity);
+	mask = capacity - 1;
+    }
+
+    namespace {
+	// A record being built on the stack, payload only
+	struct Record {
+	    uint8_t data[max_record];
+	    size_t size = 0;
+
+	    void byte(uint8_t value) { data[size++] = value; }
+	    void bytes(const void* from, size_t n) { std::memcpy(data + size, from, n); size += n; }
+	};
+    }
+
+    void UndoLog::put_bytes(const void* data, size_t size)
+    {
+	const auto* bytes = static_cast<const uint8_t*>(data);
+	for (size_t i=0; i<size; ++i)
+	    put_byte(bytes[i]);
+    }
+
+    void UndoLog::drop_oldest()
+    {
+	const size_t size = byte_at(head) | byte_at(head+1) << 8;
+	head += size;
+	used -= size;
+	count--;
+    }
+
+    void UndoLog::append(const uint8_t* payload, size_t payload_size)
+    {
+	const size_t size = payload_size + 4;
+	while (buffer.size() - used < size)
+	    drop_oldest();
+
+	const uint8_t size_bytes[2] = {static_cast<uint8_t>(size), static_cast<uint8_t>(size >> 8)};
+	const size_t index = tail & mask;
+	if (index + size <= buffer.size()) {
+	    uint8_t* out = &buffer[index];
+	    out[0] = out[size-2] = size_bytes[0];
+	    out[1] = out[size-1] = size_bytes[1];
+	    std::memcpy(out + 2, payload, payload_size);
+	    tail += size;
+	} else {
+	    put_bytes(size_bytes, 2);
+	    put_bytes(payload, payload_size);
+	    put_bytes(size_bytes, 2);
+	}
+	used += size;
+	count++;
+    }
+
+    void UndoLog::record_instruction(const MachineState& m, Instruction instruction)
+    {
+	Record r;
+	r.byte(instruction_record);
+	r.bytes(&instruction, sizeof(instruction));
+	r.bytes(&m.program_counter, sizeof(m.program_counter));
+
+	const uint8_t x = (instruction & 0x0F00) >> 8;
+	const uint16_t I = m.I_register;
+	switch (decode(instruction)) {
+	    case Opcode::LDVxbyte: case Opcode::ADDVxbyte: case Opcode::LDVxVy:
+	    case Opcode::OR: case Opcode::AND: case Opcode::XOR: case Opcode::LDVxDT:
+		r.byte(m.registers[x]);
+		break;
+	    case Opcode::ADDVxVy: case Opcode::SUB: case Opcode::SHR: case Opcode::SUBN: case Opcode::SHL:
+		r.byte(m.registers[x]);
+		r.byte(m.registers[0xF]);
+		break;
+	    case Opcode::RND:
+		r.byte(m.registers[x]);
+		r.bytes(&m.rng.state, sizeof(m.rng.state));
+		break;
+	    case Opcode::DRW: {
+		const uint8_t y = m.registers[(instruction & 0x00F0) >> 4] % Chip8State::display_height;
+		const uint8_t rows = std::min<size_t>(instruction & 0x000F, Chip8State::display_height - y);
+		r.byte(m.registers[0xF]);
+		r.byte(y);
+		r.byte(rows);
+		r.bytes(&m.display[y], rows * sizeof(uint64_t));
+		break;
+	    }
+	    case Opcode::CLS: {
+		uint32_t nonzero = 0;
+		for (size_t row=0; row<m.display.size(); ++row)
+		    nonzero |= (m.display[row] != 0) << row;
+		r.bytes(&nonzero, sizeof(nonzero));
+		for (size_t row=0; row<m.display.size(); ++row)
+		    if (m.display[row] != 0)
+			r.bytes(&m.display[row], sizeof(uint64_t));
+		break;
+	    }
+	    case Opcode::LDIaddr: case Opcode::ADDIVx: case Opcode::LDFVx:
+		r.bytes(&I, sizeof(I));
+		break;
+	    case Opcode::CALL:
+		r.byte(m.stack_pointer);
+		r.bytes(&m.stack[(m.stack_pointer+1) & 0xF], sizeof(uint16_t));
+		break;
+	    case Opcode::RET:
+		r.byte(m.stack_pointer);
+		break;
+	    case Opcode::LDVxK:
+		r.byte(m.waiting);
+		break;
+	    case Opcode::LDDTVx:
+		r.byte(m.delay_register);
+		break;
+	    case Opcode::LDSTVx:
+		r.byte(m.sound_register);
+		break;
+	    case Opcode::LDBVx:
+		for (uint16_t i=0; i<3; ++i)
+		    r.byte(m.memory[(I+i) & 0xFFF]);
+		break;
+	    case Opcode::LDIVx:
+		for (uint16_t i=0; i<=x; ++i)
+		    r.byte(m.memory[(I+i) & 0xFFF]);
+		break;
+	    case Opcode::LDVxI:
+		r.bytes(m.registers.data(), x + 1);
+		break;
+	    default:
+		break;
+	}
+	append(r.data, r.size);
+    }
+
+    void UndoLog::record_timers(const MachineState& m)
+    {
+	const uint8_t payload[] = {timers_record, m.delay_register, m.sound_register};
+	append(payload, sizeof(payload));
+    }
+
+    void UndoLog::record_keyboard(const MachineState& m)
+    {
+	uint16_t keys = 0;
+	for (size_t key=0; key<m.keyboard.size(); ++key)
+	    keys |= m.keyboard[key] << key;
+	const uint8_t payload[] = {keyboard_record, static_cast<uint8_t>(keys), static_cast<uint8_t>(keys >> 8), m.waiting};
+	append(payload, sizeof(payload));
+    }
+
+    bool UndoLog::undo(Chip8State& machine)
+    {
+	if (count == 0)
+	    return false;
+
+	MachineState& m = machine;
+	const size_t size = byte_at(tail-2) | byte_at(tail-1) << 8;
+	size_t pos = tail - size + 2;
+
+	auto get8 = [&] { return byte_at(pos++); };
+	auto get = [&](void* data, size_t n) {
+	    auto* bytes = static_cast<uint8_t*>(data);
+	    for (size_t i=0; i<n; ++i)
+		bytes[i] = get8();
+	};
+
+	switch (get8()) {
+	    case instruction_record: {
+		Instruction instruction;
+		get(&instruction, sizeof(instruction));
+		get(&m.program_counter, sizeof(m.program_counter));
+
+		const uint8_t x = (instruction & 0x0F00) >> 8;
+		switch (decode(instruction)) {
+		    case Opcode::LDVxbyte: case Opcode::ADDVxbyte: case Opcode::LDVxVy:
+		    case Opcode::OR: case Opcode::AND: case Opcode::XOR: case Opcode::LDVxDT:
+			m.registers[x] = get8();
+			break;
+		    case Opcode::ADDVxVy: case Opcode::SUB: case Opcode::SHR: case Opcode::SUBN: case Opcode::SHL:
+			// VF last, x may be F
+			m.registers[x] = get8();
+			m.registers[0xF] = get8();
+			break;
+		    case Opcode::RND:
+			m.registers[x] = get8();
+			get(&m.rng.state, sizeof(m.rng.state));
+			break;
+		    case Opcode::DRW: {
+			m.registers[0xF] = get8();
+			const uint8_t y = get8();
+			const uint8_t rows = get8();
+			for (uint8_t i=0; i<rows; ++i) {
+			    uint64_t row;
+			    get(&row, sizeof(row));
+			    machine.write_row(y+i, row);
+			}
+			break;
+		    }
+		    case Opcode::CLS: {
+			uint32_t nonzero;
+			get(&nonzero, sizeof(nonzero));
+			for (size_t row=0; row<m.display.size(); ++row) {
+			    if ((nonzero >> row) & 1) {
+				uint64_t value;
+				get(&value, sizeof(value));
+				machine.write_row(row, value);
+			    }
+			}
+			break;
+		    }
+		    case Opcode::LDIaddr: case Opcode::ADDIVx: case Opcode::LDFVx:
+			get(&m.I_register, sizeof(m.I_register));
+			break;
+		    case Opcode::CALL:
+			m.stack_pointer = get8();
+			get(&m.stack[(m.stack_pointer+1) & 0xF], sizeof(uint16_t));
+			break;
+		    case Opcode::RET:
+			m.stack_pointer = get8();
+			break;
+		    case Opcode::LDVxK:
+			m.waiting = get8();
+			break;
+		    case Opcode::LDDTVx:
+			m.delay_register = get8();
+			break;
+		    case Opcode::LDSTVx:
+			m.sound_register = get8();
+			break;
+		    case Opcode::LDBVx:
+			for (uint16_t i=0; i<3; ++i)
+			    machine.set_memory((m.I_register+i) & 0xFFF, get8());
+			break;
+		    case Opcode::LDIVx:
+			for (uint16_t i=0; i<=x; ++i)
+			    machine.set_memory((m.I_register+i) & 0xFFF, get8());
+			break;
+		    case Opcode::LDVxI:
+			get(m.registers.data(), x + 1);
+			break;
+		    default:
+			break;
+		}
+		break;
+	    }
+	    case timers_record:
+		m.delay_register = get8();
+		m.sound_register = get8();
+		break;
+	    case keyboard_record: {
+		uint16_t keys;
+		get(&keys, sizeof(keys));
+		for (size_t key=0; key<m.keyboard.size(); ++key)
+		    m.keyboard[key] = (keys >> key) & 1;
+		m.waiting = get8();
+		break;
+	    }
+	    default:
+		throw std::runtime_error("Corrupt undo log");
+	}
+
+	tail -= size;
+	used -= size;
+	count--;
+	return true;
+    }
+
+    bool UndoLog::step_back(Chip8State& m)
+    {
+	while (count > 0) {
+	    const size_t size = byte_at(tail-2) | byte_at(tail-1) << 8;
+	    const bool instruction = byte_at(tail - size + 2) == instruction_record;
+	    undo(m);
+	    if (instruction)
+		return true;
+	}
+	return false;
+    }
+
+}
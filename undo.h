@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "decode.h"
+#include "machine.h"
+
+namespace Chip8 {
+
+    class Chip8State;
+
+    // Undo records of the most recent instructions, timer ticks and key
+    // changes, so a debugger can step the machine backwards. Each record
+    // holds only the pre-image of what its instruction changes, a few bytes
+    // for most of them. Records live in a ring of budget bytes, the oldest
+    // are dropped to make room.
+    class UndoLog {
+	public:
+	    // budget is rounded up to a power of two
+	    explicit UndoLog(size_t budget=1<<20);
+
+	    // Called by Chip8State before it changes anything
+	    void record_instruction(const MachineState& m, Instruction instruction);
+	    void record_timers(const MachineState& m);
+	    void record_keyboard(const MachineState& m);
+
+	    // Undoes the newest record, false if there is none
+	    bool undo(Chip8State& m);
+	    // Undoes records up to and including the newest instruction,
+	    // false if there is none
+	    bool step_back(Chip8State& m);
+
+	    size_t records() const { return count; }
+	    size_t bytes_used() const { return used; }
+	    void clear() { head = tail = used = count = 0; }
+
+	private:
+	    // Adds size fields around the payload, dropping old records for room
+	    void append(const uint8_t* payload, size_t payload_size);
+	    void put_byte(uint8_t value) { buffer[tail++ & mask] = value; }
+	    void put_bytes(const void* data, size_t size);
+	    uint8_t byte_at(size_t pos) const { return buffer[pos & mask]; }
+	    void drop_oldest();
+
+	    std::vector<uint8_t> buffer;
+	    size_t mask;
+	    // Monotonic positions, buffer index is pos & mask
+	    size_t head = 0;
+	    size_t tail = 0;
+	    size_t used = 0;
+	    size_t count = 0;
+    };
+
+}
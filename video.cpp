@@ -0,0 +1,335 @@
+#include "video.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+namespace Chip8 {
+
+    namespace {
+	constexpr size_t width = 64;
+	constexpr size_t height = 32;
+
+	bool pixel(const Display& display, size_t x, size_t y)
+	{
+	    return (display[y] >> (width-1-x)) & 1;
+	}
+
+	std::ofstream open(const std::string& filename)
+	{
+	    std::ofstream out(filename, std::ios::binary);
+	    if (!out)
+		throw std::runtime_error("Could not open " + filename);
+	    return out;
+	}
+
+	// 4:2:0 with limited range luma, the format players take without
+	// complaint. Unchanged displays are written again, y4m has no
+	// durations.
+	class Y4mEncoder : public VideoEncoder {
+	    public:
+		Y4mEncoder(const std::string& filename, unsigned int scale)
+		    : out{open(filename)}, scale{scale}
+		{
+		    out << "YUV4MPEG2 W" << width*scale << " H" << height*scale << " F60:1 Ip A1:1 C420jpeg\n";
+		}
+
+		void write(const Display& display, uint32_t frames) override
+		{
+		    const size_t w = width*scale, h = height*scale;
+		    frame.assign(w*h + 2*((w+1)/2)*((h+1)/2), 128);
+		    for (size_t y=0; y<h; ++y)
+			for (size_t x=0; x<w; ++x)
+			    frame[y*w + x] = pixel(display, x/scale, y/scale) ? 235 : 16;
+		    for (uint32_t i=0; i<frames; ++i) {
+			out << "FRAME\n";
+			out.write(reinterpret_cast<const char*>(frame.data()), frame.size());
+		    }
+		    if (!out)
+			throw std::runtime_error("Could not write video");
+		}
+
+	    private:
+		std::ofstream out;
+		unsigned int scale;
+		std::vector<uint8_t> frame;
+	};
+
+	// Binary PBM per display, <stem>_<first frame>.pbm
+	class PbmEncoder : public VideoEncoder {
+	    public:
+		PbmEncoder(const std::string& filename, unsigned int scale)
+		    : stem{filename.substr(0, filename.size() - 4)}, scale{scale}
+		{
+		}
+
+		void write(const Display& display, uint32_t frames) override
+		{
+		    std::ostringstream name;
+		    name << stem << '_' << std::setw(6) << std::setfill('0') << frame << ".pbm";
+		    auto out = open(name.str());
+		    const size_t w = width*scale, h = height*scale;
+		    out << "P4\n# frames " << frames << '\n' << w << ' ' << h << '\n';
+		    std::vector<uint8_t> row((w + 7) / 8);
+		    for (size_t y=0; y<h; ++y) {
+			std::fill(row.begin(), row.end(), 0);
+			for (size_t x=0; x<w; ++x)
+			    row[x/8] |= pixel(display, x/scale, y/scale) << (7 - x%8);
+			out.write(reinterpret_cast<const char*>(row.data()), row.size());
+		    }
+		    if (!out)
+			throw std::runtime_error("Could not write " + name.str());
+		    frame += frames;
+		}
+
+	    private:
+		std::string stem;
+		unsigned int scale;
+		uint64_t frame = 0;
+	};
+
+	class GifEncoder : public VideoEncoder {
+	    public:
+		GifEncoder(const std::string& filename, unsigned int scale)
+		    : out{open(filename)}, scale{scale}, table(4096)
+		{
+		    out << "GIF89a";
+		    put16(width*scale);
+		    put16(height*scale);
+		    // Global table of two colours, black and white
+		    const uint8_t screen[] = {0x80, 0, 0, 0, 0, 0, 255, 255, 255};
+		    out.write(reinterpret_cast<const char*>(screen), sizeof(screen));
+		    // Loop forever
+		    const uint8_t loop[] = {0x21, 0xFF, 11, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 3, 1, 0, 0, 0};
+		    out.write(reinterpret_cast<const char*>(loop), sizeof(loop));
+		}
+
+		void write(const Display& display, uint32_t frames) override
+		{
+		    // Delays are in hundredths, keep the total exact
+		    elapsed += frames;
+		    const uint64_t delay = elapsed * 100 / 60 - written;
+		    written += delay;
+
+		    const uint8_t control[] = {0x21, 0xF9, 4, 0};
+		    out.write(reinterpret_cast<const char*>(control), sizeof(control));
+		    put16(std::min<uint64_t>(delay, 0xFFFF));
+		    out.put(0);
+		    out.put(0);
+
+		    out.put(0x2C);
+		    put16(0);
+		    put16(0);
+		    put16(width*scale);
+		    put16(height*scale);
+		    out.put(0);
+
+		    compress(display);
+		    out.put(min_code_size);
+		    for (size_t i=0; i<data.size(); i+=255) {
+			const size_t n = std::min<size_t>(255, data.size() - i);
+			out.put(n);
+			out.write(reinterpret_cast<const char*>(&data[i]), n);
+		    }
+		    out.put(0);
+		    if (!out)
+			throw std::runtime_error("Could not write video");
+		}
+
+		void finish() override
+		{
+		    out.put(0x3B);
+		    out.flush();
+		}
+
+	    private:
+		static constexpr unsigned int min_code_size = 2;
+		static constexpr uint16_t clear_code = 1 << min_code_size;
+		static constexpr uint16_t end_code = clear_code + 1;
+
+		void put16(uint16_t value)
+		{
+		    out.put(value & 0xFF);
+		    out.put(value >> 8);
+		}
+
+		void put_code(uint16_t code)
+		{
+		    bits |= static_cast<uint32_t>(code) << bit_count;
+		    bit_count += code_size;
+		    while (bit_count >= 8) {
+			data.push_back(bits);
+			bits >>= 8;
+			bit_count -= 8;
+		    }
+		}
+
+		void reset_table()
+		{
+		    std::fill(table.begin(), table.end(), std::array<uint16_t,4>{});
+		    code_size = min_code_size + 1;
+		    next_code = end_code + 1;
+		}
+
+		// LZW, codes grow up to 12 bits, then the table starts over
+		void compress(const Display& display)
+		{
+		    data.clear();
+		    bits = bit_count = 0;
+		    reset_table();
+		    put_code(clear_code);
+
+		    const size_t w = width*scale, h = height*scale;
+		    uint16_t prefix = pixel(display, 0, 0);
+		    for (size_t i=1; i<w*h; ++i) {
+			const uint8_t k = pixel(display, i%w/scale, i/w/scale);
+			auto& next = table[prefix][k];
+			if (next != 0) {
+			    prefix = next;
+			    continue;
+			}
+			put_code(prefix);
+			if (next_code == 4096) {
+			    put_code(clear_code);
+			    reset_table();
+			} else {
+			    next = next_code++;
+			    if (next == 1u << code_size && code_size < 12)
+				code_size++;
+			}
+			prefix = k;
+		    }
+		    put_code(prefix);
+		    put_code(end_code);
+		    if (bit_count > 0)
+			data.push_back(bits);
+		}
+
+		std::ofstream out;
+		unsigned int scale;
+		uint64_t elapsed = 0;
+		uint64_t written = 0;
+
+		// Code of prefix followed by a pixel, 0 if not in the table yet
+		std::vector<std::array<uint16_t,4>> table;
+		unsigned int code_size = min_code_size + 1;
+		uint16_t next_code = end_code + 1;
+		std::vector<uint8_t> data;
+		uint32_t bits = 0;
+		unsigned int bit_count = 0;
+	};
+
+	bool ends_with(const std::string& s, const std::string& suffix)
+	{
+	    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+	}
+    }
+
+    std::unique_ptr<VideoEncoder> make_video_encoder(const std::string& filename, unsigned int scale)
+    {
+	if (scale == 0 || scale > 64)
+	    throw std::runtime_error("Video scale must be between 1 and 64");
+	if (ends_with(filename, ".y4m"))
+	    return std::make_unique<Y4mEncoder>(filename, scale);
+	if (ends_with(filename, ".gif"))
+	    return std::make_unique<GifEncoder>(filename, scale);
+	if (ends_with(filename, ".pbm"))
+	    return std::make_unique<PbmEncoder>(filename, scale);
+	throw std::runtime_error("Unknown video format: " + filename + ", use .y4m, .gif or .pbm");
+    }
+
+
+    VideoRecorder::VideoRecorder(std::unique_ptr<VideoEncoder> encoder, bool wait_when_full, size_t queue_size)
+	: encoder{std::move(encoder)}, wait_when_full{wait_when_full}, queue{queue_size}
+    {
+	worker = std::thread([this] { encode(); });
+    }
+
+    VideoRecorder::~VideoRecorder()
+    {
+	try {
+	    finish();
+	} catch (const std::exception&) {
+	}
+    }
+
+    bool VideoRecorder::offer(const Entry& entry)
+    {
+	if (failed)
+	    return true;
+	while (!queue.try_push(entry)) {
+	    if (!wait_when_full || failed)
+		return false;
+	    std::this_thread::yield();
+	}
+	return true;
+    }
+
+    void VideoRecorder::push(const Display& display)
+    {
+	frame_count++;
+	if (pending.frames > 0 && display == pending.display) {
+	    pending.frames++;
+	    return;
+	}
+	if (pending.frames > 0 && !offer(pending)) {
+	    pending.frames++;
+	    dropped_count++;
+	    return;
+	}
+	pending = {display, 1};
+    }
+
+    void VideoRecorder::encode()
+    {
+	Entry entry;
+	while (true) {
+	    // done is read before the queue is, so nothing pushed before
+	    // done was set is missed
+	    const bool last = done;
+	    if (!queue.try_pop(entry)) {
+		if (last)
+		    break;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		continue;
+	    }
+	    if (failed)
+		continue;
+	    try {
+		encoder->write(entry.display, entry.frames);
+	    } catch (...) {
+		error = std::current_exception();
+		failed = true;
+	    }
+	}
+    }
+
+    void VideoRecorder::finish()
+    {
+	if (!worker.joinable())
+	    return;
+	if (pending.frames > 0) {
+	    wait_when_full = true;
+	    offer(pending);
+	    pending.frames = 0;
+	}
+	done = true;
+	worker.join();
+
+	if (!failed) {
+	    try {
+		encoder->finish();
+	    } catch (...) {
+		error = std::current_exception();
+	    }
+	}
+	if (error)
+	    std::rethrow_exception(error);
+    }
+
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "machine.h"
+#include "parallel.h"
+
+namespace Chip8 {
+
+    // Gets each distinct display in order, with the number of 60 Hz frames
+    // it stayed on screen
+    class VideoEncoder {
+	public:
+	    virtual ~VideoEncoder() = default;
+	    virtual void write(const Display& display, uint32_t frames) = 0;
+	    // After the last display
+	    virtual void finish() {}
+    };
+
+    // Picked by the extension of filename: .y4m, .gif, or .pbm for one
+    // image per distinct display, numbered by its first frame. Every pixel
+    // becomes scale by scale pixels. Throws if the file can not be opened.
+    std::unique_ptr<VideoEncoder> make_video_encoder(const std::string& filename, unsigned int scale=8);
+
+    // Hands the displays to an encoder on a background thread. push()
+    // compares and copies one display, it never waits for the encoder
+    // unless wait_when_full is set.
+    class VideoRecorder {
+	public:
+	    explicit VideoRecorder(std::unique_ptr<VideoEncoder> encoder, bool wait_when_full=false, size_t queue_size=1024);
+	    // Finishes, dropping any error
+	    ~VideoRecorder();
+	    VideoRecorder(const VideoRecorder&) = delete;
+	    VideoRecorder& operator=(const VideoRecorder&) = delete;
+
+	    // The display of one frame
+	    void push(const Display& display);
+	    // Waits until everything is encoded. Rethrows what the encoder threw.
+	    void finish();
+
+	    uint64_t frames() const { return frame_count; }
+	    // Displays lost to a full queue, the display before them is held
+	    // for their frames instead
+	    uint64_t dropped() const { return dropped_count; }
+
+	private:
+	    struct Entry {
+		Display display;
+		uint32_t frames;
+	    };
+
+	    bool offer(const Entry& entry);
+	    void encode();
+
+	    std::unique_ptr<VideoEncoder> encoder;
+	    bool wait_when_full;
+	    SpscQueue<Entry> queue;
+	    Entry pending{};
+	    uint64_t frame_count = 0;
+	    uint64_t dropped_count = 0;
+
+	    std::atomic<bool> done{false};
+	    std::atomic<bool> failed{false};
+	    std::exception_ptr error;
+	    std::thread worker;
+    };
+
+}